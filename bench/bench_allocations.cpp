@@ -0,0 +1,73 @@
+// Count heap allocations made by SliceBuilder::insert on synthetic traces, by replacing the global allocation
+// functions. Pools and storages allocate in big blocks, so anything close to one allocation per access is a regression.
+//
+// Usage: bench_allocations [access_count]
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "slice.h"
+#include "trace_generators.h"
+
+namespace {
+std::atomic<std::size_t> allocation_count{0};
+std::atomic<std::size_t> allocated_bytes{0};
+}
+
+void* operator new(std::size_t size)
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+using namespace reven::backend::memaccess::db;
+
+static void run(const char* trace_name, const std::vector<bench::Access>& trace)
+{
+	SliceBuilder b;
+	b.chunk_size_overlap_limit(100000).chunk_size_touch_limit(1000);
+
+	auto count_before = allocation_count.load();
+	auto bytes_before = allocated_bytes.load();
+	for (const auto& a : trace) {
+		if (not b.insert(a.transition, a.address, a.size)) {
+			std::cerr << "Unexpected refusal" << std::endl;
+			std::exit(1);
+		}
+	}
+	auto count = allocation_count.load() - count_before;
+	auto bytes = allocated_bytes.load() - bytes_before;
+
+	std::cout << std::setw(8) << trace_name << std::fixed << std::setprecision(4)
+	          << "  allocations: " << std::setw(9) << count
+	          << " (" << std::setw(7) << static_cast<double>(count) / trace.size() << " per access)"
+	          << std::setprecision(1)
+	          << "  bytes: " << std::setw(7) << static_cast<double>(bytes) / trace.size() << " per access" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t count = argc > 1 ? std::stoull(argv[1]) : 1000000;
+
+	for (const auto& trace : bench::all_traces(count))
+		run(trace.first, trace.second);
+	return 0;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace bench {
+
+class Timer
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	Timer() : start_(Clock::now()) {}
+
+	// Seconds since construction or the previous `lap`
+	double lap()
+	{
+		auto now = Clock::now();
+		auto elapsed = std::chrono::duration<double>(now - start_).count();
+		start_ = now;
+		return elapsed;
+	}
+
+private:
+	Clock::time_point start_;
+};
+
+// Read a "<key>: <value> kB" line of /proc/self/status, in bytes. Return 0 if unavailable.
+inline std::uint64_t proc_status_bytes(const char* key)
+{
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	std::string prefix = std::string(key) + ":";
+	while (std::getline(status, line)) {
+		if (line.compare(0, prefix.size(), prefix) == 0)
+			return std::stoull(line.substr(prefix.size())) * 1024;
+	}
+	return 0;
+}
+
+inline std::uint64_t current_rss() { return proc_status_bytes("VmRSS"); }
+
+inline std::uint64_t peak_rss() { return proc_status_bytes("VmHWM"); }
+
+// Run `f` in a child process, so that each run starts with a clean heap and its peak RSS is its own. Inputs built by
+// the parent before calling this are shared with the child: subtract `current_rss()` taken at the start of `f` from
+// the peak to ignore them.
+template <typename F>
+void run_isolated(F f)
+{
+	std::cout.flush();
+	auto pid = fork();
+	if (pid < 0) {
+		std::cerr << "fork failed" << std::endl;
+		std::exit(1);
+	}
+
+	if (pid == 0) {
+		f();
+		std::cout.flush();
+		_exit(0);
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	if (not WIFEXITED(status) or WEXITSTATUS(status) != 0) {
+		std::cerr << "benchmark run failed" << std::endl;
+		std::exit(1);
+	}
+}
+
+inline double mib(std::uint64_t bytes) { return static_cast<double>(bytes) / (1024 * 1024); }
+
+} // namespace bench
@@ -0,0 +1,255 @@
+// Measure half-axis queries on a database written by DbWriter: the SQL queries of the README's pseudo-code, run as is,
+// against DbReader with and without its chunk cache, on the default and the compact schemas.
+// Queries look for the next or previous 10 accesses touching a small range around an address of the trace, from a
+// random transition. Also report the time taken to open the DbReader, and the memory used by its index.
+//
+// Usage: bench_db_reader [access_count] [query_count] [trace_name]
+// Without trace_name, all traces are run.
+
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <db_reader.h>
+#include <db_writer.h>
+
+#include "bench_common.h"
+#include "trace_generators.h"
+
+using namespace reven::backend::memaccess::db;
+using reven::sqlite::Statement;
+
+static std::vector<MemoryAccess> to_memory_accesses(const std::vector<bench::Access>& trace)
+{
+	std::vector<MemoryAccess> accesses;
+	accesses.reserve(trace.size());
+	for (const auto& a : trace) {
+		auto operation = a.write ? Operation::Write : Operation::Read;
+		accesses.push_back({ a.transition, a.address, a.address + 0x1000, a.size, true, operation });
+	}
+	return accesses;
+}
+
+struct Query {
+	HalfAxisQuery query;
+	bool forward;
+};
+
+static std::vector<Query> random_queries(const std::vector<MemoryAccess>& accesses, std::size_t count)
+{
+	std::mt19937_64 rng(1);
+	std::vector<Query> queries;
+	for (std::size_t i = 0; i < count; ++i) {
+		const auto& target = accesses[rng() % accesses.size()];
+		Query q;
+		q.query.transition = rng() % (accesses.back().transition_id + 1);
+		q.query.address_first = target.physical_address - target.physical_address % 16;
+		q.query.address_last = q.query.address_first + 15;
+		q.query.max_results = 10;
+		q.forward = i % 2 == 0;
+		queries.push_back(q);
+	}
+	return queries;
+}
+
+/**
+ * The half-axis query of the README, one SQL query per slice, operation and chunk, on the default schema.
+ */
+class SqlQueries
+{
+public:
+	explicit SqlQueries(reven::sqlite::ResourceDatabase& db)
+	  : slice_(db, "select transition_first, transition_last from slices where rowid = ?;")
+	  , find_slice_(db, "select rowid, transition_first from slices where transition_last >= ? "
+	                    "order by transition_last limit 1;")
+	  , last_slice_(db, "select max(rowid) from slices;")
+	  , chunks_(db, "select rowid, phy_first from chunks where operation = ? and slice_id = ? and phy_last >= ? "
+	                "order by phy_last;")
+	  , forward_(db, "select rowid, transition, phy_first, size from accesses where chunk_id = ? and transition >= ? "
+	                 "and phy_first <= ? and phy_first + size > ? order by transition limit ?;")
+	  , backward_(db, "select rowid, transition, phy_first, size from accesses where chunk_id = ? and transition <= ? "
+	                  "and phy_first <= ? and phy_first + size > ? order by transition desc limit ?;")
+	{
+	}
+
+	// Return the transitions of the accesses found
+	std::vector<std::uint64_t> run(const Query& q)
+	{
+		const auto& query = q.query;
+		std::vector<std::uint64_t> results;
+		auto slice = find_slice(query.transition, q.forward);
+		while (slice > 0 and results.size() < query.max_results) {
+			slice_.bind_arg_cast(1, slice, "rowid");
+			bool exists = slice_.step() == Statement::StepResult::Row;
+			slice_.reset();
+			if (not exists)
+				break;
+
+			// (transition, rowid) of the accesses of the slice
+			std::vector<std::pair<std::uint64_t, std::uint64_t>> slice_results;
+			auto required = query.max_results - results.size();
+			for (auto operation : { Operation::Read, Operation::Write }) {
+				if (not(operation == Operation::Read ? query.reads : query.writes))
+					continue;
+
+				chunks_.bind_arg_cast(1, static_cast<std::uint8_t>(operation), "operation");
+				chunks_.bind_arg_cast(2, slice, "slice_id");
+				chunks_.bind_arg_cast(3, query.address_first, "address_first");
+				std::vector<std::uint64_t> chunks;
+				while (chunks_.step() == Statement::StepResult::Row) {
+					if (static_cast<std::uint64_t>(chunks_.column_i64(1)) > query.address_last)
+						break;
+					chunks.push_back(static_cast<std::uint64_t>(chunks_.column_i64(0)));
+				}
+				chunks_.reset();
+
+				auto& accesses = q.forward ? forward_ : backward_;
+				for (auto chunk : chunks) {
+					accesses.bind_arg_cast(1, chunk, "chunk_id");
+					accesses.bind_arg_cast(2, query.transition, "transition");
+					accesses.bind_arg_cast(3, query.address_last, "address_last");
+					accesses.bind_arg_cast(4, query.address_first, "address_first");
+					accesses.bind_arg_cast(5, required, "limit");
+					while (accesses.step() == Statement::StepResult::Row) {
+						slice_results.emplace_back(static_cast<std::uint64_t>(accesses.column_i64(1)),
+						                           static_cast<std::uint64_t>(accesses.column_i64(0)));
+					}
+					accesses.reset();
+				}
+			}
+
+			std::sort(slice_results.begin(), slice_results.end());
+			if (not q.forward)
+				std::reverse(slice_results.begin(), slice_results.end());
+			for (std::size_t i = 0; i < slice_results.size() and i < required; ++i)
+				results.push_back(slice_results[i].first);
+
+			slice = q.forward ? slice + 1 : slice - 1;
+		}
+		return results;
+	}
+
+private:
+	// Rowid of the slice to start from, 0 if there is none
+	std::uint64_t find_slice(std::uint64_t transition, bool forward)
+	{
+		find_slice_.bind_arg_cast(1, transition, "transition");
+		std::uint64_t slice = 0;
+		if (find_slice_.step() == Statement::StepResult::Row) {
+			slice = static_cast<std::uint64_t>(find_slice_.column_i64(0));
+			if (not forward and static_cast<std::uint64_t>(find_slice_.column_i64(1)) > transition) {
+				--slice;
+			} else if (not forward) {
+				// Following slices may start on the same transition
+				for (;;) {
+					slice_.bind_arg_cast(1, slice + 1, "rowid");
+					bool shared = slice_.step() == Statement::StepResult::Row and
+					              static_cast<std::uint64_t>(slice_.column_i64(0)) <= transition;
+					slice_.reset();
+					if (not shared)
+						break;
+					++slice;
+				}
+			}
+		} else if (not forward) {
+			last_slice_.step();
+			slice = static_cast<std::uint64_t>(last_slice_.column_i64(0));
+			last_slice_.reset();
+		}
+		find_slice_.reset();
+		return slice;
+	}
+
+	Statement slice_;
+	Statement find_slice_;
+	Statement last_slice_;
+	Statement chunks_;
+	Statement forward_;
+	Statement backward_;
+};
+
+static void report(const char* trace_name, const char* setting, std::size_t query_count, double seconds,
+                   std::uint64_t results)
+{
+	std::cout << std::setw(8) << trace_name << std::setw(20) << setting << std::fixed << std::setprecision(3)
+	          << "  queries: " << std::setw(7) << seconds << "s (" << std::setw(9) << std::setprecision(0)
+	          << query_count / seconds << " /s)"
+	          << "  results: " << results;
+}
+
+static reven::sqlite::ResourceDatabase write_db(const std::vector<MemoryAccess>& accesses, bool compact)
+{
+	DbWriterOptions options;
+	options.bulk_insert_rows = 128;
+	options.compact_accesses = compact;
+	// Several slices, so that queries cross them
+	options.read_slice_limits.access_count_limit = 250000;
+	options.write_slice_limits.access_count_limit = 250000;
+	DbWriter writer(":memory:", "bench", "1.0.0", "bench_db_reader", options);
+	writer.push(accesses.data(), accesses.size());
+	return std::move(writer).take();
+}
+
+static void measure_sql(const char* trace_name, const std::vector<MemoryAccess>& accesses,
+                        const std::vector<Query>& queries)
+{
+	auto db = write_db(accesses, false);
+	SqlQueries sql(db);
+
+	bench::Timer timer;
+	std::uint64_t results = 0;
+	for (const auto& q : queries)
+		results += sql.run(q).size();
+	report(trace_name, "sql", queries.size(), timer.lap(), results);
+	std::cout << std::endl;
+}
+
+static void measure_reader(const char* trace_name, const std::vector<MemoryAccess>& accesses,
+                           const std::vector<Query>& queries, bool compact, std::size_t cache_size)
+{
+	auto db = write_db(accesses, compact);
+
+	bench::Timer timer;
+	DbReaderOptions options;
+	options.chunk_cache_size = cache_size;
+	DbReader reader(std::move(db), options);
+	auto open_s = timer.lap();
+
+	std::uint64_t results = 0;
+	for (const auto& q : queries)
+		results += (q.forward ? reader.next(q.query) : reader.previous(q.query)).size();
+	auto query_s = timer.lap();
+
+	auto setting = std::string(compact ? "compact" : "reader") + " cache " + std::to_string(cache_size);
+	report(trace_name, setting.c_str(), queries.size(), query_s, results);
+	auto stats = reader.stats();
+	std::cout << std::setprecision(3) << "  open: " << open_s << "s"
+	          << std::setprecision(1) << "  index: " << bench::mib(reader.memory_usage()) << "MiB"
+	          << "  chunks: " << stats.chunks << " (hits: " << stats.cache_hits << ")" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t count = argc > 1 ? std::stoull(argv[1]) : 1000000;
+	std::size_t query_count = argc > 2 ? std::stoull(argv[2]) : 10000;
+	const char* only = argc > 3 ? argv[3] : nullptr;
+
+	for (const auto& generated : bench::all_traces(count)) {
+		if (only and std::strcmp(only, generated.first) != 0)
+			continue;
+
+		auto accesses = to_memory_accesses(generated.second);
+		auto queries = random_queries(accesses, query_count);
+		bench::run_isolated([&]() { measure_sql(generated.first, accesses, queries); });
+		for (bool compact : { false, true }) {
+			for (std::size_t cache_size : { 0, 1024 })
+				bench::run_isolated([&]() { measure_reader(generated.first, accesses, queries, compact, cache_size); });
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,335 @@
+// Measure DbWriter end-to-end throughput, from push to a fully written database, with various settings.
+// The flush time covers whatever `take` does: writing the last slice and, in bulk load mode, building indexes.
+// Also report the peak memory used by the run, and the size of the resulting database.
+// The columnar format is written next to the database, or in the current directory when databases are in memory, and
+// its conversion to sqlite is timed separately. The null sink shows the cost of building slices alone.
+// The latency runs push accesses in small batches, and report percentiles of the time taken by each call.
+//
+// Usage: bench_db_writer [access_count] [database_path] [trace_name]
+// Without database_path, databases are written in memory. Without trace_name, all traces are run.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include <db_writer.h>
+#include <columnar.h>
+
+#include "null_sink.h"
+
+#include "bench_common.h"
+#include "trace_generators.h"
+
+using namespace reven::backend::memaccess::db;
+
+static std::vector<MemoryAccess> to_memory_accesses(const std::vector<bench::Access>& trace)
+{
+	std::vector<MemoryAccess> accesses;
+	accesses.reserve(trace.size());
+	for (const auto& a : trace) {
+		auto operation = a.write ? Operation::Write : Operation::Read;
+		accesses.push_back({ a.transition, a.address, a.address + 0x1000, a.size, true, operation });
+	}
+	return accesses;
+}
+
+static std::uint64_t query_u64(reven::sqlite::Database& db, const char* query)
+{
+	reven::sqlite::Statement stmt(db, query);
+	stmt.step();
+	return static_cast<std::uint64_t>(stmt.column_i64(0));
+}
+
+static void measure(const char* trace_name, const std::vector<MemoryAccess>& accesses, const std::string& path,
+                    const char* setting, const DbWriterOptions& options)
+{
+	std::remove(path.c_str());
+	auto rss_before = bench::current_rss();
+
+	bench::Timer timer;
+	DbWriter writer(path.c_str(), "bench", "1.0.0", "bench_db_writer", options);
+	writer.push(accesses.data(), accesses.size());
+	auto push_s = timer.lap();
+	auto db = std::move(writer).take();
+	auto flush_s = timer.lap();
+	auto total_s = push_s + flush_s;
+
+	auto peak = bench::peak_rss();
+	auto db_size = query_u64(db, "pragma page_count;") * query_u64(db, "pragma page_size;");
+	auto chunks = query_u64(db, "select count(*) from chunks;");
+
+	std::cout << std::setw(8) << trace_name << std::setw(16) << setting
+	          << std::fixed << std::setprecision(3)
+	          << "  push: " << std::setw(7) << push_s << "s"
+	          << "  flush: " << std::setw(7) << flush_s << "s"
+	          << "  total: " << std::setw(7) << total_s << "s (" << std::setw(6)
+	          << accesses.size() / total_s / 1e6 << " M/s)"
+	          << std::setprecision(1)
+	          << "  peak: +" << std::setw(7) << bench::mib(peak > rss_before ? peak - rss_before : 0) << "MiB"
+	          << "  db: " << std::setw(7) << bench::mib(db_size) << "MiB"
+	          << "  chunks: " << chunks << std::endl;
+}
+
+// Accesses pushed `batch_size` at a time, as a tracer would, timing each `push`
+static void measure_latency(const char* trace_name, const std::vector<MemoryAccess>& accesses, const std::string& path,
+                            const char* setting, const DbWriterOptions& options)
+{
+	constexpr std::size_t batch_size = 64;
+	std::vector<double> latencies;
+	latencies.reserve(accesses.size() / batch_size + 1);
+
+	std::remove(path.c_str());
+	bench::Timer timer;
+	DbWriter writer(path.c_str(), "bench", "1.0.0", "bench_db_writer", options);
+	bench::Timer push_timer;
+	for (std::size_t first = 0; first < accesses.size(); first += batch_size) {
+		writer.push(accesses.data() + first, std::min(batch_size, accesses.size() - first));
+		latencies.push_back(push_timer.lap());
+	}
+	auto push_s = timer.lap();
+	std::move(writer).take();
+	auto total_s = push_s + timer.lap();
+
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p) {
+		return latencies[static_cast<std::size_t>(p * static_cast<double>(latencies.size() - 1))] * 1e6;
+	};
+
+	std::cout << std::setw(8) << trace_name << std::setw(16) << setting
+	          << std::fixed << std::setprecision(3)
+	          << "  total: " << std::setw(7) << total_s << "s"
+	          << std::setprecision(1)
+	          << "  push p50: " << std::setw(7) << percentile(0.5) << "us"
+	          << "  p99.9: " << std::setw(9) << percentile(0.999) << "us"
+	          << "  max: " << std::setw(9) << latencies.back() * 1e6 << "us" << std::endl;
+}
+
+static void measure_columnar(const char* trace_name, const std::vector<MemoryAccess>& accesses,
+                             const std::string& path, const DbWriterOptions& options)
+{
+	auto columnar_path = (path == ":memory:" ? std::string("bench_db_writer") : path) + ".columnar";
+	std::remove(columnar_path.c_str());
+	auto rss_before = bench::current_rss();
+
+	bench::Timer timer;
+	auto writer = DbWriter::columnar(columnar_path.c_str(), "bench", "1.0.0", "bench_db_writer", options);
+	writer.push(accesses.data(), accesses.size());
+	auto push_s = timer.lap();
+	std::move(writer).finish();
+	auto flush_s = timer.lap();
+	auto total_s = push_s + flush_s;
+	auto peak = bench::peak_rss();
+
+	std::FILE* file = std::fopen(columnar_path.c_str(), "rb");
+	std::fseek(file, 0, SEEK_END);
+	auto file_size = static_cast<std::size_t>(std::ftell(file));
+	std::fclose(file);
+
+	std::remove(path.c_str());
+	timer.lap();
+	auto db = columnar_to_sqlite(columnar_path.c_str(), path.c_str());
+	auto convert_s = timer.lap();
+	std::remove(columnar_path.c_str());
+
+	std::cout << std::setw(8) << trace_name << std::setw(16) << "columnar"
+	          << std::fixed << std::setprecision(3)
+	          << "  push: " << std::setw(7) << push_s << "s"
+	          << "  flush: " << std::setw(7) << flush_s << "s"
+	          << "  total: " << std::setw(7) << total_s << "s (" << std::setw(6)
+	          << accesses.size() / total_s / 1e6 << " M/s)"
+	          << std::setprecision(1)
+	          << "  peak: +" << std::setw(7) << bench::mib(peak > rss_before ? peak - rss_before : 0) << "MiB"
+	          << "  file: " << std::setw(7) << bench::mib(file_size) << "MiB"
+	          << std::setprecision(3)
+	          << "  to sqlite: " << convert_s << "s" << std::endl;
+}
+
+static void measure_null_sink(const char* trace_name, const std::vector<MemoryAccess>& accesses, const char* setting,
+                              const DbWriterOptions& options)
+{
+	NullSink::Counts counts;
+	bench::Timer timer;
+	DbWriter writer(std::make_unique<NullSink>(&counts), options);
+	writer.push(accesses.data(), accesses.size());
+	auto push_s = timer.lap();
+	std::move(writer).finish();
+	auto flush_s = timer.lap();
+	auto total_s = push_s + flush_s;
+
+	std::cout << std::setw(8) << trace_name << std::setw(16) << setting
+	          << std::fixed << std::setprecision(3)
+	          << "  push: " << std::setw(7) << push_s << "s"
+	          << "  flush: " << std::setw(7) << flush_s << "s"
+	          << "  total: " << std::setw(7) << total_s << "s (" << std::setw(6)
+	          << accesses.size() / total_s / 1e6 << " M/s)"
+	          << "  chunks: " << counts.chunks << std::endl;
+}
+
+enum class ColumnsMode {
+	Copied,
+	InPlace,
+	// In place, with all sizes replaced by 8, in a column or not
+	Sized8,
+	Fixed8,
+};
+
+// Accesses laid out column by column, as in a tracer's ring buffer, pushed in batches either in place or copied to
+// MemoryAccess objects first
+static void measure_columns(const char* trace_name, const std::vector<MemoryAccess>& accesses, ColumnsMode mode)
+{
+	bool copy = mode == ColumnsMode::Copied;
+	bool size_8 = mode == ColumnsMode::Sized8 or mode == ColumnsMode::Fixed8;
+	std::vector<std::uint64_t> transitions, physical_addresses, virtual_addresses;
+	std::vector<std::uint32_t> sizes;
+	std::vector<Operation> operations;
+	for (const auto& a : accesses) {
+		transitions.push_back(a.transition_id);
+		physical_addresses.push_back(a.physical_address);
+		virtual_addresses.push_back(a.virtual_address);
+		sizes.push_back(size_8 ? 8 : a.size);
+		operations.push_back(a.operation);
+	}
+
+	constexpr std::size_t batch_size = 4096;
+	std::vector<MemoryAccess> batch(batch_size);
+
+	NullSink::Counts counts;
+	bench::Timer timer;
+	DbWriter writer(std::make_unique<NullSink>(&counts));
+	for (std::size_t first = 0; first < accesses.size(); first += batch_size) {
+		auto count = std::min(batch_size, accesses.size() - first);
+		if (copy) {
+			for (std::size_t i = 0; i < count; ++i) {
+				batch[i] = MemoryAccess{ transitions[first + i], physical_addresses[first + i],
+				                         virtual_addresses[first + i], sizes[first + i], true, operations[first + i] };
+			}
+			writer.push(batch.data(), count);
+		} else {
+			AccessColumns columns;
+			columns.count = count;
+			columns.transition_ids = transitions.data() + first;
+			columns.physical_addresses = physical_addresses.data() + first;
+			columns.virtual_addresses = virtual_addresses.data() + first;
+			if (mode == ColumnsMode::Fixed8)
+				columns.size = 8;
+			else
+				columns.sizes = sizes.data() + first;
+			columns.operations = operations.data() + first;
+			writer.push(columns);
+		}
+	}
+	auto push_s = timer.lap();
+	std::move(writer).finish();
+	auto total_s = push_s + timer.lap();
+
+	const char* setting = copy ? "columns copied" :
+	                      mode == ColumnsMode::Sized8 ? "columns size 8" :
+	                      mode == ColumnsMode::Fixed8 ? "columns fixed 8" : "columns";
+	std::cout << std::setw(8) << trace_name << std::setw(16) << setting
+	          << std::fixed << std::setprecision(3)
+	          << "  push: " << std::setw(7) << push_s << "s"
+	          << "  total: " << std::setw(7) << total_s << "s (" << std::setw(6)
+	          << accesses.size() / total_s / 1e6 << " M/s)"
+	          << "  chunks: " << counts.chunks << std::endl;
+}
+
+static void run(const char* trace_name, const std::vector<MemoryAccess>& accesses, const std::string& path,
+                const char* setting, const DbWriterOptions& options)
+{
+	bench::run_isolated([&]() { measure(trace_name, accesses, path, setting, options); });
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t count = argc > 1 ? std::stoull(argv[1]) : 1000000;
+	std::string path = argc > 2 ? argv[2] : ":memory:";
+	const char* only = argc > 3 ? argv[3] : nullptr;
+
+	for (const auto& generated : bench::all_traces(count)) {
+		if (only and std::strcmp(only, generated.first) != 0)
+			continue;
+
+		auto trace = std::make_pair(generated.first, to_memory_accesses(generated.second));
+		for (std::size_t rows : { 1, 16, 64, 128 }) {
+			DbWriterOptions options;
+			options.bulk_insert_rows = rows;
+			run(trace.first, trace.second, path, ("bulk rows " + std::to_string(rows)).c_str(), options);
+		}
+
+		DbWriterOptions options;
+		options.bulk_insert_rows = 128;
+		options.deferred_indexes = true;
+		run(trace.first, trace.second, path, "deferred idx", options);
+		options.index_build_threads = 4;
+		run(trace.first, trace.second, path, "deferred idx x4", options);
+		options.parallel_slice_building = true;
+		run(trace.first, trace.second, path, "parallel build", options);
+		options.parallel_slice_building = false;
+		options.index_build_threads = 0;
+		options.compact_accesses = true;
+		run(trace.first, trace.second, path, "compact", options);
+
+		DbWriterOptions budget_options;
+		budget_options.bulk_insert_rows = 128;
+		budget_options.memory_budget = 16 << 20;
+		run(trace.first, trace.second, path, "budget 16MiB", budget_options);
+
+		DbWriterOptions durable_options;
+		durable_options.bulk_insert_rows = 128;
+		durable_options.durable_slices = true;
+		run(trace.first, trace.second, path, "durable", durable_options);
+
+		// Indexes maintained during insertion are where the page cache matters most
+		DbWriterOptions storage_options;
+		storage_options.bulk_insert_rows = 128;
+		storage_options.cache_size_kib = 1 << 20;
+		run(trace.first, trace.second, path, "cache 1GiB", storage_options);
+		storage_options.mmap_size = std::uint64_t(1) << 32;
+		storage_options.exclusive_locking = true;
+		run(trace.first, trace.second, path, "+ mmap excl", storage_options);
+		storage_options.no_journal = true;
+		run(trace.first, trace.second, path, "+ no journal", storage_options);
+		storage_options.page_size = 16384;
+		run(trace.first, trace.second, path, "+ page 16KiB", storage_options);
+		storage_options.page_size = 65536;
+		run(trace.first, trace.second, path, "+ page 64KiB", storage_options);
+		storage_options.deferred_indexes = true;
+		run(trace.first, trace.second, path, "+ deferred idx", storage_options);
+
+		// Slices cut every 250k accesses, so that the trace has several of them
+		DbWriterOptions latency_options;
+		latency_options.bulk_insert_rows = 128;
+		latency_options.read_slice_limits.access_count_limit = 250000;
+		latency_options.write_slice_limits.access_count_limit = 250000;
+		bench::run_isolated([&]() { measure_latency(trace.first, trace.second, path, "latency", latency_options); });
+		latency_options.incremental_flush_rows = 256;
+		bench::run_isolated(
+		  [&]() { measure_latency(trace.first, trace.second, path, "latency incr", latency_options); });
+		latency_options.incremental_flush_rows = 0;
+		latency_options.async_flush_queue_depth = 1;
+		bench::run_isolated(
+		  [&]() { measure_latency(trace.first, trace.second, path, "latency async", latency_options); });
+
+		DbWriterOptions columnar_options;
+		bench::run_isolated([&]() { measure_columnar(trace.first, trace.second, path, columnar_options); });
+
+		DbWriterOptions null_options;
+		bench::run_isolated([&]() { measure_null_sink(trace.first, trace.second, "null sink", null_options); });
+		null_options.unchecked_accesses = true;
+		bench::run_isolated([&]() { measure_null_sink(trace.first, trace.second, "null unchecked", null_options); });
+		// Without limits, slices are only cut by the memory budget
+		null_options.memory_budget = std::size_t(1) << 30;
+		for (auto* limits : { &null_options.read_slice_limits, &null_options.write_slice_limits }) {
+			limits->chunk_size_overlap_limit = 0;
+			limits->access_count_limit = 0;
+		}
+		bench::run_isolated([&]() { measure_null_sink(trace.first, trace.second, "null no limits", null_options); });
+		for (auto mode : { ColumnsMode::Copied, ColumnsMode::InPlace, ColumnsMode::Sized8, ColumnsMode::Fixed8 })
+			bench::run_isolated([&]() { measure_columns(trace.first, trace.second, mode); });
+	}
+	return 0;
+}
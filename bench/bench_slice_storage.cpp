@@ -0,0 +1,63 @@
+// Compare the chunk storages of SliceBuilder on synthetic traces: throughput of `insert`, time spent in `build` (ie,
+// merging touching chunks), and peak memory of the resulting slice.
+//
+// Usage: bench_slice_storage [access_count]
+
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include "slice.h"
+#include "bench_common.h"
+#include "trace_generators.h"
+
+using namespace reven::backend::memaccess::db;
+using bench::Access;
+
+template <typename Storage>
+static void measure(const char* storage_name, const char* trace_name, const std::vector<Access>& trace)
+{
+	auto rss_before = bench::current_rss();
+
+	bench::Timer timer;
+	BasicSliceBuilder<Storage> b;
+	b.chunk_size_overlap_limit(100000).chunk_size_touch_limit(1000);
+	for (const auto& a : trace) {
+		if (not b.insert(a.transition, a.address, a.size)) {
+			std::cerr << "Unexpected refusal" << std::endl;
+			std::exit(1);
+		}
+	}
+	auto insert_s = timer.lap();
+	auto chunks_before_merge = b.chunk_count();
+	auto slice = std::move(b).build();
+	auto build_s = timer.lap();
+	auto peak = bench::peak_rss();
+	std::cout << std::setw(8) << trace_name << std::setw(6) << storage_name
+	          << std::fixed << std::setprecision(3)
+	          << "  insert: " << std::setw(8) << insert_s << "s (" << std::setw(6)
+	          << trace.size() / insert_s / 1e6 << " M/s)"
+	          << "  build: " << std::setw(8) << build_s << "s"
+	          << "  chunks: " << chunks_before_merge << " -> " << slice.chunk_count()
+	          << std::setprecision(1)
+	          << "  peak: +" << bench::mib(peak > rss_before ? peak - rss_before : 0) << "MiB" << std::endl;
+}
+
+template <typename Storage>
+static void run(const char* storage_name, const char* trace_name, const std::vector<Access>& trace)
+{
+	bench::run_isolated([&]() { measure<Storage>(storage_name, trace_name, trace); });
+}
+
+int main(int argc, char** argv)
+{
+	std::size_t count = argc > 1 ? std::stoull(argv[1]) : 2000000;
+
+	for (const auto& trace : bench::all_traces(count)) {
+		run<MapChunkStorage>("map", trace.first, trace.second);
+		run<FlatChunkStorage>("flat", trace.first, trace.second);
+	}
+	return 0;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+namespace bench {
+
+struct Access {
+	std::uint64_t transition;
+	std::uint64_t address;
+	std::uint32_t size;
+	// Whether this is a write rather than a read
+	bool write;
+};
+
+// Arbitrary, but stable, split between reads and writes for traces that do not model it
+inline bool is_write(std::uint64_t address)
+{
+	return (address / 64) % 3 == 0;
+}
+
+// Stack-like: mostly small accesses around a slowly moving pointer
+inline std::vector<Access> stack_trace(std::size_t count)
+{
+	std::mt19937_64 rng(0);
+	std::vector<Access> trace;
+	trace.reserve(count);
+	std::uint64_t sp = 0x7fff0000;
+	for (std::size_t i = 0; i < count; ++i) {
+		sp += (rng() % 3) * 8 - 8;
+		trace.push_back({ i / 4, sp, 8, is_write(sp) });
+	}
+	return trace;
+}
+
+// Heap-like: accesses scattered over a large address space
+inline std::vector<Access> heap_trace(std::size_t count)
+{
+	std::mt19937_64 rng(0);
+	std::vector<Access> trace;
+	trace.reserve(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		auto address = 0x10000000 + (rng() % (count * 64));
+		trace.push_back({ i / 4, address, static_cast<std::uint32_t>(1 << (rng() % 4)), is_write(address) });
+	}
+	return trace;
+}
+
+// memcpy-like: bursts of sequential reads from a source buffer, each followed by a write to a destination buffer
+inline std::vector<Access> memcpy_trace(std::size_t count)
+{
+	std::mt19937_64 rng(0);
+	std::vector<Access> trace;
+	trace.reserve(count + 2);
+	std::uint64_t transition = 0;
+	while (trace.size() < count) {
+		std::uint64_t source = 0x20000000 + (rng() % 0x1000000) * 8;
+		std::uint64_t destination = 0x40000000 + (rng() % 0x1000000) * 8;
+		std::size_t length = 1 + rng() % 4096; // in 8 bytes words
+		for (std::size_t i = 0; i < length and trace.size() < count; ++i, ++transition) {
+			trace.push_back({ transition, source + i * 8, 8, false });
+			trace.push_back({ transition, destination + i * 8, 8, true });
+		}
+	}
+	trace.resize(count);
+	return trace;
+}
+
+// Hot pages: most accesses re-read a handful of pages, with occasional writes and cold accesses elsewhere
+inline std::vector<Access> hot_page_trace(std::size_t count)
+{
+	std::mt19937_64 rng(0);
+	std::vector<Access> trace;
+	trace.reserve(count);
+	constexpr std::uint64_t hot_pages = 8;
+	for (std::size_t i = 0; i < count; ++i) {
+		auto roll = rng() % 100;
+		std::uint64_t address;
+		if (roll < 95)
+			address = 0x600000 + (rng() % hot_pages) * 0x1000 + (rng() % 512) * 8;
+		else
+			address = 0x80000000 + (rng() % (count * 64));
+		trace.push_back({ i / 2, address, 8, roll % 10 == 0 });
+	}
+	return trace;
+}
+
+// rep movs-like: bursts of small accesses scattered over a page, leaving gaps between them so that they stay separate
+// chunks, each ended by a copy of the whole page, which merges all of them
+inline std::vector<Access> rep_movs_trace(std::size_t count)
+{
+	std::mt19937_64 rng(0);
+	std::vector<Access> trace;
+	trace.reserve(count);
+	for (std::size_t i = 0; i < count; ++i) {
+		auto transition = i / 2;
+		auto page = 0x100000000 + (i / 64 * 7919 % 0x40000) * 0x1000;
+		if (i % 64 == 63) {
+			trace.push_back({ transition, page, 0x1000, true });
+		} else {
+			auto address = page + (rng() % 256) * 16;
+			trace.push_back({ transition, address, 4, is_write(address) });
+		}
+	}
+	return trace;
+}
+
+// All the traces above, by name
+inline std::vector<std::pair<const char*, std::vector<Access>>> all_traces(std::size_t count)
+{
+	std::vector<std::pair<const char*, std::vector<Access>>> traces;
+	traces.emplace_back("stack", stack_trace(count));
+	traces.emplace_back("heap", heap_trace(count));
+	traces.emplace_back("memcpy", memcpy_trace(count));
+	traces.emplace_back("hotpage", hot_page_trace(count));
+	traces.emplace_back("repmovs", rep_movs_trace(count));
+	return traces;
+}
+
+} // namespace bench
@@ -2,6 +2,7 @@ get_filename_component(RVNMEMHISTWRITER_CMAKE_DIR "${CMAKE_CURRENT_LIST_FILE}" P
 include(CMakeFindDependencyMacro)
 
 find_dependency(rvnsqlite REQUIRED)
+find_dependency(Threads REQUIRED)
 
 if(NOT TARGET rvnmemhistwriter)
 	include("${RVNMEMHISTWRITER_CMAKE_DIR}/rvnmemhistwriter-targets.cmake")
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <rvnsqlite/resource_database.h>
+
+#include "db_writer.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+constexpr const char* columnar_format_version = "1.0.0";
+
+// Write the content of a columnar file, as written by a DbWriter created with `DbWriter::columnar`, to a new sqlite
+// database with the usual schema, and return it. Slices, chunks and accesses are the same, with the same rowids, as
+// if the accesses were written to sqlite in the first place, and accesses discarded by `discard_after` are removed.
+// The metadata keeps the tool information of the columnar file.
+// Throw std::runtime_error if the columnar file is incomplete or invalid.
+sqlite::ResourceDatabase columnar_to_sqlite(const char* columnar_filename, const char* sqlite_filename);
+
+}}}} // namespace reven::backend::memaccess::db
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <rvnsqlite/resource_database.h>
+
+#include "db_writer.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * A half-axis query, see the README: the first `max_results` accesses from `transition` going forward or backward, that
+ * touch the addresses `[address_first, address_last]`.
+ */
+struct HalfAxisQuery {
+	std::uint64_t transition = 0;
+	std::uint64_t address_first = 0;
+	std::uint64_t address_last = std::numeric_limits<std::uint64_t>::max();
+	// Operations of the accesses to return
+	bool reads = true;
+	bool writes = true;
+	std::size_t max_results = 1;
+};
+
+/**
+ * Options controlling how a DbReader queries the database.
+ */
+struct DbReaderOptions {
+	// Amount of chunks whose accesses are kept decoded in memory, the least recently used ones being dropped first.
+	// With the compact schema, chunks that are not cached are decoded and cached. With the default one, they are only
+	// read whole and cached once queries for the rows they need have cost about as much. With 0, nothing is kept:
+	// queries read only the rows they need from the accesses table, or decode the blobs of compact databases.
+	std::size_t chunk_cache_size = 1024;
+};
+
+/**
+ * What a DbReader did so far, see `DbReader::stats`.
+ */
+struct DbReaderStats {
+	std::uint64_t queries = 0;
+	// Chunks whose accesses were looked at, and those of them that were found in the cache
+	std::uint64_t chunks = 0;
+	std::uint64_t cache_hits = 0;
+};
+
+struct ReaderIndex;
+struct ReaderStatements;
+class ChunkCache;
+
+/**
+ * Answers half-axis queries on a database written by a DbWriter, with the default or the compact schema.
+ *
+ * Slices and chunk bounds are loaded in memory when opening, so queries only read the accesses of the chunks that
+ * overlap the requested addresses. The database must not be modified while it is read.
+ */
+class DbReader {
+public:
+	// Open the database `filename`, read-only
+	explicit DbReader(const char* filename, const DbReaderOptions& options = DbReaderOptions());
+
+	// Read a database that is already open, for instance the one returned by `DbWriter::take`
+	explicit DbReader(sqlite::ResourceDatabase db, const DbReaderOptions& options = DbReaderOptions());
+
+	~DbReader();
+	DbReader(DbReader&&);
+	DbReader(const DbReader&) = delete;
+	DbReader& operator=(DbReader&&);
+	DbReader& operator=(const DbReader&) = delete;
+
+	// Return the accesses at or after `query.transition`, in order of transition.
+	std::vector<MemoryAccess> next(const HalfAxisQuery& query);
+
+	// Return the accesses at or before `query.transition`, most recent first.
+	std::vector<MemoryAccess> previous(const HalfAxisQuery& query);
+
+	// Return the amount of slices and chunks of the database.
+	std::size_t slice_count() const;
+	std::size_t chunk_count() const;
+
+	// Return an estimate of the bytes used by the index of slices and chunks, and by the cache.
+	std::size_t memory_usage() const;
+
+	DbReaderStats stats() const { return stats_; }
+
+private:
+	// A chunk of the index, and an access found by a query, see db_reader.cpp
+	struct ChunkRef;
+	struct Found;
+
+	// `next` or `previous`
+	std::vector<MemoryAccess> run_query(const HalfAxisQuery& query, bool forward);
+
+	// Add the first accesses of `chunk` that match `query` to `found`, at most `max_results`.
+	void find_accesses(const ChunkRef& chunk, const HalfAxisQuery& query, bool forward, std::size_t max_results,
+	                   std::vector<Found>& found);
+
+	// `find_accesses` without the cache, reading only the rows of the accesses table it needs
+	void query_accesses(const ChunkRef& chunk, const HalfAxisQuery& query, bool forward, std::size_t max_results,
+	                    std::vector<Found>& found);
+
+	DbReaderOptions options_;
+	sqlite::ResourceDatabase db_;
+	std::unique_ptr<ReaderIndex> index_;
+	// Declared after `db_`, so that they are finalized before it is closed
+	std::unique_ptr<ReaderStatements> statements_;
+	std::unique_ptr<ChunkCache> cache_;
+	DbReaderStats stats_;
+};
+
+}}}} // namespace reven::backend::memaccess::db
@@ -1,8 +1,12 @@
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <vector>
-#include <unordered_map>
+#include <type_traits>
 #include <memory>
+#include <exception>
+#include <functional>
 #include <rvnsqlite/resource_database.h>
 
 namespace reven {
@@ -11,7 +15,9 @@ namespace memaccess {
 namespace db {
 
 constexpr const char* format_version = "1.0.0";
-constexpr const char* writer_version = "1.1.0";
+// Format version of databases written with `DbWriterOptions::compact_accesses`
+constexpr const char* compact_format_version = "2.0.0";
+constexpr const char* writer_version = "1.2.0";
 
 enum class Operation : std::uint8_t
 {
@@ -29,18 +35,232 @@ struct MemoryAccess {
 	Operation operation;
 };
 
-class SliceBuilder;
+/**
+ * Memory accesses laid out column by column in buffers owned by the caller, for instance a tracer's ring buffer, to push
+ * them without building MemoryAccess objects first. Access `i` is made of the `i`-th element of each column.
+ */
+struct AccessColumns {
+	std::size_t count = 0;
+	const std::uint64_t* transition_ids = nullptr;
+	const std::uint64_t* physical_addresses = nullptr;
+	// May be null when no access has a virtual address.
+	const std::uint64_t* virtual_addresses = nullptr;
+	// May be null when all accesses have a virtual address, or none if `virtual_addresses` is null. Non-zero when the
+	// access has one.
+	const std::uint8_t* has_virtual_addresses = nullptr;
+	// May be null when all accesses have the same size, `size`.
+	const std::uint32_t* sizes = nullptr;
+	std::uint32_t size = 0;
+	const Operation* operations = nullptr;
+};
+
+/**
+ * Limits on the geometry of the slices of one operation. Slices are cut when a limit is reached, so they trade memory
+ * used while building against the amount of slices. 0 means no limit. The defaults were found empirically.
+ * When the limits other than `chunk_size_touch_limit` are 0 for both operations, accesses are inserted without checking
+ * limits at all.
+ */
+struct SliceLimits {
+	// Soft limit on the amount of accesses in a chunk when an access overlaps existing chunks. Bigger chunks are slower
+	// to query.
+	std::size_t chunk_size_overlap_limit = 100000;
+
+	// Limit on the amount of accesses in a chunk when merging touching chunks, which does not cut slices.
+	std::size_t chunk_size_touch_limit = 1000;
+
+	// Soft limit on the amount of accesses in a slice. This is what bounds memory usage while building: the default
+	// costs about 3GB.
+	// Whatever the limits, including none, the read and write slices cut together never hold more than 2^32 - 1
+	// accesses in total, which is what their indices can address: they are cut when they reach it, within a
+	// transition if need be, and this counts as an access count cut.
+	std::size_t access_count_limit = 10000000;
+
+	// Hard limit on the amount of transitions a slice can span.
+	std::uint64_t transition_limit = 0;
+
+	// Soft limit on the bytes used by the chunks and accesses of a slice while building it.
+	std::size_t memory_limit = 0;
+};
+
+/**
+ * What a DbWriter did so far, see `DbWriter::stats`.
+ */
+struct DbWriterStats {
+	// Accesses pushed, by operation
+	std::uint64_t read_accesses = 0;
+	std::uint64_t write_accesses = 0;
+
+	// Written slices, a read and a write one counting as one, and their chunks. Slices are counted once written: in
+	// async mode, when the background writer is done with them.
+	std::uint64_t slices = 0;
+	std::uint64_t chunks = 0;
+
+	// Chunks merged in by an access that overlapped them, when inserting it, and touching chunks merged once slices
+	// are complete
+	std::uint64_t overlap_merges = 0;
+	std::uint64_t touch_merges = 0;
+
+	// Why slices were cut: the limit of `SliceLimits` that was reached first, `memory_budget`, or the end of the
+	// accesses with `take` or `finish`
+	std::uint64_t access_count_cuts = 0;
+	std::uint64_t memory_limit_cuts = 0;
+	std::uint64_t chunk_size_overlap_cuts = 0;
+	std::uint64_t transition_cuts = 0;
+	std::uint64_t memory_budget_cuts = 0;
+	std::uint64_t final_cuts = 0;
+
+	// Time spent completing slices, storing their chunks then accesses, and committing them
+	std::chrono::nanoseconds build_time{ 0 };
+	std::chrono::nanoseconds chunk_insert_time{ 0 };
+	std::chrono::nanoseconds access_insert_time{ 0 };
+	std::chrono::nanoseconds commit_time{ 0 };
+};
+
+/**
+ * Options controlling how a DbWriter builds and stores slices. The defaults match the historical behaviour.
+ */
+struct DbWriterOptions {
+	// Limits of the read and write slices. Both are cut as soon as either of them reaches a limit, but reads and writes
+	// usually have a very different locality, which may call for different limits.
+	SliceLimits read_slice_limits;
+	SliceLimits write_slice_limits;
+
+	// When non-zero, slices are cut as soon as the memory used by the slices being built and their accesses (see
+	// `DbWriter::memory_usage`) reaches this many bytes, so that peak memory does not depend on the access pattern.
+	// Like other limits, this is soft: slices are only cut between transitions. It does not account for the finished
+	// slices waiting in async mode.
+	std::size_t memory_budget = 0;
+
+	// When non-zero, finished slices are built and written to the database by a background thread, so that `push` does
+	// not wait for them. At most this many finished slices can be waiting to be written: `push` blocks when there are
+	// more, which caps memory usage.
+	std::size_t async_flush_queue_depth = 0;
+
+	// When non-zero, and not in async mode, the slices that are cut are written over the next calls to `push`, by
+	// steps of at most this many rows, instead of all at once by the call that cut them: this bounds the latency of
+	// each `push`. The slices being written are kept in memory meanwhile, alongside the ones being built. If the next
+	// slices are cut before they are written, they are completed then, so steps should write rows faster than `push`
+	// adds accesses: that is, more rows than accesses per call. A multiple of `bulk_insert_rows` avoids single-row
+	// inserts. `discard_after`, `take` and `finish` complete the write first.
+	std::size_t incremental_flush_rows = 0;
+
+	// Amount of rows inserted by each statement when writing chunks and accesses. Values above 1 use multi-row
+	// `insert ... values (...), (...)` statements, which greatly reduce the amount of statement executions. It is capped
+	// to what fits in the maximum amount of parameters of a sqlite statement.
+	std::size_t bulk_insert_rows = 1;
+
+	// Bulk load mode: tables are created without indexes, which are then built in one go once all slices are written,
+	// by `take` or the destructor. This is much cheaper than maintaining the indexes during insertion, but the database
+	// is not fit for queries until then.
+	bool deferred_indexes = false;
+
+	// Store the accesses of each chunk as a blob in its row, instead of a row per access in an `accesses` table (see the
+	// README). These databases are much smaller, and their format version is `compact_format_version`, so readers of
+	// the default schema reject them.
+	bool compact_accesses = false;
+
+	// Storage settings of the sqlite database, for large writes. They are ignored by the sinks that do not write one.
+	// When non-zero, page size of the database in bytes: a power of two between 512 and 65536. Larger pages make for
+	// shallower indexes with fewer page splits, but each modified page is copied to the rollback journal: large pages are
+	// best combined with `no_journal`. It is applied before the tables are created.
+	std::size_t page_size = 0;
+	// When non-zero, size of sqlite's page cache in KiB. The default cache of a few MiB is far smaller than the access
+	// indexes of large databases, which are updated at random places.
+	std::size_t cache_size_kib = 0;
+	// When non-zero, let sqlite memory-map up to this many bytes of the database file (`pragma mmap_size`).
+	std::uint64_t mmap_size = 0;
+	// Hold an exclusive lock on the database file until the writer is done, sparing the lock on each transaction.
+	// Other connections cannot read the database meanwhile.
+	bool exclusive_locking = false;
+	// Disable the rollback journal entirely instead of keeping it in memory. A failed write then leaves the database
+	// corrupted instead of rolled back, which is only acceptable when failed databases are thrown away anyway.
+	bool no_journal = false;
+	// Checkpoint mode: each written slice is durable as soon as its transaction commits, so that after a crash the
+	// database holds all the slices written so far and can be completed with `DbWriter::open_resume`. The rollback
+	// journal is written to disk and commits wait for the data to be synced, which makes writes slower. Not compatible
+	// with `no_journal`.
+	bool durable_slices = false;
+
+	// When building deferred indexes, allow sqlite to use up to this many helper threads to sort index entries.
+	// 0 keeps sqlite's default.
+	unsigned index_build_threads = 0;
+
+	// Build the read and write slices on two worker threads, fed by `push` through lock-free queues, so that both
+	// builders run in parallel with each other and with the caller.
+	// Slices are still cut at the same transition for reads and writes, and on the same accesses as in the sequential
+	// mode for the access count and transition limits. Workers report reaching other limits asynchronously though, so
+	// these cuts may come up to a thousand or so accesses later than in the sequential mode. Invalid accesses other
+	// than empty ones are also reported later, by the next `push` that cuts slices, or by `take`. The slices being
+	// built are then lost, and later calls to `push`, `discard_after`, `take` and `finish` throw the same error.
+	bool parallel_slice_building = false;
+
+	// Do not validate pushed accesses: pushing an empty access, one that wraps around the address space, or one whose
+	// transition goes backward is then undefined behaviour instead of an error. Meant for producers whose accesses are
+	// valid by construction, to spare the checks on each access. Ignored with `parallel_slice_building`.
+	bool unchecked_accesses = false;
+
+	// With `DbWriter::sharded`, start a new database once the current one holds this many slices. 0 means no limit.
+	std::size_t shard_slice_limit = 0;
+
+	// With `DbWriter::sharded`, start a new database for slices that start this many transitions after the first one of
+	// the current database. 0 means no limit.
+	std::uint64_t shard_transition_limit = 0;
+
+	// When set, called with `DbWriter::stats` each time slices are cut, by the thread pushing accesses, for instance to
+	// export them. In async mode, the slices that were just cut are not written yet, so they are not counted.
+	std::function<void(const DbWriterStats&)> stats_callback;
+};
+
+class FlatChunkStorage;
+template <typename Storage> class BasicSliceBuilder;
+template <typename Storage> class BasicSlice;
+using SliceBuilder = BasicSliceBuilder<FlatChunkStorage>;
+using Slice = BasicSlice<FlatChunkStorage>;
 struct ChunkAccess;
-struct AccessInfo;
-struct ChunkWithDescription;
-class Slice;
+class AccessJournal;
+class Sink;
+struct PendingSlices;
+struct IncrementalFlush;
+struct WrittenStats;
+template <typename Job> class AsyncFlusher;
+class SliceBuildWorker;
 
 class DbWriter {
 public:
-	explicit DbWriter(const char* filename, const char* tool_name, const char* tool_version, const char* tool_info);
+	explicit DbWriter(const char* filename, const char* tool_name, const char* tool_version, const char* tool_info,
+	                  const DbWriterOptions& options = DbWriterOptions());
+
+	// Build a DbWriter that hands its slices to `sink` instead of writing a database (see sink.h), for instance to try
+	// other storages, or to measure building slices alone with a NullSink. Options about sqlite are ignored.
+	explicit DbWriter(std::unique_ptr<Sink> sink, const DbWriterOptions& options = DbWriterOptions());
 
 	// Build a DbWriter that writes a non-persistent database into memory
-	static DbWriter from_memory(const char* tool_name, const char* tool_version, const char* tool_info);
+	static DbWriter from_memory(const char* tool_name, const char* tool_version, const char* tool_info,
+	                            const DbWriterOptions& options = DbWriterOptions());
+
+	// Build a DbWriter that writes a columnar file instead of a sqlite database. The file is append-only and much
+	// cheaper to write, but current readers expect sqlite: see `columnar_to_sqlite` in columnar.h.
+	// The file is only readable once `finish` is called, or the writer is destroyed.
+	static DbWriter columnar(const char* filename, const char* tool_name, const char* tool_version,
+	                         const char* tool_info, const DbWriterOptions& options = DbWriterOptions());
+
+	// Build a DbWriter that writes several sqlite databases, the shards, each holding the slices of a range of
+	// transitions: a new one is started when the current one reaches `shard_slice_limit` or `shard_transition_limit`.
+	// `filename` is a manifest listing the complete shards, see shards.h, and shards are written next to it as
+	// `filename.0`, `filename.1`... Complete shards are finished, which includes building deferred indexes, on a
+	// background thread while the next one is written.
+	// Since only the last shard is still open, `discard_after` can only discard accesses from it.
+	static DbWriter sharded(const char* filename, const char* tool_name, const char* tool_version,
+	                        const char* tool_info, const DbWriterOptions& options = DbWriterOptions());
+
+	// Build a DbWriter that appends to the existing database `filename`, for instance to complete a recording after a
+	// crash in `durable_slices` mode: the accesses of the slices being built were lost, and must be pushed again,
+	// starting at `resume_transition()`. Earlier accesses are rejected with std::invalid_argument.
+	// The schema, compact or not, and whether indexes are still to be built are the ones of the database. The other
+	// options apply to the slices written from now on.
+	static DbWriter open_resume(const char* filename, const DbWriterOptions& options = DbWriterOptions());
+
+	// Complete the output like `finish` if it was not done yet. Errors are dropped: call `finish` to get them.
 	~DbWriter();
 	// Due to having a dtor, we MUST explicitly declare the following ctors/operators.
 	DbWriter(DbWriter&&);
@@ -51,46 +271,184 @@ public:
 	// Add a memory access to the database
 	void push(const MemoryAccess& access);
 
+	// Add `count` memory accesses to the database, in order. Equivalent to calling `push` on each of them, but cheaper.
+	void push(const MemoryAccess* accesses, std::size_t count);
+
+	// Add the memory accesses of `columns` to the database, in order, reading them in place. Equivalent to pushing
+	// them as MemoryAccess objects. `release`, when set, is called once the buffers are not used anymore, which is
+	// before returning, even on errors, since the writer keeps its own copy of what it needs.
+	void push(const AccessColumns& columns, const std::function<void()>& release = nullptr);
+
+	// Add a range of memory accesses to the database, in order. Non-contiguous ranges are copied in small batches.
+	template <typename InputIt>
+	void push(InputIt first, InputIt last)
+	{
+		push_range(first, last, std::is_pointer<InputIt>());
+	}
+
+	// Return an estimate of the bytes used by the slices being built and their accesses. This is cheap to call.
+	std::size_t memory_usage() const;
+
+	// Return the first transition that can be pushed: the one after the last slice of the database with
+	// `open_resume`, 0 otherwise.
+	std::uint64_t resume_transition() const { return resume_transition_; }
+
+	// Return what the writer did so far. Must be called by the thread pushing accesses.
+	DbWriterStats stats() const;
+
 	// Remove all accesses that were pushed with a transition >= transition_count
 	// This method allows to cap the number of allowed transitions in a database after the fact.
 	// It is in particular meant to help with the case of the final transition, which may be incomplete (as in, it
 	// doesn't produce the final state).
+	// Accesses of the slices being built are dropped before they are written, and only the accesses of written slices
+	// cost a delete in the output.
 	// Note that calling `push` after calling this method is not defined.
 	void discard_after(std::uint64_t transition_count);
 
+	// Write all remaining slices and return the database. In async mode, this waits for the background writer.
+	// Throw std::logic_error if the writer does not write to sqlite.
 	sqlite::ResourceDatabase take() &&;
 
+	// Write all remaining slices and complete the output. In async mode, this waits for the background writer.
+	void finish() &&;
+
 private:
+
+	template <typename InputIt>
+	void push_range(InputIt first, InputIt last, std::true_type /* is_pointer */)
+	{
+		push(first, static_cast<std::size_t>(last - first));
+	}
+
+	template <typename InputIt>
+	void push_range(InputIt first, InputIt last, std::false_type /* is_pointer */)
+	{
+		std::array<MemoryAccess, 256> batch;
+		std::size_t count = 0;
+		for (; first != last; ++first) {
+			batch[count++] = *first;
+			if (count == batch.size()) {
+				push(batch.data(), count);
+				count = 0;
+			}
+		}
+		push(batch.data(), count);
+	}
+
+	// Owner of the background writer thread used in async mode, which works on this object's members.
+	// Moving it waits for the thread to write all pending slices, then stops it: a new thread is started on demand by
+	// the new owner. Errors from the writer are kept, to be rethrown by `join` or the next submission.
+	class AsyncFlusherHandle {
+	public:
+		AsyncFlusherHandle();
+		AsyncFlusherHandle(AsyncFlusherHandle&& other);
+		AsyncFlusherHandle& operator=(AsyncFlusherHandle&& other);
+		~AsyncFlusherHandle();
+
+		// Wait for all pending slices to be written and stop the thread. Rethrow any error from the writer.
+		void join();
+
+		std::unique_ptr<AsyncFlusher<PendingSlices>> flusher;
+		std::exception_ptr error;
+	};
+
+	friend PendingSlices;
+
+	// Why slices are cut, when not because of the limits of the builders.
+	enum class Cut { Limit, MemoryBudget, Capacity, Final };
+
 	// Instantiate the slice builders.
 	// Note: `read_slice_builder_` and `write_slice_builder_` pointers are valid after calling this method.
 	void create_slices();
 
-	// Will push the slices being built into database.
+	// Whether there are accesses to cut slices after, and they used up `memory_budget`.
+	bool over_memory_budget() const;
+
+	// `push` of the `count` accesses of `input`, which gives their fields by index like AccessColumns (see
+	// db_writer.cpp), so that all inputs share the same loop. Picks the insertion policy of the builders that does only
+	// the checks the options need, since each is a separate instantiation of the loop.
+	template <typename Input>
+	void push_input(const Input& input, std::size_t count);
+
+	// `push_input` with the insertion policy `Policy`, see slice.h.
+	template <typename Policy, typename Input>
+	void push_input_with(const Input& input, std::size_t count);
+
+	// `push_input` when building slices on worker threads.
+	template <typename Input>
+	void push_input_to_workers(const Input& input, std::size_t count);
+
+	// Push the slices being built and start new ones.
+	// Note: `read_slice_builder_` and `write_slice_builder_` pointers will change after calling this method.
+	void cut_slices(Cut cut);
+
+	// Make room for `count` more accesses in `journal_`, keeping geometric growth.
+	void reserve_accesses(std::size_t count);
+
+	// Will push the slices being built into database, or hand them to the background writer in async mode.
 	// Note: `read_slice_builder_` and `write_slice_builder_` pointers are not valid after calling this method.
-	void insert_slices();
+	void insert_slices(Cut cut);
+
+	// Build the slices and write them, with their accesses, to the sink.
+	void write_slices(PendingSlices& pending);
+
+	// Build the slices of `pending` if needed.
+	void build_slices(PendingSlices& pending);
 
-	using ChunkAccessToRowId = std::unordered_map<const ChunkAccess*, std::uint64_t>;
+	// In incremental flush mode, write the next rows of the slices being written, if any.
+	void step_incremental_flush();
 
-	// Will insert chunks from both slices in the database and return a map of ChunkAccess -> corresponding chunk rowid
-	void insert_chunks(const Slice& read_slice, const Slice& write_slice, std::uint64_t slice_id);
+	// In incremental flush mode, write what is left of the slices being written, if any.
+	void complete_incremental_flush();
 
-	// Will insert chunks from both slices in the database and return a map of ChunkAccess -> corresponding chunk rowid
-	void insert_accesses();
+	// Add written slices to the stats.
+	void record_written(const PendingSlices& pending);
 
-	sqlite::ResourceDatabase db_;
-	sqlite::Statement insert_slice_stmt_;
-	sqlite::Statement insert_chunk_stmt_;
-	sqlite::Statement insert_access_stmt_;
+	// Write all remaining slices, wait for them to be written and complete the output.
+	void finish_sink();
+
+	// Drop the accesses with a transition >= transition_count from the slices being built.
+	void discard_open_accesses_after(std::uint64_t transition_count);
+
+	// Wait for the slices requested from the workers. On error, keep it in `worker_error_` and rethrow it.
+	void take_worker_slices(Slice* read_slice, Slice* write_slice);
+
+	// Rethrow `worker_error_`, if any.
+	void check_worker_error() const;
+
+	// Declared first so that it is moved before any member the background writer uses.
+	AsyncFlusherHandle async_flusher_;
+
+	// Slices being written in incremental flush mode, null when there are none.
+	std::unique_ptr<IncrementalFlush> incremental_flush_;
+
+	DbWriterOptions options_;
+
+	// Where slices are written. Null once the output is complete.
+	std::unique_ptr<Sink> sink_;
 
 	// Both builders are pimpl, since Slice objects are implementation details.
 	std::unique_ptr<SliceBuilder> read_slice_builder_;
 	std::unique_ptr<SliceBuilder> write_slice_builder_;
+	// Replace the builders when building slices on worker threads.
+	std::unique_ptr<SliceBuildWorker> read_worker_;
+	std::unique_ptr<SliceBuildWorker> write_worker_;
+	// Transition of the last pushed access.
+	std::uint64_t last_transition_ = 0;
+	// Transition after the last access handed to the sink, 0 if none was.
+	std::uint64_t written_transition_end_ = 0;
+	// See `resume_transition`.
+	std::uint64_t resume_transition_ = 0;
+
+	std::uint64_t read_access_count_ = 0;
+	std::uint64_t write_access_count_ = 0;
+	// Stats of written slices, updated by whichever thread writes them.
+	std::unique_ptr<WrittenStats> written_stats_;
 
-	std::vector<AccessInfo> current_access_list_;
-	// scratch-space for reuse without allocation during chunk insertion
-	std::vector<ChunkWithDescription> chunk_list_;
-	// The map between the chunk accesses and their ID, this is cleaned at each insert_slices() call
-	ChunkAccessToRowId access_to_chunk_id_;
+	// Accesses of the slices being built, in their order of appearance.
+	std::unique_ptr<AccessJournal> journal_;
+	// Error of a worker, after which the slices being built are lost and the writer only throws it.
+	std::exception_ptr worker_error_;
 };
 
 }}}} // namespace reven::backend::memaccess::db
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "db_writer.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+// Lets several threads push accesses to a DbWriter, for instance one per replayed segment of a trace.
+//
+// Each producer thread pushes to its own Producer, which buffers accesses and hands them over in batches. A merger
+// thread pushes them to the DbWriter in order of transition, so that producers do not share any lock while pushing.
+//
+// The accesses of a producer must be in order of transition, and two producers should not push accesses of the same
+// transition: their accesses would then be interleaved. To know what it can push to the DbWriter, the merger waits
+// for each producer that is not closed to push an access, or to call `advance`, past that point: an idle producer must
+// call `advance` or `close` for the others to go on.
+class MultiProducerWriter {
+public:
+	class Producer {
+	public:
+		Producer(const Producer&) = delete;
+		Producer& operator=(const Producer&) = delete;
+
+		// Add accesses. Throw std::invalid_argument if they are not in order of transition, and rethrow the first error
+		// of the DbWriter, if any.
+		void push(const MemoryAccess& access);
+		void push(const MemoryAccess* accesses, std::size_t count);
+
+		// Tell that the next accesses of this producer will have a transition >= `transition`. This lets the merger
+		// push the accesses of other producers up to there, without waiting for this one.
+		void advance(std::uint64_t transition);
+
+		// Tell that this producer will not push any more accesses.
+		void close();
+
+	private:
+		friend MultiProducerWriter;
+		struct Shared;
+
+		Producer(Shared& shared, std::size_t index);
+
+		// Hand the buffered accesses over to the merger, along with the point before which no access will be pushed.
+		void submit(std::uint64_t watermark, bool closing);
+
+		Shared* shared_;
+		std::size_t index_;
+		std::vector<MemoryAccess> batch_;
+		std::uint64_t last_transition_ = 0;
+		bool closed_ = false;
+	};
+
+	MultiProducerWriter(DbWriter writer, std::size_t producer_count);
+
+	// Stop the merger without waiting for producers. Accesses that were not merged yet are dropped.
+	~MultiProducerWriter();
+
+	MultiProducerWriter(const MultiProducerWriter&) = delete;
+	MultiProducerWriter& operator=(const MultiProducerWriter&) = delete;
+
+	// Return a producer, to be used by a single thread at a time.
+	Producer& producer(std::size_t index);
+
+	// Close the producers that are not, wait for all accesses to be pushed, and return the writer. Producers must be
+	// done pushing. Rethrow the first error of the DbWriter, if any.
+	DbWriter finish() &&;
+
+private:
+	std::unique_ptr<Producer::Shared> shared_;
+	std::vector<std::unique_ptr<Producer>> producers_;
+};
+
+}}}} // namespace reven::backend::memaccess::db
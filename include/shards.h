@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+constexpr const char* shard_manifest_version = "1.0.0";
+
+// A database written by a DbWriter created with `DbWriter::sharded`. Shards do not overlap, and each one holds all the
+// slices of its range of transitions, so they can be queried independently.
+struct Shard {
+	// Path of the database. It is relative to the manifest when written, and resolved by `read_shard_manifest`.
+	std::string filename;
+	std::uint64_t transition_first;
+	std::uint64_t transition_last;
+};
+
+// Return the shards listed in a manifest, in order of transition. Only complete shards are listed, so this can be
+// called while the writer is still running.
+// Throw std::runtime_error if the manifest cannot be read.
+std::vector<Shard> read_shard_manifest(const char* manifest_filename);
+
+}}}} // namespace reven::backend::memaccess::db
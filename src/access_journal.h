@@ -0,0 +1,118 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * The accesses of a slice in their order of appearance, which is lost by the Slice objects but required when inserting
+ * them in the database.
+ *
+ * Accesses are stored column by column, so that writing them to the database is a sequential scan over contiguous
+ * buffers. Chunk accesses only keep the index of their entry.
+ */
+class AccessJournal
+{
+public:
+	using Index = std::uint32_t;
+
+	/**
+	 * Append an access and return its index.
+	 */
+	Index push_back(std::uint64_t transition, std::uint64_t physical_address, std::uint64_t virtual_address,
+	                bool has_virtual_address, std::uint32_t size, std::uint8_t operation)
+	{
+		if (transitions_.size() == std::numeric_limits<Index>::max()) {
+			throw std::length_error("AccessJournal: too many accesses");
+		}
+
+		transitions_.push_back(transition);
+		physical_addresses_.push_back(physical_address);
+		virtual_addresses_.push_back(virtual_address);
+		has_virtual_addresses_.push_back(has_virtual_address);
+		sizes_.push_back(size);
+		operations_.push_back(operation);
+		chunk_ids_.push_back(0);
+		return static_cast<Index>(transitions_.size() - 1);
+	}
+
+	/**
+	 * Make room for `count` more accesses, keeping geometric growth.
+	 */
+	void reserve_more(std::size_t count)
+	{
+		auto size = transitions_.size();
+		if (transitions_.capacity() - size >= count)
+			return;
+
+		auto capacity = std::max(size + count, 2 * transitions_.capacity());
+		transitions_.reserve(capacity);
+		physical_addresses_.reserve(capacity);
+		virtual_addresses_.reserve(capacity);
+		has_virtual_addresses_.reserve(capacity);
+		sizes_.reserve(capacity);
+		operations_.reserve(capacity);
+		chunk_ids_.reserve(capacity);
+	}
+
+	/**
+	 * Drop the accesses from index `count` on. Capacity is kept.
+	 */
+	void truncate(std::size_t count)
+	{
+		if (count >= transitions_.size())
+			return;
+
+		transitions_.resize(count);
+		physical_addresses_.resize(count);
+		virtual_addresses_.resize(count);
+		has_virtual_addresses_.resize(count);
+		sizes_.resize(count);
+		operations_.resize(count);
+		chunk_ids_.resize(count);
+	}
+
+	std::size_t size() const { return transitions_.size(); }
+	bool empty() const { return transitions_.empty(); }
+
+	/**
+	 * Return the bytes allocated by the journal.
+	 */
+	std::size_t memory_usage() const
+	{
+		constexpr std::size_t entry_size = 4 * sizeof(std::uint64_t) + sizeof(std::uint32_t) + 2 * sizeof(std::uint8_t);
+		return transitions_.capacity() * entry_size;
+	}
+
+	std::uint64_t transition(Index i) const { return transitions_[i]; }
+	std::uint64_t physical_address(Index i) const { return physical_addresses_[i]; }
+	std::uint64_t virtual_address(Index i) const { return virtual_addresses_[i]; }
+	bool has_virtual_address(Index i) const { return has_virtual_addresses_[i]; }
+	std::uint32_t size(Index i) const { return sizes_[i]; }
+	// Operation as is supposed to be inserted in the database.
+	std::uint8_t operation(Index i) const { return operations_[i]; }
+
+	/**
+	 * Id of the chunk the access belongs to, as set by the sink writing it, or 0 until it is set.
+	 */
+	std::uint64_t chunk_id(Index i) const { return chunk_ids_[i]; }
+	void set_chunk_id(Index i, std::uint64_t chunk_id) { chunk_ids_[i] = chunk_id; }
+
+private:
+	std::vector<std::uint64_t> transitions_;
+	std::vector<std::uint64_t> physical_addresses_;
+	std::vector<std::uint64_t> virtual_addresses_;
+	std::vector<std::uint8_t> has_virtual_addresses_;
+	std::vector<std::uint32_t> sizes_;
+	std::vector<std::uint8_t> operations_;
+	std::vector<std::uint64_t> chunk_ids_;
+};
+
+}}}}
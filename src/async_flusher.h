@@ -0,0 +1,140 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * Runs a writer function on a dedicated thread for each submitted job, in order of submission.
+ *
+ * At most `queue_depth` jobs can be waiting: `submit` blocks until there is room, which caps the memory held by pending
+ * jobs. Jobs are destroyed on the writer thread once written.
+ *
+ * If the writer throws, pending jobs are dropped and the exception is rethrown by every subsequent call to `submit` or
+ * `wait`.
+ */
+template <typename Job>
+class AsyncFlusher
+{
+public:
+	using Writer = std::function<void(Job&)>;
+
+	AsyncFlusher(std::size_t queue_depth, Writer writer)
+	  : queue_depth_(queue_depth)
+	  , writer_(std::move(writer))
+	  , thread_([this]() { run(); })
+	{
+	}
+
+	AsyncFlusher(const AsyncFlusher&) = delete;
+	AsyncFlusher& operator=(const AsyncFlusher&) = delete;
+
+	/**
+	 * Write the remaining jobs, then stop the thread. Errors are not rethrown; see `error`.
+	 */
+	~AsyncFlusher() { stop(); }
+
+	void submit(Job&& job)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		not_full_.wait(lock, [this]() { return error_ or queue_.size() < queue_depth_; });
+		if (error_)
+			std::rethrow_exception(error_);
+
+		queue_.push_back(std::move(job));
+		not_empty_.notify_one();
+	}
+
+	/**
+	 * Block until all submitted jobs are written.
+	 */
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		idle_.wait(lock, [this]() { return error_ or (queue_.empty() and not busy_); });
+		if (error_)
+			std::rethrow_exception(error_);
+	}
+
+	/**
+	 * Write the remaining jobs, then stop the thread. Further submissions are not allowed.
+	 */
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		not_empty_.notify_one();
+		if (thread_.joinable())
+			thread_.join();
+	}
+
+	std::exception_ptr error() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		return error_;
+	}
+
+private:
+	void run()
+	{
+		for (;;) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				not_empty_.wait(lock, [this]() { return stopping_ or not queue_.empty(); });
+				if (queue_.empty())
+					return;
+
+				job = std::move(queue_.front());
+				queue_.pop_front();
+				busy_ = true;
+			}
+			not_full_.notify_one();
+
+			try {
+				writer_(job);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(mutex_);
+				error_ = std::current_exception();
+				queue_.clear();
+				busy_ = false;
+				not_full_.notify_all();
+				idle_.notify_all();
+				return;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				busy_ = false;
+			}
+			idle_.notify_all();
+		}
+	}
+
+	const std::size_t queue_depth_;
+	Writer writer_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable not_empty_;
+	std::condition_variable not_full_;
+	std::condition_variable idle_;
+	std::deque<Job> queue_;
+	bool busy_ = false;
+	bool stopping_ = false;
+	std::exception_ptr error_;
+
+	// Last, so that it starts once everything else is initialized.
+	std::thread thread_;
+};
+
+}}}}
@@ -1,6 +1,10 @@
 #pragma once
 
 #include <vector>
+#include <memory>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
 #include <cstdint>
 
 namespace reven {
@@ -9,74 +13,152 @@ namespace memaccess {
 namespace db {
 
 class Chunk;
+class ChunkAccessPool;
 
 /**
- * This is the representation for an access. It is intrusively linked because the author could not make a performant use
- * of the std lists objects.
+ * Index of an access in its ChunkAccessPool. 32 bits are plenty since DbWriter cuts slices before they reach 4G
+ * accesses.
+ */
+using ChunkAccessIndex = std::uint32_t;
+
+/**
+ * Index of an access in the AccessJournal of its slice, where the access itself is stored.
+ */
+using JournalIndex = std::uint32_t;
+
+/**
+ * This is the representation for an access in a chunk. It is intrusively linked because the author could not make a
+ * performant use of the std lists objects. Links are indices in the owning ChunkAccessPool rather than pointers, so that
+ * nodes can be allocated in bulk and released all at once with the pool.
+ *
+ * Nodes only link the accesses of a chunk together: the accesses themselves are found in the journal of the slice.
  */
 struct ChunkAccess {
-	ChunkAccess(std::uint64_t transition, std::uint64_t address, std::uint32_t size)
-	  : transition(transition)
-	  , address(address)
-	  , size(size)
+	explicit ChunkAccess(JournalIndex journal_index)
+	  : journal_index(journal_index)
+	{
+	}
+
+	JournalIndex journal_index;
+
+private:
+	static constexpr ChunkAccessIndex no_next = std::numeric_limits<ChunkAccessIndex>::max();
+
+	ChunkAccessIndex next_ = no_next;
+	friend Chunk;
+	friend ChunkAccessPool;
+};
+
+/**
+ * Arena handing out ChunkAccess nodes from big blocks. Nodes never move once allocated, so pointers to them stay valid
+ * until the pool is destroyed, and there is no per-node deallocation: everything is released at once with the pool.
+ */
+class ChunkAccessPool
+{
+public:
+	ChunkAccessPool() = default;
+	ChunkAccessPool(const ChunkAccessPool&) = delete;
+	ChunkAccessPool& operator=(const ChunkAccessPool&) = delete;
+
+	/**
+	 * Allocate a new, unlinked access and return its index.
+	 */
+	ChunkAccessIndex emplace(JournalIndex journal_index)
+	{
+		if (size_ == ChunkAccess::no_next) {
+			throw std::length_error("ChunkAccessPool: too many accesses");
+		}
+
+		if ((size_ & block_mask) == 0) {
+			blocks_.emplace_back(static_cast<ChunkAccess*>(::operator new(block_size * sizeof(ChunkAccess))));
+		}
+
+		new (&blocks_.back()[size_ & block_mask]) ChunkAccess(journal_index);
+		return size_++;
+	}
+
+	ChunkAccess& operator[](ChunkAccessIndex index) { return blocks_[index >> block_bits][index & block_mask]; }
+	const ChunkAccess& operator[](ChunkAccessIndex index) const { return blocks_[index >> block_bits][index & block_mask]; }
+
+	/**
+	 * Return a valid pointer to the access following `access` in its chunk, or `nullptr` if this is the last element.
+	 */
+	const ChunkAccess* next(const ChunkAccess& access) const
 	{
+		return access.next_ == ChunkAccess::no_next ? nullptr : &(*this)[access.next_];
 	}
 
-	std::uint64_t transition;
-	std::uint64_t address;
-	std::uint32_t size;
+	ChunkAccess* next(const ChunkAccess& access)
+	{
+		return access.next_ == ChunkAccess::no_next ? nullptr : &(*this)[access.next_];
+	}
 
 	/**
-	 * Return a valid pointer to the next item in the list, or `nullptr` if this is the last element.
+	 * Return the number of accesses allocated so far.
 	 */
-	const ChunkAccess* next() const { return next_.get(); }
+	std::size_t size() const { return size_; }
 
 	/**
-	 * Return a valid pointer to the next item in the list, or `nullptr` if this is the last element.
+	 * Return the bytes used by the accesses allocated so far. The unused end of the last block is not counted: its
+	 * pages are only touched as accesses are allocated, and it would otherwise use up small memory budgets on its own.
 	 */
-	ChunkAccess* next() { return next_.get(); }
+	std::size_t memory_usage() const
+	{
+		return size_ * sizeof(ChunkAccess) + blocks_.capacity() * sizeof(blocks_[0]);
+	}
 
 private:
-	std::unique_ptr<ChunkAccess> next_;
-	friend Chunk;
+	// ChunkAccess is trivially destructible, so blocks are released as raw memory.
+	struct BlockDeleter {
+		void operator()(ChunkAccess* block) const { ::operator delete(block); }
+	};
+
+	static constexpr std::uint32_t block_bits = 16;
+	static constexpr std::uint32_t block_size = 1u << block_bits;
+	static constexpr std::uint32_t block_mask = block_size - 1;
+
+	std::vector<std::unique_ptr<ChunkAccess[], BlockDeleter>> blocks_;
+	ChunkAccessIndex size_ = 0;
 };
 
 /**
  * This is a chunk. Note that it is supposed to be part of a slice, so it does not store the bounding transitions.
+ *
+ * Accesses are allocated from a ChunkAccessPool that must outlive the chunk.
  */
 class Chunk
 {
 public:
 	/**
-	 * Spawn a new chunk from a single access.
+	 * Spawn a new chunk from a single access, stored at `journal_index` in the journal of the slice.
 	 */
-	Chunk(std::uint64_t transition, std::uint64_t address, std::uint32_t size)
-		: address_first_(address), address_last_(address + size - 1)
+	Chunk(ChunkAccessPool& pool, JournalIndex journal_index, std::uint64_t address, std::uint32_t size)
+		: address_first_(address), address_last_(address + size - 1), pool_(&pool)
 	{
-		accesses_ = std::make_unique<ChunkAccess>(transition, address, size);
-		last_access_ = accesses_.get();
+		first_access_ = pool.emplace(journal_index);
+		last_access_ = first_access_;
 		size_ = 1;
 	}
 
 	Chunk(Chunk&& other) = default;
-
-	~Chunk()
-	{
-		// Manually unwind nested ptr to avoid stack overflow while browsing destructors
-		while (accesses_) {
-			accesses_ = std::move(accesses_->next_);
-		}
-	}
+	Chunk& operator=(Chunk&& other) = default;
 
 	std::uint64_t address_first() const { return address_first_; }
 	std::uint64_t address_last() const { return address_last_; }
 	std::uint64_t address_size() const { return address_last_ - address_first_ + 1; }
 
 	/**
-	 * Return the first access known. You can iterate on accesses by calling ChunkAccess::next(), until it returns
-	 * nullptr. The returned pointer and its siblings are valid as long as the Chunk is valid.
+	 * Return the first access known. You can iterate on accesses by calling Chunk::next(), until it returns
+	 * nullptr. The returned pointer and its siblings are valid as long as the pool is valid.
+	 */
+	const ChunkAccess* accesses() const { return &(*pool_)[first_access_]; }
+	ChunkAccess* accesses() { return &(*pool_)[first_access_]; }
+
+	/**
+	 * Return a valid pointer to the access following `access`, or `nullptr` if this is the last element.
 	 */
-	const ChunkAccess* accesses() const { return accesses_.get(); }
+	const ChunkAccess* next(const ChunkAccess* access) const { return pool_->next(*access); }
+	ChunkAccess* next(const ChunkAccess* access) { return pool_->next(*access); }
 
 	/**
 	 * Return the number of accesses stored
@@ -105,24 +187,53 @@ public:
 
 	/**
 	 * Merge a chunk in. The other chunk's accesses will be moved in 0(1), and their pointers will remain valid.
+	 * Both chunks must share the same pool.
 	 */
 	void merge_in(Chunk&& other)
 	{
-		address_first_ = std::min(address_first(), other.address_first());
-		address_last_ = std::max(address_last(), other.address_last());
-		if (last_access_->next_)
+		if (pool_ != other.pool_)
+			throw std::logic_error("Cannot merge chunks from different pools");
+		auto& last = (*pool_)[last_access_];
+		if (last.next_ != ChunkAccess::no_next)
 			throw std::logic_error("Current next is not null");
-		if (other.last_access_->next_)
+		if ((*pool_)[other.last_access_].next_ != ChunkAccess::no_next)
 			throw std::logic_error("Other next is not null");
-		last_access_->next_ = std::move(other.accesses_);
+		address_first_ = std::min(address_first(), other.address_first());
+		address_last_ = std::max(address_last(), other.address_last());
+		last.next_ = other.first_access_;
 		last_access_ = other.last_access_;
 		size_ += other.size();
 	}
 
+	/**
+	 * Add an access that lies within the bounds of the chunk, which are thus left untouched. Return the new access.
+	 */
+	const ChunkAccess* add_access(JournalIndex journal_index)
+	{
+		auto index = pool_->emplace(journal_index);
+		(*pool_)[last_access_].next_ = index;
+		last_access_ = index;
+		++size_;
+		return &(*pool_)[index];
+	}
+
+	/**
+	 * Like `merge_in`, for a chunk of the same pool that starts after this one. As this is meant for hot loops where
+	 * this is known to hold, nothing is checked.
+	 */
+	void append(Chunk&& other)
+	{
+		(*pool_)[last_access_].next_ = other.first_access_;
+		last_access_ = other.last_access_;
+		address_last_ = std::max(address_last_, other.address_last_);
+		size_ += other.size_;
+	}
+
 private:
 	std::uint64_t address_first_, address_last_;
-	std::unique_ptr<ChunkAccess> accesses_;
-	ChunkAccess* last_access_;
+	ChunkAccessPool* pool_;
+	ChunkAccessIndex first_access_;
+	ChunkAccessIndex last_access_;
 	std::size_t size_;
 };
 
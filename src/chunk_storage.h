@@ -0,0 +1,387 @@
+#pragma once
+
+#include <map>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <cstdint>
+
+#include "chunk.h"
+#include "simd_scan.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * Chunk storages keep the chunks of a slice sorted by address. Chunks of a storage never overlap, so they are sorted by
+ * both `address_first` and `address_last`.
+ *
+ * A storage must provide:
+ *  - `iterator` / `const_iterator`, bidirectional iterators dereferencing to `Chunk`, and `begin()` / `end()` / `size()` /
+ *    `empty()`;
+ *  - `lower_bound_by_last(address)`: the first chunk whose `address_last` is >= `address`, ie the first chunk that may
+ *    overlap a range starting at `address`;
+ *  - `replace(first, last, chunk)`: replace the chunks in `[first, last)` (possibly empty) with `chunk`, which must fit
+ *    between the neighbours of that range. Return an iterator to the inserted chunk;
+ *  - `upper_bound_by_first(it, address)`: the first chunk from `it` whose `address_first` is > `address`, ie the end of
+ *    the chunks a range ending at `address` may overlap, when `it` is the first one;
+ *  - `compact(should_merge)`: in a single pass, append each chunk to the previous one, as in `Chunk::append`, whenever
+ *    `should_merge(previous, chunk)` is true. `previous` is the chunk resulting from previous merges;
+ *  - `add_access(it, journal_index)`: add an access within the bounds of `*it`, as in `Chunk::add_access`;
+ *  - `memory_usage()`: an estimate of the bytes allocated by the storage for its chunks, computed in O(1).
+ *
+ * Chunks must not be modified through iterators, since storages may keep some of their bounds on the side.
+ * `add_access` is the exception, as it does not change bounds. Likewise, it does not invalidate iterators.
+ */
+
+/**
+ * Storage based on `std::map`, keyed by `address_first`. Simple, but each chunk is a separate tree node.
+ */
+class MapChunkStorage
+{
+	using Map = std::map<std::uint64_t, Chunk>;
+
+	template <typename MapIterator, typename Value>
+	class Iterator
+	{
+	public:
+		using iterator_category = std::bidirectional_iterator_tag;
+		using value_type = Chunk;
+		using difference_type = std::ptrdiff_t;
+		using pointer = Value*;
+		using reference = Value&;
+
+		Iterator() = default;
+		explicit Iterator(MapIterator it) : it_(it) {}
+		// Allow iterator -> const_iterator
+		template <typename OtherIterator, typename OtherValue>
+		Iterator(const Iterator<OtherIterator, OtherValue>& other) : it_(other.it_) {}
+
+		reference operator*() const { return it_->second; }
+		pointer operator->() const { return &it_->second; }
+		Iterator& operator++() { ++it_; return *this; }
+		Iterator operator++(int) { auto tmp = *this; ++it_; return tmp; }
+		Iterator& operator--() { --it_; return *this; }
+		Iterator operator--(int) { auto tmp = *this; --it_; return tmp; }
+		bool operator==(const Iterator& other) const { return it_ == other.it_; }
+		bool operator!=(const Iterator& other) const { return it_ != other.it_; }
+
+	private:
+		MapIterator it_;
+		template <typename, typename> friend class Iterator;
+		friend MapChunkStorage;
+	};
+
+public:
+	using iterator = Iterator<Map::iterator, Chunk>;
+	using const_iterator = Iterator<Map::const_iterator, const Chunk>;
+
+	iterator begin() { return iterator(chunks_.begin()); }
+	iterator end() { return iterator(chunks_.end()); }
+	const_iterator begin() const { return const_iterator(chunks_.cbegin()); }
+	const_iterator end() const { return const_iterator(chunks_.cend()); }
+
+	std::size_t size() const { return chunks_.size(); }
+	bool empty() const { return chunks_.empty(); }
+
+	iterator lower_bound_by_last(std::uint64_t address)
+	{
+		auto next = chunks_.upper_bound(address);
+		if (next != chunks_.begin()) {
+			auto previous = std::prev(next);
+			if (previous->second.address_last() >= address)
+				return iterator(previous);
+		}
+		return iterator(next);
+	}
+
+	iterator upper_bound_by_first(iterator, std::uint64_t address) { return iterator(chunks_.upper_bound(address)); }
+
+	iterator replace(iterator first, iterator last, Chunk&& chunk)
+	{
+		auto hint = chunks_.erase(first.it_, last.it_);
+		auto key = chunk.address_first();
+		return iterator(chunks_.emplace_hint(hint, key, std::move(chunk)));
+	}
+
+	template <typename ShouldMerge>
+	void compact(ShouldMerge should_merge)
+	{
+		if (chunks_.empty())
+			return;
+
+		auto current = chunks_.begin();
+		for (auto next = std::next(current); next != chunks_.end();) {
+			if (should_merge(static_cast<const Chunk&>(current->second), static_cast<const Chunk&>(next->second))) {
+				current->second.append(std::move(next->second));
+				next = chunks_.erase(next);
+			} else {
+				current = next++;
+			}
+		}
+	}
+
+	const ChunkAccess* add_access(iterator it, JournalIndex journal_index) { return it->add_access(journal_index); }
+
+	std::size_t memory_usage() const
+	{
+		// Each tree node holds the value, three pointers and the color
+		return chunks_.size() * (sizeof(Map::value_type) + 4 * sizeof(void*));
+	}
+
+private:
+	Map chunks_;
+};
+
+/**
+ * Storage based on a sorted sequence of small contiguous blocks of chunks, a flat two-level B-tree of sorts.
+ *
+ * Lookups are binary searches over two contiguous arrays instead of a pointer chase, and insertions or removals only
+ * move the chunks of a single, small block.
+ */
+class FlatChunkStorage
+{
+	using Block = std::vector<Chunk>;
+
+	template <typename Storage, typename Value>
+	class Iterator
+	{
+	public:
+		using iterator_category = std::bidirectional_iterator_tag;
+		using value_type = Chunk;
+		using difference_type = std::ptrdiff_t;
+		using pointer = Value*;
+		using reference = Value&;
+
+		Iterator() = default;
+		Iterator(Storage* storage, std::size_t block, std::size_t index)
+		  : storage_(storage), block_(block), index_(index) {}
+		// Allow iterator -> const_iterator
+		template <typename OtherStorage, typename OtherValue>
+		Iterator(const Iterator<OtherStorage, OtherValue>& other)
+		  : storage_(other.storage_), block_(other.block_), index_(other.index_) {}
+
+		reference operator*() const { return storage_->blocks_[block_][index_]; }
+		pointer operator->() const { return &**this; }
+		Iterator& operator++()
+		{
+			if (++index_ == storage_->blocks_[block_].size()) {
+				++block_;
+				index_ = 0;
+			}
+			return *this;
+		}
+		Iterator operator++(int) { auto tmp = *this; ++*this; return tmp; }
+		Iterator& operator--()
+		{
+			if (index_ == 0) {
+				--block_;
+				index_ = storage_->blocks_[block_].size();
+			}
+			--index_;
+			return *this;
+		}
+		Iterator operator--(int) { auto tmp = *this; --*this; return tmp; }
+		bool operator==(const Iterator& other) const { return block_ == other.block_ and index_ == other.index_; }
+		bool operator!=(const Iterator& other) const { return not (*this == other); }
+
+	private:
+		Storage* storage_ = nullptr;
+		std::size_t block_ = 0;
+		std::size_t index_ = 0;
+		template <typename, typename> friend class Iterator;
+		friend FlatChunkStorage;
+	};
+
+public:
+	using iterator = Iterator<FlatChunkStorage, Chunk>;
+	using const_iterator = Iterator<const FlatChunkStorage, const Chunk>;
+
+	/**
+	 * Maximum amount of chunks in a block before it is split in two.
+	 */
+	static constexpr std::size_t block_capacity = 256;
+
+	iterator begin() { return iterator(this, 0, 0); }
+	iterator end() { return iterator(this, blocks_.size(), 0); }
+	const_iterator begin() const { return const_iterator(this, 0, 0); }
+	const_iterator end() const { return const_iterator(this, blocks_.size(), 0); }
+
+	std::size_t size() const { return size_; }
+	bool empty() const { return size_ == 0; }
+
+	iterator lower_bound_by_last(std::uint64_t address)
+	{
+		auto block = simd::lower_bound(block_lasts_.data(), block_lasts_.size(), address);
+		if (block == block_lasts_.size())
+			return end();
+
+		const auto& chunks = blocks_[block];
+		auto chunk_it = std::lower_bound(chunks.begin(), chunks.end(), address,
+		                                 [](const Chunk& c, std::uint64_t a) { return c.address_last() < a; });
+		return iterator(this, block, static_cast<std::size_t>(chunk_it - chunks.begin()));
+	}
+
+	/**
+	 * Most ranges overlap no chunk, or a few, which are checked one by one. Wide ones skip the blocks they cover
+	 * entirely, by their last address, then search the block they end in.
+	 */
+	iterator upper_bound_by_first(iterator it, std::uint64_t address)
+	{
+		for (std::size_t step = 0; step < 4; ++step, ++it) {
+			if (it == end() or it->address_first() > address)
+				return it;
+		}
+
+		auto block = it.block_;
+		auto index = it.index_;
+		for (; block < blocks_.size(); ++block, index = 0) {
+			if (block_lasts_[block] <= address)
+				continue;
+
+			const auto& chunks = blocks_[block];
+			auto chunk_it = std::upper_bound(chunks.begin() + static_cast<std::ptrdiff_t>(index), chunks.end(), address,
+			                                 [](std::uint64_t a, const Chunk& c) { return a < c.address_first(); });
+			// The end of a block is the start of the next one, as `operator++` goes
+			if (chunk_it == chunks.end())
+				return iterator(this, block + 1, 0);
+			return iterator(this, block, static_cast<std::size_t>(chunk_it - chunks.begin()));
+		}
+		return end();
+	}
+
+	iterator replace(iterator first, iterator last, Chunk&& chunk)
+	{
+		if (first == last)
+			return insert(first, std::move(chunk));
+
+		auto next = std::next(first);
+		erase(next, last);
+		*first = std::move(chunk);
+		refresh_block_last(first.block_);
+		return first;
+	}
+
+	/**
+	 * Chunks are compacted in place, one block at a time, so only chunks following a merge in their own block are
+	 * moved. Merged chunks are dropped all at once at the end of each block, instead of being erased one by one.
+	 */
+	template <typename ShouldMerge>
+	void compact(ShouldMerge should_merge)
+	{
+		// Chunk being merged into. It is not moved anymore once set, since blocks are only truncated.
+		Chunk* current = nullptr;
+		for (auto& chunks : blocks_) {
+			std::size_t write = 0;
+			for (std::size_t index = 0; index < chunks.size(); ++index) {
+				auto& next = chunks[index];
+				if (current and should_merge(static_cast<const Chunk&>(*current), static_cast<const Chunk&>(next))) {
+					current->append(std::move(next));
+					--size_;
+					continue;
+				}
+
+				if (write != index)
+					chunks[write] = std::move(next);
+				current = &chunks[write++];
+			}
+			chunks.erase(chunks.begin() + static_cast<std::ptrdiff_t>(write), chunks.end());
+		}
+
+		blocks_.erase(std::remove_if(blocks_.begin(), blocks_.end(), [](const Block& b) { return b.empty(); }),
+		              blocks_.end());
+		block_lasts_.resize(blocks_.size());
+		for (std::size_t block = 0; block < blocks_.size(); ++block)
+			refresh_block_last(block);
+	}
+
+	const ChunkAccess* add_access(iterator it, JournalIndex journal_index) { return it->add_access(journal_index); }
+
+	std::size_t memory_usage() const
+	{
+		// Blocks never grow beyond the capacity they reserve
+		return blocks_.size() * block_capacity * sizeof(Chunk) + blocks_.capacity() * sizeof(Block) +
+		       block_lasts_.capacity() * sizeof(std::uint64_t);
+	}
+
+private:
+	iterator insert(iterator position, Chunk&& chunk)
+	{
+		if (blocks_.empty()) {
+			blocks_.emplace_back();
+			blocks_.back().reserve(block_capacity);
+			block_lasts_.push_back(0);
+			position = begin();
+		} else if (position == end()) {
+			// Append to the last block rather than creating a new one
+			position = iterator(this, blocks_.size() - 1, blocks_.back().size());
+		}
+
+		if (blocks_[position.block_].size() == block_capacity) {
+			// Split before inserting, so that the block does not reallocate beyond its reserved capacity
+			split(position.block_);
+			auto half = blocks_[position.block_].size();
+			if (position.index_ > half)
+				position = iterator(this, position.block_ + 1, position.index_ - half);
+		}
+
+		auto& block = blocks_[position.block_];
+		block.insert(block.begin() + static_cast<std::ptrdiff_t>(position.index_), std::move(chunk));
+		++size_;
+		refresh_block_last(position.block_);
+		return position;
+	}
+
+	// Move the upper half of a block to a new block following it
+	void split(std::size_t block_index)
+	{
+		auto& block = blocks_[block_index];
+		auto half = block.size() / 2;
+		Block upper;
+		upper.reserve(block_capacity);
+		std::move(block.begin() + static_cast<std::ptrdiff_t>(half), block.end(), std::back_inserter(upper));
+		block.erase(block.begin() + static_cast<std::ptrdiff_t>(half), block.end());
+
+		blocks_.insert(blocks_.begin() + static_cast<std::ptrdiff_t>(block_index + 1), std::move(upper));
+		block_lasts_.insert(block_lasts_.begin() + static_cast<std::ptrdiff_t>(block_index + 1), 0);
+		refresh_block_last(block_index);
+		refresh_block_last(block_index + 1);
+	}
+
+	// Remove chunks in `[first, last)`. Chunks before `first` are not moved.
+	void erase(iterator first, iterator last)
+	{
+		auto remaining = static_cast<std::size_t>(std::distance(first, last));
+		auto block = first.block_;
+		auto index = first.index_;
+
+		while (remaining) {
+			auto& chunks = blocks_[block];
+			auto count = std::min(remaining, chunks.size() - index);
+			chunks.erase(chunks.begin() + static_cast<std::ptrdiff_t>(index),
+			             chunks.begin() + static_cast<std::ptrdiff_t>(index + count));
+			size_ -= count;
+			remaining -= count;
+
+			if (chunks.empty()) {
+				blocks_.erase(blocks_.begin() + static_cast<std::ptrdiff_t>(block));
+				block_lasts_.erase(block_lasts_.begin() + static_cast<std::ptrdiff_t>(block));
+			} else {
+				refresh_block_last(block);
+				++block;
+			}
+			index = 0;
+		}
+	}
+
+	void refresh_block_last(std::size_t block) { block_lasts_[block] = blocks_[block].back().address_last(); }
+
+	std::vector<Block> blocks_;
+	// address_last of the last chunk of each block, to find the block a given address is in.
+	std::vector<std::uint64_t> block_lasts_;
+	std::size_t size_ = 0;
+};
+
+}}}}
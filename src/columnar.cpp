@@ -0,0 +1,215 @@
+#include "columnar.h"
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "columnar_format.h"
+#include "sqlite_sink.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+using namespace columnar;
+
+namespace {
+
+/**
+ * Reads a columnar memory history file: the header and footer at construction, then blocks on demand.
+ */
+class ColumnarFile
+{
+public:
+	explicit ColumnarFile(const char* filename)
+	  : filename_(filename)
+	  , file_(filename, std::ios::binary)
+	{
+		if (not file_) {
+			error("can't open");
+		}
+
+		file_.seekg(0, std::ios::end);
+		auto file_size = static_cast<std::uint64_t>(file_.tellg());
+
+		std::vector<std::uint8_t> bytes;
+		if (file_size < sizeof(file_magic) + trailer_size) {
+			error("too small");
+		}
+		read(0, sizeof(file_magic), bytes);
+		if (not std::equal(bytes.begin(), bytes.end(), std::begin(file_magic))) {
+			error("not a columnar memory history file");
+		}
+
+		read(file_size - trailer_size, trailer_size, bytes);
+		if (not std::equal(bytes.begin() + 8, bytes.end(), std::begin(end_magic))) {
+			error("incomplete file, it was not finished");
+		}
+		auto footer_offset = get_u64(bytes.data());
+		if (footer_offset < sizeof(file_magic) or footer_offset > file_size - trailer_size) {
+			error("invalid footer offset");
+		}
+
+		auto footer_size = file_size - trailer_size - footer_offset;
+		read(footer_offset, footer_size, bytes);
+		if (footer_size < 16 or (footer_size - 16) % index_entry_size != 0 or
+		    get_u64(bytes.data()) != (footer_size - 16) / index_entry_size) {
+			error("invalid footer");
+		}
+
+		const auto* entry = bytes.data() + 8;
+		for (std::uint64_t i = 0; i < get_u64(bytes.data()); ++i, entry += index_entry_size) {
+			slices.push_back(SliceIndexEntry{ get_u64(entry), get_u64(entry + 8), get_u64(entry + 16),
+			                                  get_u64(entry + 24), get_u64(entry + 32), get_u64(entry + 40) });
+			if (slices.back().offset + slices.back().size > footer_offset) {
+				error("invalid slice index");
+			}
+		}
+		discard_after = get_u64(entry);
+
+		// Header strings lie between the magic and the first block, or the footer if there is none
+		auto header_end = slices.empty() ? footer_offset : slices.front().offset;
+		if (header_end < sizeof(file_magic)) {
+			error("invalid slice index");
+		}
+		read(sizeof(file_magic), header_end - sizeof(file_magic), bytes);
+		const auto* in = bytes.data();
+		const auto* end = in + bytes.size();
+		format_version = get_string(in, end);
+		if (format_version != columnar_format_version) {
+			error("unsupported format version " + format_version);
+		}
+		writer_version = get_string(in, end);
+		tool_name = get_string(in, end);
+		tool_version = get_string(in, end);
+		tool_info = get_string(in, end);
+	}
+
+	/**
+	 * Read the block of a slice and return its columns, which point into `bytes`.
+	 */
+	std::array<std::pair<const std::uint8_t*, const std::uint8_t*>, column_count>
+	read_slice(const SliceIndexEntry& slice, std::vector<std::uint8_t>& bytes)
+	{
+		read(slice.offset, slice.size, bytes);
+
+		std::array<std::pair<const std::uint8_t*, const std::uint8_t*>, column_count> columns;
+		const auto* in = bytes.data();
+		const auto* end = in + bytes.size();
+		for (auto& column : columns) {
+			auto size = get_varint(in, end);
+			if (size > static_cast<std::uint64_t>(end - in)) {
+				error("truncated column");
+			}
+			column = { in, in + size };
+			in += size;
+		}
+		return columns;
+	}
+
+	[[noreturn]] void error(const std::string& message)
+	{
+		throw std::runtime_error("Columnar memory history " + filename_ + ": " + message);
+	}
+
+	std::string format_version;
+	std::string writer_version;
+	std::string tool_name;
+	std::string tool_version;
+	std::string tool_info;
+	std::vector<SliceIndexEntry> slices;
+	std::uint64_t discard_after;
+
+private:
+	void read(std::uint64_t offset, std::uint64_t size, std::vector<std::uint8_t>& bytes)
+	{
+		bytes.resize(size);
+		file_.seekg(static_cast<std::streamoff>(offset));
+		file_.read(reinterpret_cast<char*>(bytes.data()), static_cast<std::streamsize>(size));
+		if (not file_) {
+			error("can't read");
+		}
+	}
+
+	std::string filename_;
+	std::ifstream file_;
+};
+
+} // anonymous namespace
+
+sqlite::ResourceDatabase columnar_to_sqlite(const char* columnar_filename, const char* sqlite_filename)
+{
+	ColumnarFile file(columnar_filename);
+
+	// Indexes are only needed once everything is there
+	DbWriterOptions options;
+	options.bulk_insert_rows = 128;
+	options.deferred_indexes = true;
+	SqliteSink sink(sqlite_filename, file.tool_name.c_str(), file.tool_version.c_str(), file.tool_info.c_str(),
+	                options);
+
+	std::vector<std::uint8_t> bytes;
+	std::vector<SqliteSink::ChunkRow> chunks;
+	std::vector<SqliteSink::AccessRow> accesses;
+	for (const auto& slice : file.slices) {
+		auto columns = file.read_slice(slice, bytes);
+
+		sink.begin();
+		auto slice_id = sink.insert_slice(slice.transition_first, slice.transition_last);
+
+		chunks.clear();
+		std::uint64_t first = 0;
+		auto& operations = columns[ChunkOperations];
+		for (std::uint64_t i = 0; i < slice.chunk_count; ++i) {
+			if (operations.first == operations.second) {
+				file.error("truncated chunk operations");
+			}
+			first += unzigzag(get_varint(columns[ChunkFirsts].first, columns[ChunkFirsts].second));
+			auto length = get_varint(columns[ChunkLengths].first, columns[ChunkLengths].second);
+			chunks.push_back(SqliteSink::ChunkRow{ slice_id, first, first + length, *operations.first++ });
+		}
+		auto first_chunk_id = sink.insert_chunk_rows(chunks.size(), [&chunks](std::size_t index) {
+			return chunks[index];
+		});
+
+		accesses.clear();
+		std::uint64_t chunk = 0;
+		std::uint64_t transition = slice.transition_first;
+		std::uint64_t linear_offset = 0;
+		for (std::uint64_t i = 0; i < slice.access_count; ++i) {
+			chunk += unzigzag(get_varint(columns[AccessChunks].first, columns[AccessChunks].second));
+			transition += unzigzag(get_varint(columns[AccessTransitions].first, columns[AccessTransitions].second));
+			auto offset = get_varint(columns[AccessOffsets].first, columns[AccessOffsets].second);
+			auto size = get_varint(columns[AccessSizes].first, columns[AccessSizes].second);
+			auto linear = get_varint(columns[AccessLinears].first, columns[AccessLinears].second);
+			if (chunk >= chunks.size()) {
+				file.error("invalid access chunk");
+			}
+
+			const auto& chunk_row = chunks[chunk];
+			auto phy_first = chunk_row.phy_first + offset;
+			if (linear)
+				linear_offset += unzigzag(linear - 1);
+
+			if (transition >= file.discard_after)
+				continue;
+
+			accesses.push_back(SqliteSink::AccessRow{ first_chunk_id + chunk, transition, phy_first + linear_offset,
+			                                          linear != 0, phy_first, static_cast<std::uint32_t>(size),
+			                                          chunk_row.operation });
+		}
+		sink.insert_access_rows(accesses.size(), [&accesses](std::size_t index) {
+			return accesses[index];
+		});
+
+		sink.commit();
+	}
+
+	sink.finish();
+	return std::move(sink).take();
+}
+
+}}}} // namespace reven::backend::memaccess::db
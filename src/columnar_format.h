@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "varint.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+namespace columnar {
+
+/**
+ * Layout of the columnar memory history files, written by ColumnarSink and read back by `columnar_to_sqlite`.
+ *
+ * The file is append-only: a header, one block per slice in order of transition, then a footer indexing the blocks.
+ *
+ * - header: `file_magic`, then the format version, writer version, tool name, tool version and tool info as strings.
+ * - slice block: the `column_count` columns below, each as its length in bytes followed by its content. A block holds
+ *   the same chunks and accesses as a slice of the sqlite database, in the same order: chunks sorted by address, and
+ *   accesses in their order of appearance.
+ * - footer: the slice count, then a SliceIndexEntry per slice, then the transition accesses are discarded after
+ *   (`no_discard` if none), each as a fixed-size integer.
+ * - trailer: the offset of the footer as a fixed-size integer, then `end_magic`.
+ *
+ * Integers in columns and strings lengths are LEB128 varints, and signed deltas are zigzag-encoded first. Fixed-size
+ * integers are 64 bits little endian.
+ */
+
+constexpr char file_magic[8] = { 'R', 'V', 'N', 'M', 'H', 'C', 'O', 'L' };
+constexpr char end_magic[8] = { 'R', 'V', 'N', 'M', 'H', 'E', 'N', 'D' };
+constexpr std::size_t trailer_size = 8 + sizeof(end_magic);
+constexpr std::uint64_t no_discard = ~std::uint64_t(0);
+
+enum Column {
+	// Operation of each chunk, as a byte.
+	ChunkOperations,
+	// Signed delta between the first address of each chunk and the one of the previous chunk.
+	ChunkFirsts,
+	// Last address of each chunk, minus its first address.
+	ChunkLengths,
+	// Signed delta between the index of the chunk of each access in the slice, and the one of the previous access.
+	AccessChunks,
+	// Signed delta between the transition of each access and the one of the previous access, or the first transition
+	// of the slice.
+	AccessTransitions,
+	// Physical address of each access, minus the first address of its chunk.
+	AccessOffsets,
+	AccessSizes,
+	// 0 if the access has no linear address. Otherwise, 1 + the signed delta between its linear-minus-physical
+	// address, and the last one in the slice, which is 0 initially.
+	AccessLinears,
+	column_count
+};
+
+struct SliceIndexEntry {
+	std::uint64_t offset;
+	std::uint64_t size;
+	std::uint64_t transition_first;
+	std::uint64_t transition_last;
+	std::uint64_t chunk_count;
+	std::uint64_t access_count;
+};
+
+constexpr std::size_t index_entry_size = 6 * 8;
+
+inline void put_u64(std::vector<std::uint8_t>& out, std::uint64_t value)
+{
+	for (int i = 0; i < 8; ++i)
+		out.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+}
+
+inline std::uint64_t get_u64(const std::uint8_t* in)
+{
+	std::uint64_t value = 0;
+	for (int i = 0; i < 8; ++i)
+		value |= static_cast<std::uint64_t>(in[i]) << (8 * i);
+	return value;
+}
+
+inline void put_string(std::vector<std::uint8_t>& out, const std::string& value)
+{
+	put_varint(out, value.size());
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+inline std::string get_string(const std::uint8_t*& in, const std::uint8_t* end)
+{
+	auto size = get_varint(in, end);
+	if (size > static_cast<std::uint64_t>(end - in))
+		throw std::runtime_error("Columnar memory history: truncated string");
+	std::string value(reinterpret_cast<const char*>(in), size);
+	in += size;
+	return value;
+}
+
+}}}}}
@@ -0,0 +1,151 @@
+#include "columnar_sink.h"
+
+#include <algorithm>
+
+#include "columnar.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+using namespace columnar;
+
+ColumnarSink::ColumnarSink(const char* filename, const char* tool_name, const char* tool_version,
+                           const char* tool_info)
+  : filename_(filename)
+  , file_(filename, std::ios::binary | std::ios::trunc)
+{
+	if (not file_) {
+		throw std::runtime_error("Can't create columnar memory history " + filename_);
+	}
+
+	std::vector<std::uint8_t> header(std::begin(file_magic), std::end(file_magic));
+	put_string(header, columnar_format_version);
+	put_string(header, writer_version);
+	put_string(header, tool_name);
+	put_string(header, tool_version);
+	put_string(header, tool_info);
+	write(header);
+}
+
+void ColumnarSink::write(const std::vector<std::uint8_t>& bytes)
+{
+	file_.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+	if (not file_) {
+		throw std::runtime_error("Can't write columnar memory history " + filename_);
+	}
+	offset_ += bytes.size();
+}
+
+void ColumnarSink::write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal)
+{
+	auto transitions = slice_transitions(read_slice, write_slice);
+
+	for (auto& column : columns_)
+		column.clear();
+
+	encode_chunks(read_slice, write_slice, journal);
+	encode_accesses(journal, transitions.first);
+
+	StepTimer timer(times_.commit);
+	block_.clear();
+	for (const auto& column : columns_) {
+		put_varint(block_, column.size());
+		block_.insert(block_.end(), column.begin(), column.end());
+	}
+
+	index_.push_back(SliceIndexEntry{ offset_, block_.size(), transitions.first, transitions.second,
+	                                  chunk_firsts_.size(), journal.size() });
+	write(block_);
+}
+
+void ColumnarSink::encode_chunks(Slice& read_slice, Slice& write_slice, AccessJournal& journal)
+{
+	StepTimer timer(times_.chunks);
+
+	chunk_firsts_.clear();
+	std::uint64_t previous_first = 0;
+	for (SliceChunkMerge chunks(read_slice, write_slice); not chunks.done();) {
+		auto it = chunks.next();
+		chunk_firsts_.push_back(it.chunk->address_first());
+		columns_[ChunkOperations].push_back(it.operation);
+		put_varint(columns_[ChunkFirsts], zigzag(it.chunk->address_first() - previous_first));
+		put_varint(columns_[ChunkLengths], it.chunk->address_last() - it.chunk->address_first());
+		previous_first = it.chunk->address_first();
+
+		// Chunk ids are indices in the slice, starting at 1 since 0 means unset
+		for (auto a = it.chunk->accesses(); a; a = it.chunk->next(a)) {
+			journal.set_chunk_id(a->journal_index, chunk_firsts_.size());
+		}
+	}
+}
+
+void ColumnarSink::encode_accesses(const AccessJournal& journal, std::uint64_t transition_first)
+{
+	StepTimer timer(times_.accesses);
+
+	std::uint64_t previous_chunk = 0;
+	std::uint64_t previous_transition = transition_first;
+	std::uint64_t previous_linear_offset = 0;
+	for (AccessJournal::Index i = 0; i < journal.size(); ++i) {
+		auto chunk_id = journal.chunk_id(i);
+		if (not chunk_id) {
+			throw std::logic_error("All accesses should have a chunk id, but one is missing");
+		}
+		auto chunk = chunk_id - 1;
+		if (columns_[ChunkOperations][chunk] != journal.operation(i)) {
+			throw std::logic_error("Accesses should have the operation of their chunk");
+		}
+
+		put_varint(columns_[AccessChunks], zigzag(chunk - previous_chunk));
+		put_varint(columns_[AccessTransitions], zigzag(journal.transition(i) - previous_transition));
+		put_varint(columns_[AccessOffsets], journal.physical_address(i) - chunk_firsts_[chunk]);
+		put_varint(columns_[AccessSizes], journal.size(i));
+		if (journal.has_virtual_address(i)) {
+			auto linear_offset = journal.virtual_address(i) - journal.physical_address(i);
+			put_varint(columns_[AccessLinears], zigzag(linear_offset - previous_linear_offset) + 1);
+			previous_linear_offset = linear_offset;
+		} else {
+			columns_[AccessLinears].push_back(0);
+		}
+		previous_chunk = chunk;
+		previous_transition = journal.transition(i);
+	}
+}
+
+void ColumnarSink::discard_after(std::uint64_t transition_count)
+{
+	discard_after_ = std::min(discard_after_, transition_count);
+}
+
+void ColumnarSink::finish()
+{
+	if (not file_.is_open())
+		return;
+
+	auto footer_offset = offset_;
+
+	std::vector<std::uint8_t> footer;
+	put_u64(footer, index_.size());
+	for (const auto& entry : index_) {
+		put_u64(footer, entry.offset);
+		put_u64(footer, entry.size);
+		put_u64(footer, entry.transition_first);
+		put_u64(footer, entry.transition_last);
+		put_u64(footer, entry.chunk_count);
+		put_u64(footer, entry.access_count);
+	}
+	put_u64(footer, discard_after_);
+
+	put_u64(footer, footer_offset);
+	footer.insert(footer.end(), std::begin(end_magic), std::end(end_magic));
+	write(footer);
+
+	file_.close();
+	if (not file_) {
+		throw std::runtime_error("Can't write columnar memory history " + filename_);
+	}
+}
+
+}}}} // namespace reven::backend::memaccess::db
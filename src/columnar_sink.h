@@ -0,0 +1,62 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "sink.h"
+#include "columnar_format.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * Writes slices to a columnar memory history file (see columnar_format.h), without sqlite.
+ *
+ * Each slice is encoded in memory then appended to the file, which is only complete, and readable, once `finish`
+ * wrote its footer.
+ */
+class ColumnarSink : public Sink
+{
+public:
+	ColumnarSink(const char* filename, const char* tool_name, const char* tool_version, const char* tool_info);
+
+	void write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal) override;
+
+	/**
+	 * Accesses are not removed from the file, which is append-only: the footer records the transition, and readers
+	 * skip the accesses after it.
+	 */
+	void discard_after(std::uint64_t transition_count) override;
+
+	/**
+	 * Write the footer and close the file.
+	 */
+	void finish() override;
+
+private:
+	// Fill the chunk columns, in ascending order of address, and set the chunk ids of the journal.
+	void encode_chunks(Slice& read_slice, Slice& write_slice, AccessJournal& journal);
+	// Fill the access columns. Needs the chunk ids.
+	void encode_accesses(const AccessJournal& journal, std::uint64_t transition_first);
+
+	void write(const std::vector<std::uint8_t>& bytes);
+
+	std::string filename_;
+	std::ofstream file_;
+	std::uint64_t offset_ = 0;
+	std::uint64_t discard_after_ = columnar::no_discard;
+	std::vector<columnar::SliceIndexEntry> index_;
+
+	// scratch-space for reuse without allocation while encoding slices
+	// First address of each chunk of the slice, by index
+	std::vector<std::uint64_t> chunk_firsts_;
+	std::array<std::vector<std::uint8_t>, columnar::column_count> columns_;
+	std::vector<std::uint8_t> block_;
+};
+
+}}}}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "varint.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+namespace compact {
+
+/**
+ * Encoding of the accesses of a chunk, stored as a blob in its row in the compact schema (see the README).
+ *
+ * The blob is the amount of accesses, then for each of them, in their order of appearance:
+ * - the delta between its transition and the one of the previous access, or the first transition of the slice;
+ * - its physical address, minus the first address of the chunk;
+ * - its size;
+ * - 0 if it has no linear address. Otherwise, 1 + the signed delta between its linear-minus-physical address and the
+ *   one of the previous access of the chunk with a linear address, which is 0 initially.
+ *
+ * The operation is the one of the chunk. All values are varints (see varint.h).
+ */
+
+struct Access {
+	std::uint64_t transition;
+	std::uint64_t physical_address;
+	std::uint64_t linear_address;
+	std::uint32_t size;
+	bool has_linear_address;
+};
+
+class AccessEncoder
+{
+public:
+	/**
+	 * Start the blob of a chunk of `access_count` accesses in `blob`, which is cleared.
+	 */
+	AccessEncoder(std::vector<std::uint8_t>& blob, std::uint64_t access_count, std::uint64_t chunk_first,
+	              std::uint64_t transition_first)
+	  : blob_(blob)
+	  , chunk_first_(chunk_first)
+	  , previous_transition_(transition_first)
+	{
+		blob_.clear();
+		put_varint(blob_, access_count);
+	}
+
+	/**
+	 * Append an access. Accesses are expected in order of transition, within the chunk.
+	 */
+	void add(std::uint64_t transition, std::uint64_t physical_address, std::uint64_t linear_address,
+	         bool has_linear_address, std::uint32_t size)
+	{
+		put_varint(blob_, transition - previous_transition_);
+		put_varint(blob_, physical_address - chunk_first_);
+		put_varint(blob_, size);
+		if (has_linear_address) {
+			auto linear_offset = linear_address - physical_address;
+			put_varint(blob_, zigzag(linear_offset - previous_linear_offset_) + 1);
+			previous_linear_offset_ = linear_offset;
+		} else {
+			blob_.push_back(0);
+		}
+		previous_transition_ = transition;
+	}
+
+private:
+	std::vector<std::uint8_t>& blob_;
+	std::uint64_t chunk_first_;
+	std::uint64_t previous_transition_;
+	std::uint64_t previous_linear_offset_ = 0;
+};
+
+/**
+ * Decode the blob of a chunk. Throw std::runtime_error if it is truncated.
+ */
+inline std::vector<Access> decode_accesses(const std::uint8_t* blob, std::size_t size, std::uint64_t chunk_first,
+                                           std::uint64_t transition_first)
+{
+	const auto* end = blob + size;
+	auto count = get_varint(blob, end);
+
+	std::vector<Access> accesses;
+	// Each access takes at least 4 bytes: do not trust the count of a corrupted blob
+	accesses.reserve(std::min<std::uint64_t>(count, size / 4));
+
+	auto transition = transition_first;
+	std::uint64_t linear_offset = 0;
+	for (std::uint64_t i = 0; i < count; ++i) {
+		Access access;
+		transition += get_varint(blob, end);
+		access.transition = transition;
+		access.physical_address = chunk_first + get_varint(blob, end);
+		access.size = static_cast<std::uint32_t>(get_varint(blob, end));
+		auto linear = get_varint(blob, end);
+		access.has_linear_address = linear != 0;
+		if (access.has_linear_address) {
+			linear_offset += unzigzag(linear - 1);
+			access.linear_address = access.physical_address + linear_offset;
+		} else {
+			access.linear_address = 0;
+		}
+		accesses.push_back(access);
+	}
+	return accesses;
+}
+
+}}}}}
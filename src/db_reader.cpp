@@ -0,0 +1,516 @@
+#include "db_reader.h"
+
+#include <algorithm>
+#include <limits>
+#include <list>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
+#include <sqlite3.h>
+
+#include "compact_accesses.h"
+#include "simd_scan.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+// An access of a decoded chunk. `order` is its rowid with the default schema, and its index in the chunk with the
+// compact one.
+struct ReaderAccess {
+	std::uint64_t transition;
+	std::uint64_t physical_address;
+	std::uint64_t linear_address;
+	std::uint64_t order;
+	std::uint32_t size;
+	bool has_linear_address;
+};
+
+// Accesses of a chunk, in their order of appearance, which is also their order of transition
+using DecodedChunk = std::vector<ReaderAccess>;
+
+namespace {
+
+using Stmt = sqlite::Statement;
+
+// Index of the chunks of an operation in ReaderIndex
+std::size_t operation_index(Operation operation)
+{
+	return operation == Operation::Read ? 0 : 1;
+}
+
+// Steps run by a statement since the previous call, which is how much its last execution cost
+std::uint64_t vm_steps(Stmt& stmt)
+{
+	return static_cast<std::uint64_t>(sqlite3_stmt_status(stmt.get(), SQLITE_STMTSTATUS_VM_STEP, 1));
+}
+
+bool touches(const ReaderAccess& access, const HalfAxisQuery& query)
+{
+	return access.physical_address <= query.address_last and
+	       access.physical_address - 1 + access.size >= query.address_first;
+}
+
+} // anonymous namespace
+
+/**
+ * Slices and chunk bounds of the database, in struct-of-arrays form so that searches only touch the bounds.
+ */
+struct ReaderIndex {
+	// Chunks of one operation, grouped by slice then sorted by address. Since they do not overlap, both bounds are
+	// sorted within a slice.
+	struct Chunks {
+		std::vector<std::uint64_t> firsts;
+		std::vector<std::uint64_t> lasts;
+		std::vector<std::uint64_t> rowids;
+		// The chunks of the slice at index `i` are `[slice_ends[i - 1], slice_ends[i])`
+		std::vector<std::size_t> slice_ends;
+
+		std::size_t slice_begin(std::size_t slice) const { return slice ? slice_ends[slice - 1] : 0; }
+	};
+
+	bool compact = false;
+	// Slices in order of transition, which is the order of their rowids
+	std::vector<std::uint64_t> slice_rowids;
+	std::vector<std::uint64_t> slice_firsts;
+	std::vector<std::uint64_t> slice_lasts;
+	// Read chunks, then write chunks
+	Chunks chunks[2];
+
+	std::size_t memory_usage() const
+	{
+		std::size_t usage = (slice_rowids.capacity() + slice_firsts.capacity() + slice_lasts.capacity()) * 8;
+		for (const auto& c : chunks) {
+			usage += (c.firsts.capacity() + c.lasts.capacity() + c.rowids.capacity()) * 8 +
+			         c.slice_ends.capacity() * sizeof(std::size_t);
+		}
+		return usage;
+	}
+};
+
+/**
+ * The statements of a DbReader, prepared once.
+ */
+struct ReaderStatements {
+	// Accesses of a chunk from a transition, in either direction, and all accesses of a chunk. Only with the default
+	// schema.
+	std::unique_ptr<Stmt> accesses_forward;
+	std::unique_ptr<Stmt> accesses_backward;
+	std::unique_ptr<Stmt> chunk_accesses;
+	// Blob of a chunk, only with the compact schema
+	std::unique_ptr<Stmt> chunk_blob;
+};
+
+/**
+ * Decoded chunks, by rowid. Least recently used ones are dropped first once `capacity` is reached.
+ */
+class ChunkCache
+{
+public:
+	explicit ChunkCache(std::size_t capacity) : capacity_(capacity) {}
+
+	// Return the chunk if it is cached, and make it the most recently used one
+	const DecodedChunk* find(std::uint64_t rowid)
+	{
+		auto it = chunks_.find(rowid);
+		if (it == chunks_.end())
+			return nullptr;
+		lru_.splice(lru_.begin(), lru_, it->second);
+		return &it->second->second;
+	}
+
+	// Whether a chunk missing from the cache should be read whole and cached, rather than queried for the accesses
+	// needed, with the default schema. As in ski rental, chunks are queried until their queries cost as much as reading
+	// a chunk whole usually does, which is never more than twice the cost of the best choice. Only the chunks missed
+	// last are remembered.
+	bool admit(std::uint64_t rowid)
+	{
+		auto it = query_costs_.find(rowid);
+		if (it == query_costs_.end() or it->second < load_cost_)
+			return false;
+		query_costs_.erase(it);
+		return true;
+	}
+
+	// Record the cost of a query for the accesses of a chunk that was not admitted, and of reading a chunk whole, in
+	// sqlite steps
+	void add_query_cost(std::uint64_t rowid, std::uint64_t cost)
+	{
+		if (query_costs_.size() >= 4 * capacity_ and not query_costs_.count(rowid))
+			query_costs_.clear();
+		query_costs_[rowid] += cost;
+	}
+
+	void add_load_cost(std::uint64_t cost)
+	{
+		// Moving average
+		load_cost_ = load_cost_ ? load_cost_ - load_cost_ / 8 + cost / 8 : cost;
+	}
+
+	const DecodedChunk& insert(std::uint64_t rowid, DecodedChunk chunk)
+	{
+		if (lru_.size() >= capacity_) {
+			access_count_ -= lru_.back().second.size();
+			chunks_.erase(lru_.back().first);
+			lru_.pop_back();
+		}
+
+		access_count_ += chunk.size();
+		lru_.emplace_front(rowid, std::move(chunk));
+		chunks_.emplace(rowid, lru_.begin());
+		return lru_.front().second;
+	}
+
+	std::size_t memory_usage() const
+	{
+		return access_count_ * sizeof(ReaderAccess) + lru_.size() * (sizeof(Entry) + 4 * sizeof(void*)) +
+		       query_costs_.size() * 4 * sizeof(void*);
+	}
+
+private:
+	using Entry = std::pair<std::uint64_t, DecodedChunk>;
+
+	std::size_t capacity_;
+	std::size_t access_count_ = 0;
+	// Most recently used first
+	std::list<Entry> lru_;
+	std::unordered_map<std::uint64_t, std::list<Entry>::iterator> chunks_;
+	std::unordered_map<std::uint64_t, std::uint64_t> query_costs_;
+	// 0 until a chunk was read whole, so that chunks are admitted on their second miss at first
+	std::uint64_t load_cost_ = 0;
+};
+
+struct DbReader::ChunkRef {
+	std::uint64_t rowid;
+	std::uint64_t address_first;
+	std::size_t slice;
+	Operation operation;
+};
+
+struct DbReader::Found {
+	MemoryAccess access;
+	// Order of appearance of accesses on the same transition: the access rowid with the default schema, the chunk rowid
+	// then the index in the chunk with the compact one.
+	std::uint64_t chunk_order;
+	std::uint64_t order;
+
+	std::tuple<std::uint64_t, std::uint64_t, std::uint64_t> key() const
+	{
+		return std::make_tuple(access.transition_id, chunk_order, order);
+	}
+};
+
+namespace {
+
+bool has_table(sqlite::Database& db, const char* name)
+{
+	Stmt stmt(db, (std::string("select count(*) from sqlite_master where type = 'table' and name = '") + name +
+	               "';").c_str());
+	stmt.step();
+	return stmt.column_i64(0) != 0;
+}
+
+std::unique_ptr<ReaderIndex> load_index(sqlite::Database& db)
+{
+	if (not has_table(db, "slices") or not has_table(db, "chunks")) {
+		throw std::runtime_error("DbReader: not a memory history database");
+	}
+
+	auto index = std::make_unique<ReaderIndex>();
+	index->compact = not has_table(db, "accesses");
+
+	{
+		Stmt stmt(db, "select rowid, transition_first, transition_last from slices order by rowid;");
+		while (stmt.step() == Stmt::StepResult::Row) {
+			index->slice_rowids.push_back(static_cast<std::uint64_t>(stmt.column_i64(0)));
+			index->slice_firsts.push_back(static_cast<std::uint64_t>(stmt.column_i64(1)));
+			index->slice_lasts.push_back(static_cast<std::uint64_t>(stmt.column_i64(2)));
+		}
+	}
+
+	for (auto operation : { Operation::Read, Operation::Write }) {
+		auto& chunks = index->chunks[operation_index(operation)];
+		chunks.slice_ends.assign(index->slice_rowids.size(), 0);
+
+		// Matches idx_chunks_1, so sqlite does not need to sort
+		Stmt stmt(db, "select rowid, slice_id, phy_first, phy_last from chunks where operation = ? "
+		              "order by slice_id, phy_last;");
+		stmt.bind_arg_cast(1, static_cast<std::uint8_t>(operation), "operation");
+
+		std::size_t slice = 0;
+		while (stmt.step() == Stmt::StepResult::Row) {
+			auto slice_id = static_cast<std::uint64_t>(stmt.column_i64(1));
+			while (slice < index->slice_rowids.size() and index->slice_rowids[slice] < slice_id)
+				chunks.slice_ends[slice++] = chunks.rowids.size();
+			if (slice == index->slice_rowids.size() or index->slice_rowids[slice] != slice_id) {
+				throw std::runtime_error("DbReader: chunk of a missing slice");
+			}
+
+			chunks.rowids.push_back(static_cast<std::uint64_t>(stmt.column_i64(0)));
+			chunks.firsts.push_back(static_cast<std::uint64_t>(stmt.column_i64(2)));
+			chunks.lasts.push_back(static_cast<std::uint64_t>(stmt.column_i64(3)));
+		}
+		for (; slice < index->slice_rowids.size(); ++slice)
+			chunks.slice_ends[slice] = chunks.rowids.size();
+	}
+
+	return index;
+}
+
+ReaderAccess access_row(Stmt& stmt)
+{
+	// Columns are rowid, transition, linear, phy_first, size
+	return ReaderAccess{ static_cast<std::uint64_t>(stmt.column_i64(1)), static_cast<std::uint64_t>(stmt.column_i64(3)),
+	                     static_cast<std::uint64_t>(stmt.column_i64(2)), static_cast<std::uint64_t>(stmt.column_i64(0)),
+	                     static_cast<std::uint32_t>(stmt.column_i64(4)), stmt.column_type(2) != Stmt::Type::Null };
+}
+
+// Read all the accesses of a chunk
+DecodedChunk load_chunk(ReaderStatements& statements, const ReaderIndex& index, std::uint64_t rowid,
+                        std::uint64_t address_first, std::size_t slice)
+{
+	DecodedChunk accesses;
+	if (not index.compact) {
+		auto& stmt = *statements.chunk_accesses;
+		stmt.bind_arg_throw(1, rowid, "chunk_id");
+		while (stmt.step() == Stmt::StepResult::Row)
+			accesses.push_back(access_row(stmt));
+		stmt.reset();
+		return accesses;
+	}
+
+	auto& stmt = *statements.chunk_blob;
+	stmt.bind_arg_throw(1, rowid, "rowid");
+	if (stmt.step() != Stmt::StepResult::Row) {
+		stmt.reset();
+		throw std::runtime_error("DbReader: missing chunk");
+	}
+
+	auto decoded = compact::decode_accesses(static_cast<const std::uint8_t*>(sqlite3_column_blob(stmt.get(), 0)),
+	                                        static_cast<std::size_t>(sqlite3_column_bytes(stmt.get(), 0)),
+	                                        address_first, index.slice_firsts[slice]);
+	stmt.reset();
+
+	accesses.reserve(decoded.size());
+	for (std::size_t i = 0; i < decoded.size(); ++i) {
+		const auto& a = decoded[i];
+		accesses.push_back(ReaderAccess{ a.transition, a.physical_address, a.linear_address, i, a.size,
+		                                 a.has_linear_address });
+	}
+	return accesses;
+}
+
+} // anonymous namespace
+
+DbReader::DbReader(const char* filename, const DbReaderOptions& options)
+  : DbReader(sqlite::ResourceDatabase::open(filename, true), options)
+{
+}
+
+DbReader::DbReader(sqlite::ResourceDatabase db, const DbReaderOptions& options)
+  : options_(options)
+  , db_(std::move(db))
+  , index_(load_index(db_))
+  , statements_(std::make_unique<ReaderStatements>())
+  , cache_(std::make_unique<ChunkCache>(options.chunk_cache_size))
+{
+	if (index_->compact) {
+		statements_->chunk_blob = std::make_unique<Stmt>(db_, "select accesses from chunks where rowid = ?;");
+		return;
+	}
+
+	// The order matches idx_accesses_1, whose entries end with the rowid. Addresses are compared as signed values by
+	// sqlite, so ranges beyond that bind null to skip its filter.
+	statements_->accesses_forward = std::make_unique<Stmt>(
+	  db_, "select rowid, transition, linear, phy_first, size from accesses where chunk_id = ?1 and transition >= ?2 "
+	       "and (?3 is null or (phy_first <= ?3 and phy_first + size > ?4)) order by transition, rowid;");
+	statements_->accesses_backward = std::make_unique<Stmt>(
+	  db_, "select rowid, transition, linear, phy_first, size from accesses where chunk_id = ?1 and transition <= ?2 "
+	       "and (?3 is null or (phy_first <= ?3 and phy_first + size > ?4)) order by transition desc, rowid desc;");
+	statements_->chunk_accesses = std::make_unique<Stmt>(
+	  db_, "select rowid, transition, linear, phy_first, size from accesses where chunk_id = ? "
+	       "order by transition, rowid;");
+}
+
+DbReader::~DbReader() = default;
+DbReader::DbReader(DbReader&&) = default;
+DbReader& DbReader::operator=(DbReader&&) = default;
+
+std::vector<MemoryAccess> DbReader::next(const HalfAxisQuery& query)
+{
+	return run_query(query, true);
+}
+
+std::vector<MemoryAccess> DbReader::previous(const HalfAxisQuery& query)
+{
+	return run_query(query, false);
+}
+
+std::size_t DbReader::slice_count() const
+{
+	return index_->slice_rowids.size();
+}
+
+std::size_t DbReader::chunk_count() const
+{
+	return index_->chunks[0].rowids.size() + index_->chunks[1].rowids.size();
+}
+
+std::size_t DbReader::memory_usage() const
+{
+	return index_->memory_usage() + cache_->memory_usage();
+}
+
+std::vector<MemoryAccess> DbReader::run_query(const HalfAxisQuery& query, bool forward)
+{
+	++stats_.queries;
+
+	std::vector<MemoryAccess> results;
+	const auto& slice_lasts = index_->slice_lasts;
+	if (query.max_results == 0 or (not query.reads and not query.writes) or
+	    query.address_first > query.address_last or slice_lasts.empty()) {
+		return results;
+	}
+
+	// Adjacent slices may share a transition, when a slice was cut in its middle: forward queries start from the first
+	// slice that ends at or after the transition, and backward ones from the last slice that starts at or before it.
+	// Other slices are either before or after the transition, which may be in a gap.
+	std::size_t slice;
+	if (forward) {
+		slice = simd::lower_bound(slice_lasts.data(), slice_lasts.size(), query.transition);
+	} else {
+		slice = simd::upper_bound(index_->slice_firsts.data(), index_->slice_firsts.size(), query.transition);
+		if (slice == 0)
+			return results;
+		--slice;
+	}
+
+	std::vector<Found> found;
+	while (results.size() < query.max_results and slice < slice_lasts.size()) {
+		auto required = query.max_results - results.size();
+		found.clear();
+
+		// Chunks of different operations may overlap, so each operation is searched on its own
+		for (auto operation : { Operation::Read, Operation::Write }) {
+			if (not (operation == Operation::Read ? query.reads : query.writes))
+				continue;
+
+			const auto& chunks = index_->chunks[operation_index(operation)];
+			auto begin = chunks.slice_begin(slice);
+			auto end = chunks.slice_ends[slice];
+			auto chunk = begin + simd::lower_bound(chunks.lasts.data() + begin, end - begin, query.address_first);
+			for (; chunk < end and chunks.firsts[chunk] <= query.address_last; ++chunk) {
+				find_accesses(ChunkRef{ chunks.rowids[chunk], chunks.firsts[chunk], slice, operation }, query,
+				              forward, required, found);
+			}
+		}
+
+		// Each chunk gave its first accesses, only the first of all of them are kept
+		auto count = std::min(required, found.size());
+		auto before = [forward](const Found& a, const Found& b) {
+			return forward ? a.key() < b.key() : b.key() < a.key();
+		};
+		std::partial_sort(found.begin(), found.begin() + static_cast<std::ptrdiff_t>(count), found.end(), before);
+		for (std::size_t i = 0; i < count; ++i)
+			results.push_back(found[i].access);
+
+		if (forward) {
+			++slice;
+		} else if (slice == 0) {
+			break;
+		} else {
+			--slice;
+		}
+	}
+
+	return results;
+}
+
+void DbReader::find_accesses(const ChunkRef& chunk, const HalfAxisQuery& query, bool forward,
+                             std::size_t max_results, std::vector<Found>& found)
+{
+	++stats_.chunks;
+
+	const DecodedChunk* accesses = cache_->find(chunk.rowid);
+	DecodedChunk uncached;
+	if (accesses) {
+		++stats_.cache_hits;
+	} else if (not index_->compact and (options_.chunk_cache_size == 0 or not cache_->admit(chunk.rowid))) {
+		query_accesses(chunk, query, forward, max_results, found);
+		return;
+	} else {
+		uncached = load_chunk(*statements_, *index_, chunk.rowid, chunk.address_first, chunk.slice);
+		if (not index_->compact)
+			cache_->add_load_cost(vm_steps(*statements_->chunk_accesses));
+		if (options_.chunk_cache_size)
+			accesses = &cache_->insert(chunk.rowid, std::move(uncached));
+		else
+			accesses = &uncached;
+	}
+
+	auto add = [&](const ReaderAccess& a) {
+		found.push_back(Found{ MemoryAccess{ a.transition, a.physical_address, a.linear_address, a.size,
+		                                     a.has_linear_address, chunk.operation },
+		                       index_->compact ? chunk.rowid : 0, a.order });
+	};
+
+	// Accesses are sorted by transition
+	auto by_transition = [](const ReaderAccess& a, std::uint64_t transition) { return a.transition < transition; };
+	std::size_t added = 0;
+	if (forward) {
+		auto it = std::lower_bound(accesses->begin(), accesses->end(), query.transition, by_transition);
+		for (; it != accesses->end() and added < max_results; ++it) {
+			if (touches(*it, query)) {
+				add(*it);
+				++added;
+			}
+		}
+	} else {
+		auto it = std::upper_bound(accesses->begin(), accesses->end(), query.transition,
+		                           [](std::uint64_t transition, const ReaderAccess& a) { return transition < a.transition; });
+		while (it != accesses->begin() and added < max_results) {
+			--it;
+			if (touches(*it, query)) {
+				add(*it);
+				++added;
+			}
+		}
+	}
+}
+
+void DbReader::query_accesses(const ChunkRef& chunk, const HalfAxisQuery& query, bool forward,
+                              std::size_t max_results, std::vector<Found>& found)
+{
+	auto& stmt = forward ? *statements_->accesses_forward : *statements_->accesses_backward;
+	stmt.bind_arg_throw(1, chunk.rowid, "chunk_id");
+	stmt.bind_arg_cast(2, query.transition, "transition");
+	if (query.address_last <= static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max())) {
+		stmt.bind_arg_cast(3, query.address_last, "address_last");
+		stmt.bind_arg_cast(4, query.address_first, "address_first");
+	} else {
+		stmt.bind_null(3, "address_last");
+	}
+
+	// Filtering in sqlite saves reading the rows that do not match, but addresses are still checked here when it did
+	// not
+	std::size_t added = 0;
+	while (added < max_results and stmt.step() == Stmt::StepResult::Row) {
+		auto a = access_row(stmt);
+		if (touches(a, query)) {
+			found.push_back(Found{ MemoryAccess{ a.transition, a.physical_address, a.linear_address, a.size,
+			                                     a.has_linear_address, chunk.operation },
+			                       0, a.order });
+			++added;
+		}
+	}
+	stmt.reset();
+
+	auto cost = vm_steps(stmt);
+	if (options_.chunk_cache_size)
+		cache_->add_query_cost(chunk.rowid, cost);
+}
+
+}}}} // namespace reven::backend::memaccess::db
@@ -1,13 +1,18 @@
 #include "db_writer.h"
 
 #include <algorithm>
-#include <sstream>
 #include <iostream>
-
-#include <rvnmetadata/metadata-common.h>
-#include <rvnmetadata/metadata-sql.h>
+#include <limits>
+#include <mutex>
+#include <string>
 
 #include "slice.h"
+#include "async_flusher.h"
+#include "access_journal.h"
+#include "slice_build_worker.h"
+#include "sqlite_sink.h"
+#include "columnar_sink.h"
+#include "sharded_sink.h"
 
 namespace reven {
 namespace backend {
@@ -15,282 +20,737 @@ namespace memaccess {
 namespace db {
 
 /**
- * This structure is there to keep track of information related to the inserted accesses that is not stored in the
- * underlying Slice objects.
- *
- * Note that they are stored in DbWriter::current_access_list_ in their order of appearance, which is lost by the Slice
- * object but required when inserting them in the database.
+ * Slices that are full, along with their accesses, waiting to be built and written to the database.
+ */
+struct PendingSlices {
+	std::unique_ptr<SliceBuilder> read_slice_builder;
+	std::unique_ptr<SliceBuilder> write_slice_builder;
+	std::unique_ptr<AccessJournal> journal;
+	// Already built slices, when built by worker threads instead of the builders above.
+	Slice read_slice;
+	Slice write_slice;
+	// Why the slices were cut, when not because of the limits of the builders
+	DbWriter::Cut cut;
+};
+
+/**
+ * Slices being written over several calls to `push`, in incremental flush mode.
  */
-struct AccessInfo {
-	const ChunkAccess* chunk_access; // Inserted access. Invalidated when builder and built slices are destroyed.
-	bool has_virtual_address;
-	std::uint64_t virtual_address;
-	std::uint8_t operation; // Operation as is supposed to be inserted in the database.
+struct IncrementalFlush {
+	PendingSlices pending;
+	std::unique_ptr<SliceWrite> write;
 };
 
-struct ChunkWithDescription {
-	std::uint8_t operation;
-	const Chunk* chunk;
+/**
+ * The part of DbWriterStats updated when writing slices, which may happen on the background writer.
+ */
+struct WrittenStats {
+	std::mutex mutex;
+	DbWriterStats stats;
 };
 
 namespace {
 
-using Db = sqlite::Database;
-using RDb = sqlite::ResourceDatabase;
-using Stmt = sqlite::Statement;
+std::unique_ptr<SliceBuilder> make_slice_builder(const SliceLimits& limits)
+{
+	auto builder = std::make_unique<SliceBuilder>();
+	if (limits.chunk_size_overlap_limit)
+		builder->chunk_size_overlap_limit(limits.chunk_size_overlap_limit);
+	if (limits.chunk_size_touch_limit)
+		builder->chunk_size_touch_limit(limits.chunk_size_touch_limit);
+	if (limits.access_count_limit)
+		builder->access_count_limit(limits.access_count_limit);
+	if (limits.transition_limit)
+		builder->transition_limit(limits.transition_limit);
+	if (limits.memory_limit)
+		builder->memory_limit(limits.memory_limit);
+	return builder;
+}
+
+// Accesses that can be waiting for each slice building thread. This also bounds how late limits reported by the
+// threads cut slices, so it is kept small: the threads keep up with far less.
+constexpr std::size_t worker_queue_capacity = 1 << 10;
 
-using Meta = ::reven::metadata::Metadata;
-using MetaType = ::reven::metadata::ResourceType;
-using MetaVersion = ::reven::metadata::Version;
+// Accesses the journal of a slice can index, which also bounds the ChunkAccessPool of its builders
+constexpr std::size_t max_slice_accesses = std::numeric_limits<AccessJournal::Index>::max();
 
-void create_sqlite_db(Db& db)
+// Inputs of DbWriter::push_input
+
+class MemoryAccessInput
 {
-	db.exec("create table slices(transition_first int8 not null, transition_last int8 not null);",
-	        "Can't create table slices");
-	db.exec("create table chunks(slice_id int8 not null, phy_first int8 not null, phy_last int8 not null,"
-	        "operation int not null);",
-	        "Can't create table chunks");
-	db.exec("create table accesses(chunk_id int8 not null, transition int8 not null, linear int8,"
-	        "phy_first int8 not null, size int not null, operation int not null);",
-	        "Can't create table accesses");
+public:
+	explicit MemoryAccessInput(const MemoryAccess* accesses) : accesses_(accesses) {}
+
+	std::uint64_t transition_id(std::size_t i) const { return accesses_[i].transition_id; }
+	std::uint64_t physical_address(std::size_t i) const { return accesses_[i].physical_address; }
+	std::uint64_t virtual_address(std::size_t i) const { return accesses_[i].virtual_address; }
+	bool has_virtual_address(std::size_t i) const { return accesses_[i].has_virtual_address; }
+	std::uint32_t size(std::size_t i) const { return accesses_[i].size; }
+	Operation operation(std::size_t i) const { return accesses_[i].operation; }
+
+private:
+	const MemoryAccess* accesses_;
+};
+
+class ColumnsInput
+{
+public:
+	explicit ColumnsInput(const AccessColumns& columns) : columns_(columns)
+	{
+		if (columns.count and (not columns.transition_ids or not columns.physical_addresses or
+		                       (not columns.sizes and not columns.size) or not columns.operations)) {
+			throw std::invalid_argument("DbWriter: missing access columns");
+		}
+	}
 
-	db.exec("create index idx_slices_1 on slices(transition_last);", "Can't create idx_slices_1");
-	db.exec("create index idx_chunks_1 on chunks(operation, slice_id, phy_last);",
-	        "Can't create idx_chunks_1");
-	db.exec("create index idx_accesses_1 on accesses(chunk_id, transition);",
-	        "Can't create idx_accesses_1");
-	db.exec("create index idx_accesses_2 on accesses(transition);",
-	        "Can't create idx_accesses_2");
+	std::uint64_t transition_id(std::size_t i) const { return columns_.transition_ids[i]; }
+	std::uint64_t physical_address(std::size_t i) const { return columns_.physical_addresses[i]; }
+	std::uint64_t virtual_address(std::size_t i) const
+	{
+		return columns_.virtual_addresses ? columns_.virtual_addresses[i] : 0;
+	}
+	bool has_virtual_address(std::size_t i) const
+	{
+		if (columns_.has_virtual_addresses)
+			return columns_.has_virtual_addresses[i] != 0;
+		return columns_.virtual_addresses != nullptr;
+	}
+	std::uint32_t size(std::size_t i) const { return columns_.sizes ? columns_.sizes[i] : columns_.size; }
+	Operation operation(std::size_t i) const { return columns_.operations[i]; }
 
-	db.exec("pragma synchronous=off", "Pragma error");
-	db.exec("pragma count_changes=off", "Pragma error");
-	db.exec("pragma journal_mode=memory", "Pragma error");
-	db.exec("pragma temp_store=memory", "Pragma error");
-}
+private:
+	const AccessColumns& columns_;
+};
 
-// Will insert a slice in the database and return the inserted rowid
-std::uint64_t insert_slice(Db& db, Stmt& stmt, const Slice& read_slice, const Slice& write_slice)
+// Columns without sizes, whose accesses all have size `Size`, so that builders know it at compile time
+template <std::uint32_t Size>
+class FixedSizeColumnsInput : public ColumnsInput
 {
-	// Compute slice bounding box
-	auto transition_first = std::min(read_slice.transition_first(), write_slice.transition_first());
-	auto transition_last = std::max(read_slice.transition_last(), write_slice.transition_last());
+public:
+	using ColumnsInput::ColumnsInput;
 
-	if (read_slice.empty() and write_slice.empty()) {
-		throw std::logic_error("You should not be writing empty slices into database");
+	FixedSize<Size> size(std::size_t) const { return {}; }
+};
+
+// Whether a builder with these limits can refuse accesses
+bool has_insert_limits(const SliceLimits& limits)
+{
+	return limits.chunk_size_overlap_limit or limits.access_count_limit or limits.transition_limit or
+	       limits.memory_limit;
+}
+
+// Call a release callback when going out of scope
+class ReleaseGuard
+{
+public:
+	explicit ReleaseGuard(const std::function<void()>& release) : release_(release) {}
+	~ReleaseGuard()
+	{
+		if (release_)
+			release_();
 	}
 
-	if (read_slice.empty()) {
-		transition_first = write_slice.transition_first();
-		transition_last = write_slice.transition_last();
-	} else if (write_slice.empty()) {
-		transition_first = read_slice.transition_first();
-		transition_last = read_slice.transition_last();
+private:
+	const std::function<void()>& release_;
+};
+
+// Checked for every access: reads and writes are only ordered within their own slice, and not at all for unchecked
+// accesses.
+void check_resume_transition(std::uint64_t transition_id, std::uint64_t resume_transition)
+{
+	if (transition_id < resume_transition) {
+		throw std::invalid_argument("DbWriter: access before the resume transition, already in the database");
 	}
+}
 
-	stmt.bind_arg_throw(1, transition_first, "transition_first");
-	stmt.bind_arg_throw(2, transition_last, "transition_last");
-	stmt.step();
+} // anonymous namespace
 
-	stmt.reset();
+DbWriter::DbWriter(const char* filename, const char* tool_name, const char* tool_version, const char* tool_info,
+                   const DbWriterOptions& options) :
+	DbWriter(std::make_unique<SqliteSink>(filename, tool_name, tool_version, tool_info, options), options)
+{
+}
 
-	return static_cast<std::uint64_t>(db.last_insert_rowid());
+DbWriter::DbWriter(std::unique_ptr<Sink> sink, const DbWriterOptions& options) :
+	options_(options),
+	sink_(std::move(sink)),
+	written_stats_(std::make_unique<WrittenStats>())
+{
+	create_slices();
 }
 
+DbWriter DbWriter::from_memory(const char* tool_name, const char* tool_version, const char* tool_info,
+                               const DbWriterOptions& options)
+{
+	return DbWriter(":memory:", tool_name, tool_version, tool_info, options);
+}
 
-} // anonymous namespace
+DbWriter DbWriter::columnar(const char* filename, const char* tool_name, const char* tool_version,
+                            const char* tool_info, const DbWriterOptions& options)
+{
+	return DbWriter(std::make_unique<ColumnarSink>(filename, tool_name, tool_version, tool_info), options);
+}
+
+DbWriter DbWriter::sharded(const char* filename, const char* tool_name, const char* tool_version,
+                           const char* tool_info, const DbWriterOptions& options)
+{
+	// Shards are only created along the way: check their options right away.
+	if (options.bulk_insert_rows == 0) {
+		throw std::invalid_argument("DbWriter: bulk_insert_rows must be at least 1");
+	}
+
+	std::string tool_name_string = tool_name;
+	std::string tool_version_string = tool_version;
+	std::string tool_info_string = tool_info;
+	auto factory = [tool_name_string, tool_version_string, tool_info_string, options](const std::string& shard) {
+		return std::make_unique<SqliteSink>(shard.c_str(), tool_name_string.c_str(), tool_version_string.c_str(),
+		                                    tool_info_string.c_str(), options);
+	};
+	return DbWriter(std::make_unique<ShardedSink>(filename, factory, options.shard_slice_limit,
+	                                              options.shard_transition_limit), options);
+}
+
+DbWriter DbWriter::open_resume(const char* filename, const DbWriterOptions& options)
+{
+	auto sink = SqliteSink::resume(filename, options);
+	auto transition_end = sink->transition_end();
+
+	DbWriter writer(std::move(sink), options);
+	writer.resume_transition_ = transition_end;
+	writer.written_transition_end_ = transition_end;
+	return writer;
+}
 
+void DbWriter::push(const MemoryAccess& access)
+{
+	push(&access, 1);
+}
 
+void DbWriter::push(const MemoryAccess* accesses, std::size_t count)
+{
+	check_worker_error();
+	step_incremental_flush();
+	if (read_worker_)
+		push_input_to_workers(MemoryAccessInput(accesses), count);
+	else
+		push_input(MemoryAccessInput(accesses), count);
+}
 
-// Will insert chunks from both slices in the database and return a map of ChunkAccess -> corresponding chunk rowid
-void DbWriter::insert_accesses()
+void DbWriter::push(const AccessColumns& columns, const std::function<void()>& release)
 {
-	for (const auto& access: current_access_list_) {
-		auto chunk_id_it = access_to_chunk_id_.find(access.chunk_access);
-		if (chunk_id_it == access_to_chunk_id_.end()) {
-			throw std::logic_error("access_to_chunk_id object should contain all accesses, but one is missing");
+	ReleaseGuard guard(release);
+
+	check_worker_error();
+	step_incremental_flush();
+	if (read_worker_) {
+		push_input_to_workers(ColumnsInput(columns), columns.count);
+		return;
+	}
+
+	if (not columns.sizes) {
+		switch (columns.size) {
+			case 1: push_input(FixedSizeColumnsInput<1>(columns), columns.count); return;
+			case 2: push_input(FixedSizeColumnsInput<2>(columns), columns.count); return;
+			case 4: push_input(FixedSizeColumnsInput<4>(columns), columns.count); return;
+			case 8: push_input(FixedSizeColumnsInput<8>(columns), columns.count); return;
 		}
+	}
+	push_input(ColumnsInput(columns), columns.count);
+}
 
-		insert_access_stmt_.bind_arg_throw(1, chunk_id_it->second, "chunk_id");
-		insert_access_stmt_.bind_arg_throw(2, access.chunk_access->transition, "transition");
-		if (access.has_virtual_address)
-			insert_access_stmt_.bind_arg_cast(3, access.virtual_address, "linear");
+template <typename Input>
+void DbWriter::push_input(const Input& input, std::size_t count)
+{
+	bool limits = has_insert_limits(options_.read_slice_limits) or has_insert_limits(options_.write_slice_limits);
+	if (limits) {
+		if (options_.unchecked_accesses)
+			push_input_with<InsertPolicy<true, false>>(input, count);
+		else
+			push_input_with<InsertPolicy<true, true>>(input, count);
+	} else {
+		if (options_.unchecked_accesses)
+			push_input_with<InsertPolicy<false, false>>(input, count);
 		else
-			insert_access_stmt_.bind_null(3, "linear");
-		insert_access_stmt_.bind_arg_throw(4, access.chunk_access->address, "phy_first");
-		insert_access_stmt_.bind_arg_throw(5, access.chunk_access->size, "size");
-		insert_access_stmt_.bind_arg_extend(6, access.operation, "operation");
-		insert_access_stmt_.step();
-		insert_access_stmt_.reset();
+			push_input_with<InsertPolicy<false, true>>(input, count);
 	}
 }
 
-
-void DbWriter::insert_chunks(const Slice& read_slice, const Slice& write_slice, std::uint64_t slice_id)
+template <typename Policy, typename Input>
+void DbWriter::push_input_with(const Input& input, std::size_t count)
 {
-	chunk_list_.clear();
-	access_to_chunk_id_.clear();
+	reserve_accesses(count);
+
+	// Builders only change when slices are cut, so they are resolved once instead of for each access.
+	SliceBuilder* read_builder = read_slice_builder_.get();
+	SliceBuilder* write_builder = write_slice_builder_.get();
+
+	for (std::size_t i = 0; i < count; ++i) {
+		auto transition_id = input.transition_id(i);
+		auto physical_address = input.physical_address(i);
+		auto size = input.size(i);
+		auto operation = input.operation(i);
+		check_resume_transition(transition_id, resume_transition_);
+
+		SliceBuilder* builder;
+		switch(operation) {
+			case Operation::Read: builder = read_builder; ++read_access_count_; break;
+			case Operation::Write: builder = write_builder; ++write_access_count_; break;
+			case Operation::Execute: throw std::runtime_error("Execute access is not supported");
+			default: throw std::logic_error("Unknown access type");
+		}
 
-	for (const auto& it : read_slice) {
-		chunk_list_.emplace_back(ChunkWithDescription{ static_cast<std::uint8_t>(Operation::Read), &it.second });
-	}
-	for (const auto& it : write_slice) {
-		chunk_list_.emplace_back(ChunkWithDescription{ static_cast<std::uint8_t>(Operation::Write), &it.second });
+		if (transition_id != last_transition_ and over_memory_budget()) {
+			cut_slices(Cut::MemoryBudget);
+			reserve_accesses(count - i);
+			read_builder = read_slice_builder_.get();
+			write_builder = write_slice_builder_.get();
+			builder = operation == Operation::Read ? read_builder : write_builder;
+		}
+		last_transition_ = transition_id;
+
+		if (journal_->size() == max_slice_accesses) {
+			cut_slices(Cut::Capacity);
+			reserve_accesses(count - i);
+			read_builder = read_slice_builder_.get();
+			write_builder = write_slice_builder_.get();
+			builder = operation == Operation::Read ? read_builder : write_builder;
+		}
+
+		auto journal_index = static_cast<AccessJournal::Index>(journal_->size());
+		const auto* inserted_access = builder->insert<Policy>(transition_id, physical_address, size, journal_index);
+		if (Policy::limits and not inserted_access) {
+			cut_slices(Cut::Limit);
+			reserve_accesses(count - i);
+
+			// Note that SliceBuilder pointers will have changed since last `insert` call
+			read_builder = read_slice_builder_.get();
+			write_builder = write_slice_builder_.get();
+			builder = operation == Operation::Read ? read_builder : write_builder;
+
+			journal_index = 0;
+			inserted_access = builder->insert<Policy>(transition_id, physical_address, size, journal_index);
+			if (not inserted_access) {
+				throw std::logic_error("Insertion must be possible on empty slices");
+			}
+		}
+		journal_->push_back(transition_id, physical_address, input.virtual_address(i), input.has_virtual_address(i),
+		                    size, static_cast<std::uint8_t>(operation));
 	}
+}
 
-	// Let's ease sqlite's job and ensure chunks are naturally sorted by ascending address
-	std::sort(chunk_list_.begin(), chunk_list_.end(), [](const ChunkWithDescription& a, const ChunkWithDescription& b) {
-		return a.chunk->address_first() > b.chunk->address_first();
-	});
-
-	for (const auto& it : chunk_list_) {
-		insert_chunk_stmt_.bind_arg_throw(1, slice_id, "slice_id");
-		insert_chunk_stmt_.bind_arg_throw(2, it.chunk->address_first(), "phy_first");
-		insert_chunk_stmt_.bind_arg_throw(3, it.chunk->address_last(), "phy_last");
-		insert_chunk_stmt_.bind_arg_extend(4, it.operation, "operation");
-		insert_chunk_stmt_.step();
-		insert_chunk_stmt_.reset();
-
-		std::uint64_t chunk_id = static_cast<std::uint64_t>(db_.last_insert_rowid());
-		for (auto a = it.chunk->accesses(); a; a = a->next()) {
-			access_to_chunk_id_.emplace(a, chunk_id);
+template <typename Input>
+void DbWriter::push_input_to_workers(const Input& input, std::size_t count)
+{
+	reserve_accesses(count);
+
+	for (std::size_t i = 0; i < count; ++i) {
+		auto transition_id = input.transition_id(i);
+		auto size = input.size(i);
+		auto operation = input.operation(i);
+		check_resume_transition(transition_id, resume_transition_);
+
+		SliceBuildWorker* worker;
+		switch(operation) {
+			case Operation::Read: worker = read_worker_.get(); ++read_access_count_; break;
+			case Operation::Write: worker = write_worker_.get(); ++write_access_count_; break;
+			case Operation::Execute: throw std::runtime_error("Execute access is not supported");
+			default: throw std::logic_error("Unknown access type");
+		}
+
+		// Checked here, since workers cannot refuse accesses synchronously
+		if (size == 0) {
+			throw std::invalid_argument("SliceBuilder insertion: attempted to insert access with size 0");
+		}
+
+		// Workers only request cuts, which are done on the next transition, so that both slices end on the same one
+		if (transition_id != last_transition_ and not journal_->empty()) {
+			if (read_worker_->cut_requested() or write_worker_->cut_requested()) {
+				cut_slices(Cut::Limit);
+				reserve_accesses(count - i);
+			} else if (over_memory_budget()) {
+				cut_slices(Cut::MemoryBudget);
+				reserve_accesses(count - i);
+			}
+		}
+		last_transition_ = transition_id;
+
+		// Limits that only depend on the accesses, like the capacity of the journal, are checked here instead, so that
+		// slices are cut on the same accesses as without workers.
+		if (journal_->size() == max_slice_accesses) {
+			cut_slices(Cut::Capacity);
+			reserve_accesses(count - i);
+		} else if (worker->refuses(transition_id)) {
+			cut_slices(Cut::Limit);
+			reserve_accesses(count - i);
 		}
+
+		worker->insert(transition_id, input.physical_address(i), size,
+		               static_cast<AccessJournal::Index>(journal_->size()));
+		journal_->push_back(transition_id, input.physical_address(i), input.virtual_address(i),
+		                    input.has_virtual_address(i), size, static_cast<std::uint8_t>(operation));
 	}
 }
 
+std::size_t DbWriter::memory_usage() const
+{
+	std::size_t usage = journal_ ? journal_->memory_usage() : 0;
+	if (read_worker_)
+		return usage + read_worker_->memory_usage() + write_worker_->memory_usage();
+	if (read_slice_builder_)
+		usage += read_slice_builder_->memory_usage() + write_slice_builder_->memory_usage();
+	return usage;
+}
 
-DbWriter::DbWriter(const char* filename, const char* tool_name, const char* tool_version, const char* tool_info) :
-	db_([filename, tool_name, tool_version, tool_info]() {
-	auto md = Meta(
-		MetaType::MemHist,
-		MetaVersion::from_string(format_version),
-		tool_name,
-		MetaVersion::from_string(tool_version),
-		tool_info + std::string(" - using rvnmemhistwriter ") + writer_version
-	);
+DbWriterStats DbWriter::stats() const
+{
+	DbWriterStats stats;
+	{
+		std::lock_guard<std::mutex> lock(written_stats_->mutex);
+		stats = written_stats_->stats;
+	}
+	stats.read_accesses = read_access_count_;
+	stats.write_accesses = write_access_count_;
+	return stats;
+}
 
-	auto rdb = RDb::create(filename, metadata::to_sqlite_raw_metadata(md));
-	create_sqlite_db(rdb);
-	return rdb;
-}()),
-	insert_slice_stmt_(db_, "insert into slices values (?,?);"),
-	insert_chunk_stmt_(db_, "insert into chunks values (?,?,?,?);"),
-	insert_access_stmt_(db_, "insert into accesses values (?,?,?,?,?,?);")
+bool DbWriter::over_memory_budget() const
 {
-	create_slices();
+	return options_.memory_budget and not journal_->empty() and memory_usage() >= options_.memory_budget;
 }
 
-DbWriter DbWriter::from_memory(const char* tool_name, const char* tool_version, const char* tool_info)
+void DbWriter::cut_slices(Cut cut)
 {
-	return DbWriter(":memory:", tool_name, tool_version, tool_info);
+	insert_slices(cut);
+	create_slices();
 }
 
-void DbWriter::push(const MemoryAccess& access)
+void DbWriter::reserve_accesses(std::size_t count)
 {
-	auto& builder = [&access, this]() -> std::unique_ptr<SliceBuilder>& {
-		switch(access.operation) {
-			case Operation::Read: return read_slice_builder_;
-			case Operation::Write: return write_slice_builder_;
-			case Operation::Execute: throw std::runtime_error("Execute access is not supported");
-		}
-		throw std::logic_error("Unknown access type");
-	}();
+	journal_->reserve_more(count);
+}
 
-	const auto* inserted_access = builder->insert(access.transition_id, access.physical_address, access.size);
-	if (not inserted_access) {
-		insert_slices();
-		create_slices();
+void DbWriter::create_slices()
+{
+	journal_ = std::make_unique<AccessJournal>();
+
+	const auto& read_limits = options_.read_slice_limits;
+	const auto& write_limits = options_.write_slice_limits;
+	if (not options_.parallel_slice_building) {
+		read_slice_builder_ = make_slice_builder(read_limits);
+		write_slice_builder_ = make_slice_builder(write_limits);
+	} else if (not read_worker_) {
+		// Workers start new slices by themselves when cut
+		read_worker_ = std::make_unique<SliceBuildWorker>(
+		  worker_queue_capacity, [read_limits]() { return make_slice_builder(read_limits); },
+		  read_limits.access_count_limit, read_limits.transition_limit);
+		write_worker_ = std::make_unique<SliceBuildWorker>(
+		  worker_queue_capacity, [write_limits]() { return make_slice_builder(write_limits); },
+		  write_limits.access_count_limit, write_limits.transition_limit);
+	}
+}
 
-		// Note that SliceBuilder pointers will have changed since last `insert` call
+void DbWriter::insert_slices(Cut cut)
+{
+	check_worker_error();
+	if (not journal_ or journal_->empty())
+		return;
 
-		inserted_access = builder->insert(access.transition_id, access.physical_address, access.size);
-		if (not inserted_access) {
-			throw std::logic_error("Insertion must be possible on empty slices");
+	PendingSlices pending;
+	// Both slices are built at the same time. Nothing is moved before they are, so that the writer is left as is on
+	// errors.
+	if (read_worker_)
+		take_worker_slices(&pending.read_slice, &pending.write_slice);
+
+	written_transition_end_ = journal_->transition(static_cast<AccessJournal::Index>(journal_->size() - 1)) + 1;
+	pending.read_slice_builder = std::move(read_slice_builder_);
+	pending.write_slice_builder = std::move(write_slice_builder_);
+	pending.journal = std::move(journal_);
+	pending.cut = cut;
+
+	if (options_.incremental_flush_rows and not options_.async_flush_queue_depth and cut != Cut::Final) {
+		complete_incremental_flush();
+		build_slices(pending);
+		incremental_flush_ = std::make_unique<IncrementalFlush>();
+		incremental_flush_->pending = std::move(pending);
+		auto& flushed = incremental_flush_->pending;
+		incremental_flush_->write = sink_->start_write_slices(flushed.read_slice, flushed.write_slice,
+		                                                      *flushed.journal);
+	} else if (not options_.async_flush_queue_depth) {
+		complete_incremental_flush();
+		write_slices(pending);
+	} else {
+		if (async_flusher_.error)
+			std::rethrow_exception(async_flusher_.error);
+
+		if (not async_flusher_.flusher) {
+			async_flusher_.flusher = std::make_unique<AsyncFlusher<PendingSlices>>(
+			  options_.async_flush_queue_depth, [this](PendingSlices& p) { write_slices(p); });
 		}
+		async_flusher_.flusher->submit(std::move(pending));
 	}
-	current_access_list_.push_back(
-	  { inserted_access, access.has_virtual_address, access.virtual_address, static_cast<std::uint8_t>(access.operation) });
+
+	if (options_.stats_callback)
+		options_.stats_callback(stats());
 }
 
-void DbWriter::create_slices()
+void DbWriter::write_slices(PendingSlices& pending)
 {
-	// These capping values are found empirically
-	std::size_t overlap_limit = 100000; // reasonable access time
-	std::size_t touch_limit = 1000;
-	std::size_t access_count_limit = 10000000; // ~3Go ram while building
-	std::size_t chunk_count_reserve = 10000000; // Allow for 1M accesses in a slice, while costing only 160MB
+	build_slices(pending);
+	sink_->write_slices(pending.read_slice, pending.write_slice, *pending.journal);
+	record_written(pending);
 
-	chunk_list_.reserve(chunk_count_reserve);
+	// Release the slices and their accesses right away
+	pending = PendingSlices();
+}
 
-	read_slice_builder_ = std::make_unique<SliceBuilder>();
-	read_slice_builder_->chunk_size_overlap_limit(overlap_limit)
-	  .chunk_size_touch_limit(touch_limit)
-	  .access_count_limit(access_count_limit);
-	write_slice_builder_ = std::make_unique<SliceBuilder>();
-	write_slice_builder_->chunk_size_overlap_limit(overlap_limit)
-	  .chunk_size_touch_limit(touch_limit)
-	  .access_count_limit(access_count_limit);
+void DbWriter::build_slices(PendingSlices& pending)
+{
+	if (pending.read_slice_builder) {
+		pending.read_slice = std::move(*pending.read_slice_builder).build();
+		pending.read_slice_builder.reset();
+		pending.write_slice = std::move(*pending.write_slice_builder).build();
+		pending.write_slice_builder.reset();
+	}
 }
 
-void DbWriter::insert_slices()
+void DbWriter::step_incremental_flush()
 {
-	if (current_access_list_.empty())
+	if (not incremental_flush_)
 		return;
 
-	auto read_slice = std::move(*read_slice_builder_).build();
-	read_slice_builder_.reset();
-	auto write_slice = std::move(*write_slice_builder_).build();
-	write_slice_builder_.reset();
+	// Dropped on errors as well: the sink cannot resume a failed write
+	auto flush = std::move(incremental_flush_);
+	if (not flush->write->step(options_.incremental_flush_rows)) {
+		incremental_flush_ = std::move(flush);
+		return;
+	}
+	record_written(flush->pending);
+}
 
-	db_.exec("begin", "Cannot start transaction");
+void DbWriter::complete_incremental_flush()
+{
+	if (not incremental_flush_)
+		return;
 
-	std::uint64_t slice_id = insert_slice(db_, insert_slice_stmt_, read_slice, write_slice);
+	auto flush = std::move(incremental_flush_);
+	flush->write->step(SliceWrite::all_rows);
+	record_written(flush->pending);
+}
 
-	insert_chunks(read_slice, write_slice, slice_id);
+void DbWriter::record_written(const PendingSlices& pending)
+{
+	const auto& read_stats = pending.read_slice.build_stats();
+	const auto& write_stats = pending.write_slice.build_stats();
+	auto times = sink_->times();
+
+	std::lock_guard<std::mutex> lock(written_stats_->mutex);
+	auto& stats = written_stats_->stats;
+	stats.slices += 1;
+	stats.chunks += pending.read_slice.chunk_count() + pending.write_slice.chunk_count();
+	stats.overlap_merges += read_stats.overlap_merges + write_stats.overlap_merges;
+	stats.touch_merges += read_stats.touch_merges + write_stats.touch_merges;
+	stats.build_time += read_stats.build_time + write_stats.build_time;
+
+	auto limit = read_stats.limit != SliceLimit::None ? read_stats.limit : write_stats.limit;
+	if (pending.cut == Cut::MemoryBudget)
+		stats.memory_budget_cuts += 1;
+	else if (pending.cut == Cut::Capacity)
+		stats.access_count_cuts += 1;
+	else if (pending.cut == Cut::Final or limit == SliceLimit::None)
+		stats.final_cuts += 1;
+	else if (limit == SliceLimit::AccessCount)
+		stats.access_count_cuts += 1;
+	else if (limit == SliceLimit::Memory)
+		stats.memory_limit_cuts += 1;
+	else if (limit == SliceLimit::ChunkSizeOverlap)
+		stats.chunk_size_overlap_cuts += 1;
+	else
+		stats.transition_cuts += 1;
+
+	stats.chunk_insert_time = times.chunks;
+	stats.access_insert_time = times.accesses;
+	stats.commit_time = times.commit;
+}
+
+void DbWriter::discard_after(uint64_t transition_count)
+{
+	check_worker_error();
+
+	// The sink is only asked to delete accesses when written slices have some, which is rare since this is mostly
+	// called to drop the last, incomplete, transition. It goes first so that nothing changes if it refuses.
+	if (written_transition_end_ > transition_count) {
+		async_flusher_.join();
+		complete_incremental_flush();
+		sink_->discard_after(transition_count);
+	}
+
+	discard_open_accesses_after(transition_count);
+}
+
+void DbWriter::discard_open_accesses_after(uint64_t transition_count)
+{
+	if (not journal_)
+		return;
 
-	insert_accesses();
+	// Accesses are in order of transition, and the discarded ones are usually a few at the end
+	auto kept = static_cast<AccessJournal::Index>(journal_->size());
+	while (kept > 0 and journal_->transition(kept - 1) >= transition_count)
+		--kept;
+	if (kept == journal_->size())
+		return;
 
-	db_.exec("commit", "Can't commit transaction");
+	// Chunks cannot shrink, so the open slices are built again from the kept accesses, which gives them tight bounds.
+	// They are inserted in the same order as when pushed, so the builders accept them all again.
+	journal_->truncate(kept);
+	if (read_worker_) {
+		take_worker_slices(nullptr, nullptr);
+	} else {
+		read_slice_builder_ = make_slice_builder(options_.read_slice_limits);
+		write_slice_builder_ = make_slice_builder(options_.write_slice_limits);
+	}
 
-	// Slices will be deleted when this function exits, invalidating these pointers. We couldn't keep them even if we
-	// needed to.
-	current_access_list_.clear();
+	for (AccessJournal::Index i = 0; i < kept; ++i) {
+		bool read = static_cast<Operation>(journal_->operation(i)) == Operation::Read;
+		if (read_worker_) {
+			auto& worker = read ? *read_worker_ : *write_worker_;
+			worker.insert(journal_->transition(i), journal_->physical_address(i), journal_->size(i), i);
+		} else {
+			auto& builder = read ? *read_slice_builder_ : *write_slice_builder_;
+			if (not builder.insert(journal_->transition(i), journal_->physical_address(i), journal_->size(i), i)) {
+				throw std::logic_error("Insertion of kept accesses must be possible");
+			}
+		}
+	}
+	if (kept > 0)
+		last_transition_ = journal_->transition(kept - 1);
 }
 
-void DbWriter::discard_after(uint64_t transition_count)
+void DbWriter::take_worker_slices(Slice* read_slice, Slice* write_slice)
 {
-	// We have no choice but to dump the current open slices, regardless of constraints. This is OK, because we call
-	// this at the end of the recording. This is why push after this method should not happen.
-	insert_slices();
+	read_worker_->request_cut();
+	write_worker_->request_cut();
+
+	// Both workers must be waited for, even when the first one failed
+	std::exception_ptr error;
+	try {
+		auto slice = read_worker_->take_slice();
+		if (read_slice)
+			*read_slice = std::move(slice);
+	} catch (...) {
+		error = std::current_exception();
+	}
+	try {
+		auto slice = write_worker_->take_slice();
+		if (write_slice)
+			*write_slice = std::move(slice);
+	} catch (...) {
+		if (not error)
+			error = std::current_exception();
+	}
 
-	std::stringstream ss;
-	ss << "delete from accesses where "
-	   << "chunk_id >= (select min(rowid) from chunks where "
-	   <<              "slice_id = (select rowid from slices where transition_last >= " << transition_count
-	   <<                         " limit 1) limit 1) and "
-	   << "transition >= " << transition_count << ";";
-	db_.exec(ss.str().c_str(), "Can't discard accesses");
+	if (error) {
+		worker_error_ = error;
+		std::rethrow_exception(error);
+	}
+}
 
-	// Note we do not shrink chunks or slices to reflect this change, which may result in slight inconsistencies where
-	// chunks are empty or not tight.
-	// This should not be a problem because the user should always end up requesting the accesses for a given chunk,
-	// and in this case accesses will simply not be there.
+void DbWriter::check_worker_error() const
+{
+	if (worker_error_)
+		std::rethrow_exception(worker_error_);
 }
 
 DbWriter::~DbWriter()
 {
-	if (db_.get()) {
-		insert_slices();
+	if (not sink_)
+		return;
+
+	// Like worker errors, errors of the background writer or the sink cannot be reported from here
+	try {
+		finish_sink();
+	} catch (...) {
+	}
+}
+
+sqlite::ResourceDatabase DbWriter::take() &&
+{
+	auto* sqlite_sink = dynamic_cast<SqliteSink*>(sink_.get());
+	if (not sqlite_sink) {
+		throw std::logic_error("DbWriter: take is only possible when writing to sqlite, use finish instead");
 	}
+
+	insert_slices(Cut::Final);
+	complete_incremental_flush();
+	async_flusher_.join();
+	sqlite_sink->finish();
+	auto db = std::move(*sqlite_sink).take();
+	sink_.reset();
+	return db;
 }
 
-RDb DbWriter::take() &&
+void DbWriter::finish() &&
 {
-	insert_slices();
-	return std::move(db_);
+	check_worker_error();
+	if (sink_)
+		finish_sink();
 }
 
-// Move ctor/op can be default because they the dtor does nothing after the move db_
+void DbWriter::finish_sink()
+{
+	// After a worker error, only the slices written before it are kept
+	if (not worker_error_)
+		insert_slices(Cut::Final);
+	complete_incremental_flush();
+	async_flusher_.join();
+	sink_->finish();
+	sink_.reset();
+}
+
+// Move ctor/op can be default because they the dtor does nothing after the move of sink_, and because `async_flusher_`
+// stops the background writer before the members it uses are moved.
 DbWriter::DbWriter(DbWriter&&) = default;
 DbWriter& DbWriter::operator=(DbWriter&&) = default;
 
+DbWriter::AsyncFlusherHandle::AsyncFlusherHandle() = default;
+
+DbWriter::AsyncFlusherHandle::AsyncFlusherHandle(AsyncFlusherHandle&& other)
+{
+	*this = std::move(other);
+}
+
+DbWriter::AsyncFlusherHandle& DbWriter::AsyncFlusherHandle::operator=(AsyncFlusherHandle&& other)
+{
+	if (flusher) {
+		flusher->stop();
+		error = flusher->error();
+		flusher.reset();
+	}
+
+	if (other.flusher) {
+		other.flusher->stop();
+		other.error = other.flusher->error();
+		other.flusher.reset();
+	}
+
+	if (not error)
+		error = other.error;
+	other.error = nullptr;
+
+	return *this;
+}
+
+DbWriter::AsyncFlusherHandle::~AsyncFlusherHandle() = default;
+
+void DbWriter::AsyncFlusherHandle::join()
+{
+	if (flusher) {
+		flusher->stop();
+		error = flusher->error();
+		flusher.reset();
+	}
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
 }}}} // namespace reven::backend::memaccess::db
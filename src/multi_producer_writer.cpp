@@ -0,0 +1,269 @@
+#include "multi_producer_writer.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+namespace {
+
+// Accesses buffered by a producer before handing them over. The shared lock is taken once per batch.
+constexpr std::size_t producer_batch_size = 4096;
+
+// Batches of a producer that can be waiting for the merger: `push` blocks when there are more.
+constexpr std::size_t producer_queue_depth = 16;
+
+constexpr std::uint64_t no_limit = std::numeric_limits<std::uint64_t>::max();
+
+} // anonymous namespace
+
+struct MultiProducerWriter::Producer::Shared {
+	struct Queue {
+		std::deque<std::vector<MemoryAccess>> batches;
+		// Position of the next access to merge in the front batch
+		std::size_t position = 0;
+		// The next accesses of the producer will have a transition >= watermark
+		std::uint64_t watermark = 0;
+		bool closed = false;
+
+		bool has_accesses() const { return not batches.empty(); }
+		std::uint64_t next_transition() const { return batches.front()[position].transition_id; }
+	};
+
+	Shared(DbWriter writer, std::size_t producer_count)
+	  : writer(std::move(writer))
+	  , queues(producer_count)
+	{
+	}
+
+	// Runs on the merger thread until all producers are closed and merged, or stopping is set.
+	void merge();
+
+	// Throw the error of the merger, if any. The lock must be held.
+	void check_error() const
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	DbWriter writer;
+
+	std::mutex mutex;
+	// Notified when a producer hands something over, or on stop
+	std::condition_variable changed;
+	// Notified when the merger pops a batch, or fails
+	std::condition_variable not_full;
+	std::vector<Queue> queues;
+	std::exception_ptr error;
+	bool stopping = false;
+
+	// Last, so that the other members exist while it runs.
+	std::thread merger;
+};
+
+void MultiProducerWriter::Producer::Shared::merge()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (not stopping) {
+		// The producer with the earliest next access
+		Queue* next = nullptr;
+		for (auto& queue : queues) {
+			if (queue.has_accesses() and (not next or queue.next_transition() < next->next_transition()))
+				next = &queue;
+		}
+
+		if (not next) {
+			if (std::all_of(queues.begin(), queues.end(), [](const Queue& queue) { return queue.closed; }))
+				return;
+			changed.wait(lock);
+			continue;
+		}
+
+		// Its accesses can be merged up to the next access of the others, included since ties are allowed, and up to
+		// the point where idle producers may still push, excluded.
+		std::uint64_t included_limit = no_limit;
+		std::uint64_t excluded_limit = no_limit;
+		for (const auto& queue : queues) {
+			if (&queue == next)
+				continue;
+			if (queue.has_accesses())
+				included_limit = std::min(included_limit, queue.next_transition());
+			else if (not queue.closed)
+				excluded_limit = std::min(excluded_limit, queue.watermark);
+		}
+
+		const auto& batch = next->batches.front();
+		auto first = next->position;
+		auto last = first;
+		while (last < batch.size() and batch[last].transition_id <= included_limit and
+		       batch[last].transition_id < excluded_limit) {
+			++last;
+		}
+
+		if (last == first) {
+			// Waiting for an idle producer
+			changed.wait(lock);
+			continue;
+		}
+
+		// Only the merger removes batches, so this one stays valid while unlocked
+		lock.unlock();
+		try {
+			writer.push(batch.data() + first, last - first);
+		} catch (...) {
+			lock.lock();
+			error = std::current_exception();
+			not_full.notify_all();
+			return;
+		}
+		lock.lock();
+
+		next->position = last;
+		if (last == batch.size()) {
+			next->batches.pop_front();
+			next->position = 0;
+			not_full.notify_all();
+		}
+	}
+}
+
+MultiProducerWriter::Producer::Producer(Shared& shared, std::size_t index)
+  : shared_(&shared)
+  , index_(index)
+{
+	batch_.reserve(producer_batch_size);
+}
+
+void MultiProducerWriter::Producer::push(const MemoryAccess& access)
+{
+	push(&access, 1);
+}
+
+void MultiProducerWriter::Producer::push(const MemoryAccess* accesses, std::size_t count)
+{
+	if (closed_) {
+		throw std::logic_error("MultiProducerWriter: push on a closed producer");
+	}
+
+	for (std::size_t i = 0; i < count; ++i) {
+		const auto& access = accesses[i];
+		if (access.transition_id < last_transition_) {
+			throw std::invalid_argument("MultiProducerWriter: accesses of a producer must be in order of transition");
+		}
+		last_transition_ = access.transition_id;
+
+		batch_.push_back(access);
+		if (batch_.size() >= producer_batch_size)
+			submit(last_transition_, false);
+	}
+}
+
+void MultiProducerWriter::Producer::advance(std::uint64_t transition)
+{
+	if (closed_) {
+		throw std::logic_error("MultiProducerWriter: advance on a closed producer");
+	}
+	if (transition < last_transition_) {
+		throw std::invalid_argument("MultiProducerWriter: cannot advance before the last pushed access");
+	}
+
+	last_transition_ = transition;
+	submit(transition, false);
+}
+
+void MultiProducerWriter::Producer::close()
+{
+	if (closed_)
+		return;
+
+	submit(last_transition_, true);
+	closed_ = true;
+}
+
+void MultiProducerWriter::Producer::submit(std::uint64_t watermark, bool closing)
+{
+	auto& shared = *shared_;
+	auto& queue = shared.queues[index_];
+	{
+		std::unique_lock<std::mutex> lock(shared.mutex);
+		if (not batch_.empty()) {
+			// The last batch goes over the depth rather than waiting: the merger may be waiting for a producer that is
+			// only closed after this one, as `finish` does.
+			if (not closing) {
+				shared.not_full.wait(lock, [&]() {
+					return shared.error or shared.stopping or queue.batches.size() < producer_queue_depth;
+				});
+			}
+			shared.check_error();
+
+			queue.batches.push_back(std::move(batch_));
+		}
+		queue.watermark = watermark;
+		queue.closed = closing;
+	}
+	shared.changed.notify_one();
+
+	batch_.clear();
+	if (not closing)
+		batch_.reserve(producer_batch_size);
+}
+
+MultiProducerWriter::MultiProducerWriter(DbWriter writer, std::size_t producer_count)
+  : shared_(new Producer::Shared(std::move(writer), producer_count))
+{
+	if (producer_count == 0) {
+		throw std::invalid_argument("MultiProducerWriter: at least one producer is required");
+	}
+
+	producers_.reserve(producer_count);
+	for (std::size_t i = 0; i < producer_count; ++i)
+		producers_.emplace_back(new Producer(*shared_, i));
+
+	auto& shared = *shared_;
+	shared.merger = std::thread([&shared]() { shared.merge(); });
+}
+
+MultiProducerWriter::~MultiProducerWriter()
+{
+	if (not shared_ or not shared_->merger.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(shared_->mutex);
+		shared_->stopping = true;
+	}
+	shared_->changed.notify_one();
+	shared_->not_full.notify_all();
+	shared_->merger.join();
+}
+
+MultiProducerWriter::Producer& MultiProducerWriter::producer(std::size_t index)
+{
+	return *producers_.at(index);
+}
+
+DbWriter MultiProducerWriter::finish() &&
+{
+	for (auto& producer : producers_) {
+		try {
+			producer->close();
+		} catch (...) {
+			// The same error is rethrown below
+		}
+	}
+
+	shared_->merger.join();
+	shared_->check_error();
+	return std::move(shared_->writer);
+}
+
+}}}} // namespace reven::backend::memaccess::db
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+
+#include "sink.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * Drops slices, only counting them. Meant to measure building slices without the cost of any storage.
+ */
+class NullSink : public Sink
+{
+public:
+	struct Counts {
+		std::uint64_t slices = 0;
+		std::uint64_t chunks = 0;
+		std::uint64_t accesses = 0;
+	};
+
+	/**
+	 * When not null, `counts` is updated with what the sink receives. It must outlive the sink.
+	 */
+	explicit NullSink(Counts* counts = nullptr) : counts_(counts) {}
+
+	void write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal) override
+	{
+		// Still reject what other sinks would
+		slice_transitions(read_slice, write_slice);
+
+		if (counts_) {
+			counts_->slices += 1;
+			counts_->chunks += read_slice.chunk_count() + write_slice.chunk_count();
+			counts_->accesses += journal.size();
+		}
+	}
+
+	void discard_after(std::uint64_t) override {}
+	void finish() override {}
+
+private:
+	Counts* counts_;
+};
+
+}}}}
@@ -0,0 +1,165 @@
+#include "sharded_sink.h"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+namespace {
+
+// First line of manifests, followed by the version. Each of the next lines is a shard: its first and last
+// transitions, then its file name up to the end of the line.
+constexpr const char* manifest_header = "rvnmemhistwriter shards";
+
+// Completed shards that can be waiting to be finished
+constexpr std::size_t finisher_queue_depth = 2;
+
+std::string base_name(const std::string& path)
+{
+	auto separator = path.find_last_of('/');
+	return separator == std::string::npos ? path : path.substr(separator + 1);
+}
+
+} // anonymous namespace
+
+ShardedSink::ShardedSink(std::string manifest_filename, ShardFactory factory, std::size_t slice_limit,
+                         std::uint64_t transition_limit)
+  : manifest_filename_(std::move(manifest_filename))
+  , factory_(std::move(factory))
+  , slice_limit_(slice_limit)
+  , transition_limit_(transition_limit)
+  , finisher_(finisher_queue_depth, [this](CompletedShard& completed) { finish_shard(completed); })
+{
+	// Readers always find a manifest, even before the first shard is complete
+	write_manifest();
+}
+
+void ShardedSink::write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal)
+{
+	start_write_slices(read_slice, write_slice, journal)->step(SliceWrite::all_rows);
+}
+
+std::unique_ptr<SliceWrite> ShardedSink::start_write_slices(Slice& read_slice, Slice& write_slice,
+                                                            AccessJournal& journal)
+{
+	auto transitions = slice_transitions(read_slice, write_slice);
+
+	if (current_ and ((slice_limit_ and current_slice_count_ >= slice_limit_) or
+	                  (transition_limit_ and transitions.first - current_shard_.transition_first >= transition_limit_))) {
+		complete_shard();
+	}
+
+	if (not current_) {
+		auto filename = manifest_filename_ + "." + std::to_string(shard_count_++);
+		current_ = factory_(filename);
+		current_shard_ = Shard{ base_name(filename), transitions.first, transitions.second };
+		current_slice_count_ = 0;
+	}
+
+	auto write = current_->start_write_slices(read_slice, write_slice, journal);
+	current_shard_.transition_last = transitions.second;
+	++current_slice_count_;
+	return write;
+}
+
+void ShardedSink::discard_after(std::uint64_t transition_count)
+{
+	if (completed_transition_last_ and transition_count <= *completed_transition_last_) {
+		throw std::invalid_argument("ShardedSink: cannot discard accesses of completed shards");
+	}
+
+	if (current_)
+		current_->discard_after(transition_count);
+}
+
+void ShardedSink::finish()
+{
+	if (current_)
+		complete_shard();
+	finisher_.stop();
+	if (auto error = finisher_.error())
+		std::rethrow_exception(error);
+}
+
+Sink::Times ShardedSink::times() const
+{
+	auto times = completed_times_;
+	if (current_)
+		times += current_->times();
+	return times;
+}
+
+void ShardedSink::complete_shard()
+{
+	completed_times_ += current_->times();
+	completed_transition_last_ = current_shard_.transition_last;
+	finisher_.submit(CompletedShard{ std::move(current_), current_shard_ });
+}
+
+void ShardedSink::finish_shard(CompletedShard& completed)
+{
+	completed.sink->finish();
+	completed.sink.reset();
+
+	manifest_.push_back(completed.shard);
+	write_manifest();
+}
+
+void ShardedSink::write_manifest()
+{
+	// Replace the manifest at once, so that readers never see a partial one
+	auto temporary_filename = manifest_filename_ + ".tmp";
+	{
+		std::ofstream manifest(temporary_filename, std::ios::trunc);
+		manifest << manifest_header << " " << shard_manifest_version << "\n";
+		for (const auto& shard : manifest_)
+			manifest << shard.transition_first << " " << shard.transition_last << " " << shard.filename << "\n";
+
+		manifest.close();
+		if (not manifest) {
+			throw std::runtime_error("Can't write shard manifest " + temporary_filename);
+		}
+	}
+
+	if (std::rename(temporary_filename.c_str(), manifest_filename_.c_str()) != 0) {
+		throw std::runtime_error("Can't write shard manifest " + manifest_filename_);
+	}
+}
+
+std::vector<Shard> read_shard_manifest(const char* manifest_filename)
+{
+	std::string filename = manifest_filename;
+	std::ifstream manifest(filename);
+	if (not manifest) {
+		throw std::runtime_error("Can't open shard manifest " + filename);
+	}
+
+	std::string line;
+	std::string header = std::string(manifest_header) + " " + shard_manifest_version;
+	if (not std::getline(manifest, line) or line != header) {
+		throw std::runtime_error("Not a shard manifest, or unsupported version: " + filename);
+	}
+
+	// Shards are next to the manifest
+	auto separator = filename.find_last_of('/');
+	auto directory = separator == std::string::npos ? std::string() : filename.substr(0, separator + 1);
+
+	std::vector<Shard> shards;
+	while (std::getline(manifest, line)) {
+		std::istringstream fields(line);
+		Shard shard;
+		if (not (fields >> shard.transition_first >> shard.transition_last) or fields.get() != ' ' or
+		    not std::getline(fields, shard.filename) or shard.filename.empty()) {
+			throw std::runtime_error("Invalid shard manifest " + filename + ": " + line);
+		}
+		shard.filename = directory + shard.filename;
+		shards.push_back(shard);
+	}
+	return shards;
+}
+
+}}}} // namespace reven::backend::memaccess::db
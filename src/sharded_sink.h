@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <experimental/optional>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "shards.h"
+#include "sink.h"
+#include "async_flusher.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * Spreads slices over several outputs, the shards, each covering a range of transitions. A new shard is started when
+ * the current one reaches a limit, and the manifest lists the completed ones (see shards.h).
+ *
+ * Completed shards are finished and released on a background thread, in parallel with the writing of the next one,
+ * and the manifest is updated once they are.
+ */
+class ShardedSink : public Sink
+{
+public:
+	// Create the sink for the shard written to `filename`
+	using ShardFactory = std::function<std::unique_ptr<Sink>(const std::string& filename)>;
+
+	/**
+	 * Shards are written next to the manifest, as `manifest_filename.0`, `manifest_filename.1`...
+	 * 0 means no limit.
+	 */
+	ShardedSink(std::string manifest_filename, ShardFactory factory, std::size_t slice_limit,
+	            std::uint64_t transition_limit);
+
+	void write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal) override;
+	/**
+	 * Steps are the ones of the current shard.
+	 */
+	std::unique_ptr<SliceWrite> start_write_slices(Slice& read_slice, Slice& write_slice,
+	                                               AccessJournal& journal) override;
+
+	/**
+	 * Only the current shard is modified: throw std::invalid_argument if a completed one has accesses to discard.
+	 */
+	void discard_after(std::uint64_t transition_count) override;
+
+	/**
+	 * Finish the current shard, wait for all of them, and write the final manifest.
+	 */
+	void finish() override;
+
+	/**
+	 * Includes the times of all shards.
+	 */
+	Times times() const override;
+
+private:
+	struct CompletedShard {
+		std::unique_ptr<Sink> sink;
+		Shard shard;
+	};
+
+	// Hand the current shard to the background thread.
+	void complete_shard();
+
+	// Runs on the background thread.
+	void finish_shard(CompletedShard& completed);
+	void write_manifest();
+
+	std::string manifest_filename_;
+	ShardFactory factory_;
+	std::size_t slice_limit_;
+	std::uint64_t transition_limit_;
+
+	std::unique_ptr<Sink> current_;
+	Shard current_shard_;
+	std::size_t current_slice_count_ = 0;
+	std::size_t shard_count_ = 0;
+	// Times of the completed shards
+	Times completed_times_;
+	// Last transition of the completed shards, if any.
+	std::experimental::optional<std::uint64_t> completed_transition_last_;
+
+	// Only used by the background thread, or once it is stopped.
+	std::vector<Shard> manifest_;
+
+	// Last, so that it is stopped before the members it uses are destroyed.
+	AsyncFlusher<CompletedShard> finisher_;
+};
+
+}}}}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+namespace simd {
+
+/**
+ * Searches over sorted, contiguous arrays of addresses, such as the last addresses of the blocks of FlatChunkStorage.
+ *
+ * Arrays are first narrowed down by a branchless binary search, then the remaining window is compared all at once with
+ * AVX2 or SSE4.2 when the build targets them (for instance with the ENABLE_AVX2 CMake option), which avoids the
+ * unpredictable branches of the last steps. Scalar builds only do the binary search. All variants return the same
+ * results.
+ */
+
+// Size of the window compared at once by the searches
+#if defined(__AVX2__)
+constexpr std::size_t scan_window = 16;
+#elif defined(__SSE4_2__)
+constexpr std::size_t scan_window = 8;
+#else
+constexpr std::size_t scan_window = 1;
+#endif
+
+namespace detail {
+
+#if defined(__AVX2__)
+// Unsigned 64 bits comparisons, with the signed instructions: flip the sign bit of both operands
+inline __m256i flip_sign(__m256i values)
+{
+	return _mm256_xor_si256(values, _mm256_set1_epi64x(static_cast<long long>(std::uint64_t(1) << 63)));
+}
+#elif defined(__SSE4_2__)
+inline __m128i flip_sign(__m128i values)
+{
+	return _mm_xor_si128(values, _mm_set1_epi64x(static_cast<long long>(std::uint64_t(1) << 63)));
+}
+#endif
+
+// Count the values of `[values, values + count)` that are < key, or <= key when `or_equal`.
+template <bool or_equal>
+inline std::size_t count_below(const std::uint64_t* values, std::size_t count, std::uint64_t key)
+{
+	std::size_t result = 0;
+	std::size_t i = 0;
+#if defined(__AVX2__)
+	// `values < key` is `key > values`, and `values <= key` is `key + 1 > values`, unless key is the maximum
+	if (not or_equal or key != ~std::uint64_t(0)) {
+		auto bound = flip_sign(_mm256_set1_epi64x(static_cast<long long>(or_equal ? key + 1 : key)));
+		for (; i + 4 <= count; i += 4) {
+			auto v = flip_sign(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i)));
+			auto mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(bound, v)));
+			result += static_cast<std::size_t>(__builtin_popcount(static_cast<unsigned>(mask)));
+		}
+	}
+#elif defined(__SSE4_2__)
+	if (not or_equal or key != ~std::uint64_t(0)) {
+		auto bound = flip_sign(_mm_set1_epi64x(static_cast<long long>(or_equal ? key + 1 : key)));
+		for (; i + 2 <= count; i += 2) {
+			auto v = flip_sign(_mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i)));
+			auto mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(bound, v)));
+			result += static_cast<std::size_t>(__builtin_popcount(static_cast<unsigned>(mask)));
+		}
+	}
+#endif
+	for (; i < count; ++i)
+		result += or_equal ? values[i] <= key : values[i] < key;
+	return result;
+}
+
+template <bool or_equal>
+inline std::size_t sorted_count_below(const std::uint64_t* values, std::size_t count, std::uint64_t key)
+{
+	const auto* first = values;
+	while (count > scan_window) {
+		auto half = count / 2;
+		first = (or_equal ? first[half - 1] <= key : first[half - 1] < key) ? first + half : first;
+		count -= half;
+	}
+	return static_cast<std::size_t>(first - values) + count_below<or_equal>(first, count, key);
+}
+
+} // namespace detail
+
+/**
+ * Index of the first value >= key in the sorted `[values, values + count)`, as `std::lower_bound`.
+ */
+inline std::size_t lower_bound(const std::uint64_t* values, std::size_t count, std::uint64_t key)
+{
+	return detail::sorted_count_below<false>(values, count, key);
+}
+
+/**
+ * Index of the first value > key in the sorted `[values, values + count)`, as `std::upper_bound`.
+ */
+inline std::size_t upper_bound(const std::uint64_t* values, std::size_t count, std::uint64_t key)
+{
+	return detail::sorted_count_below<true>(values, count, key);
+}
+
+}}}}}
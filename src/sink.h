@@ -0,0 +1,218 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+
+#include "db_writer.h"
+#include "slice.h"
+#include "access_journal.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * Storing of a read and a write slice started by `Sink::start_write_slices`, done a few rows at a time.
+ */
+class SliceWrite
+{
+public:
+	// Rows for `step` to store everything that is left at once
+	static constexpr std::size_t all_rows = std::numeric_limits<std::size_t>::max();
+
+	virtual ~SliceWrite() = default;
+
+	/**
+	 * Store up to about `rows` more rows, at least one, and return whether the slices are now completely stored.
+	 */
+	virtual bool step(std::size_t rows) = 0;
+};
+
+/**
+ * Where a DbWriter stores the slices it built. SqliteSink writes the usual database, but any implementation can be
+ * given to the DbWriter constructor.
+ *
+ * Slices are handed over in order of transition. Calls may come from a thread other than the one that created the
+ * sink, such as the background writer in async mode, but never from two threads at once.
+ */
+class Sink
+{
+public:
+	/**
+	 * Time spent by `write_slices` in each of its steps. Sinks fill the ones that apply to them.
+	 */
+	struct Times {
+		// Storing chunks, then accesses
+		std::chrono::nanoseconds chunks{ 0 };
+		std::chrono::nanoseconds accesses{ 0 };
+		// Making them durable or visible, once stored
+		std::chrono::nanoseconds commit{ 0 };
+
+		Times& operator+=(const Times& other)
+		{
+			chunks += other.chunks;
+			accesses += other.accesses;
+			commit += other.commit;
+			return *this;
+		}
+	};
+
+	virtual ~Sink() = default;
+
+	/**
+	 * Store a read and a write slice that cover the same transitions, along with the journal of their accesses. At
+	 * least one of the slices is not empty.
+	 * The chunk ids of `journal` are free for the sink to use.
+	 */
+	virtual void write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal) = 0;
+
+	/**
+	 * Same as `write_slices`, but done in steps by the returned object, so that the caller can spread the work. The
+	 * slices and the journal must outlive it, and no other method of the sink may be called until it is done.
+	 * By default, everything is written by the first step.
+	 */
+	virtual std::unique_ptr<SliceWrite> start_write_slices(Slice& read_slice, Slice& write_slice,
+	                                                       AccessJournal& journal);
+
+	/**
+	 * Remove all accesses written so far with a transition >= transition_count. See `DbWriter::discard_after`.
+	 */
+	virtual void discard_after(std::uint64_t transition_count) = 0;
+
+	/**
+	 * Complete the output once all slices are written. Nothing is written afterwards.
+	 */
+	virtual void finish() = 0;
+
+	/**
+	 * Return the time spent so far in `write_slices`. Same threading requirements as the methods above.
+	 */
+	virtual Times times() const { return times_; }
+
+protected:
+	Times times_;
+};
+
+/**
+ * Add the time spent in its scope to a total.
+ */
+class StepTimer
+{
+public:
+	explicit StepTimer(std::chrono::nanoseconds& total)
+	  : total_(total)
+	  , start_(std::chrono::steady_clock::now())
+	{
+	}
+
+	~StepTimer() { total_ += std::chrono::steady_clock::now() - start_; }
+
+	StepTimer(const StepTimer&) = delete;
+	StepTimer& operator=(const StepTimer&) = delete;
+
+private:
+	std::chrono::nanoseconds& total_;
+	std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ * SliceWrite of sinks that write slices at once.
+ */
+class WholeSliceWrite : public SliceWrite
+{
+public:
+	WholeSliceWrite(Sink& sink, Slice& read_slice, Slice& write_slice, AccessJournal& journal)
+	  : sink_(sink)
+	  , read_slice_(read_slice)
+	  , write_slice_(write_slice)
+	  , journal_(journal)
+	{
+	}
+
+	bool step(std::size_t) override
+	{
+		sink_.write_slices(read_slice_, write_slice_, journal_);
+		return true;
+	}
+
+private:
+	Sink& sink_;
+	Slice& read_slice_;
+	Slice& write_slice_;
+	AccessJournal& journal_;
+};
+
+inline std::unique_ptr<SliceWrite> Sink::start_write_slices(Slice& read_slice, Slice& write_slice,
+                                                            AccessJournal& journal)
+{
+	return std::make_unique<WholeSliceWrite>(*this, read_slice, write_slice, journal);
+}
+
+struct ChunkWithDescription {
+	std::uint8_t operation;
+	Chunk* chunk;
+};
+
+/**
+ * Return the transitions covered by a read and a write slice stored together.
+ */
+inline std::pair<std::uint64_t, std::uint64_t> slice_transitions(const Slice& read_slice, const Slice& write_slice)
+{
+	if (read_slice.empty() and write_slice.empty()) {
+		throw std::logic_error("You should not be writing empty slices into database");
+	}
+
+	if (read_slice.empty())
+		return { write_slice.transition_first(), write_slice.transition_last() };
+	if (write_slice.empty())
+		return { read_slice.transition_first(), read_slice.transition_last() };
+
+	return { std::min(read_slice.transition_first(), write_slice.transition_first()),
+	         std::max(read_slice.transition_last(), write_slice.transition_last()) };
+}
+
+/**
+ * Walks the chunks of a read and a write slice stored together, in ascending order of first address, read chunks first
+ * on ties. Each slice is already sorted, so they are merged along the way, without listing or sorting their chunks.
+ */
+class SliceChunkMerge
+{
+public:
+	SliceChunkMerge(Slice& read_slice, Slice& write_slice)
+	  : read_(read_slice.begin())
+	  , read_end_(read_slice.end())
+	  , write_(write_slice.begin())
+	  , write_end_(write_slice.end())
+	  , size_(read_slice.chunk_count() + write_slice.chunk_count())
+	{
+	}
+
+	// Amount of chunks in both slices
+	std::size_t size() const { return size_; }
+
+	// Whether `next` has chunks left to return
+	bool done() const { return read_ == read_end_ and write_ == write_end_; }
+
+	// Return the next chunk. Must not be called once done.
+	ChunkWithDescription next()
+	{
+		if (write_ == write_end_ or (read_ != read_end_ and read_->address_first() <= write_->address_first()))
+			return { static_cast<std::uint8_t>(Operation::Read), &*read_++ };
+		return { static_cast<std::uint8_t>(Operation::Write), &*write_++ };
+	}
+
+private:
+	Slice::Iterator read_;
+	Slice::Iterator read_end_;
+	Slice::Iterator write_;
+	Slice::Iterator write_end_;
+	std::size_t size_;
+};
+
+}}}}
@@ -1,30 +1,61 @@
 #pragma once
 
-#include <map>
+#include <chrono>
+#include <memory>
 #include <cstdint>
 #include <experimental/optional>
+#include <type_traits>
 
 #include "chunk.h"
+#include "chunk_storage.h"
 
 namespace reven {
 namespace backend {
 namespace memaccess {
 namespace db {
 
-class SliceBuilder;
+template <typename Storage> class BasicSliceBuilder;
 
 /**
- * This is the representation of a slice. Chunks are accessible through begin() and end(), which are map's iterator and
- * so chunks are stored sorted by addresses.
+ * Limit of a SliceBuilder that refused accesses, or made it stop at the next transition.
+ */
+enum class SliceLimit : std::uint8_t {
+	None,
+	AccessCount,
+	Memory,
+	ChunkSizeOverlap,
+	Transition,
+};
+
+/**
+ * What building a slice took.
+ */
+struct SliceBuildStats {
+	// Chunks merged in by accesses that overlapped them
+	std::uint64_t overlap_merges = 0;
+	// Touching chunks merged when building the slice
+	std::uint64_t touch_merges = 0;
+	// The first limit that was hit
+	SliceLimit limit = SliceLimit::None;
+	// Time spent in `build`
+	std::chrono::nanoseconds build_time{ 0 };
+};
+
+/**
+ * This is the representation of a slice. Chunks are accessible through begin() and end(), which are iterators of the
+ * underlying `Storage` (see chunk_storage.h), so chunks are stored sorted by addresses.
  *
  * There cannot be two overlapping chunks in a slice, though some might be side by side.
+ *
+ * The slice owns the pool its accesses are allocated from, so they are all released at once when it is destroyed.
  */
-class Slice
+template <typename Storage>
+class BasicSlice
 {
 public:
-	using StorageType = std::map<std::uint64_t, Chunk>;
-	using Iterator = StorageType::iterator;
-	using ConstIterator = StorageType::const_iterator;
+	using StorageType = Storage;
+	using Iterator = typename StorageType::iterator;
+	using ConstIterator = typename StorageType::const_iterator;
 
 	std::uint64_t transition_first() const { return transition_first_; }
 	std::uint64_t transition_last() const { return transition_last_; }
@@ -33,8 +64,8 @@ public:
 	Iterator begin() { return access_chunks_.begin(); }
 	Iterator end() { return access_chunks_.end(); }
 
-	ConstIterator begin() const { return access_chunks_.cbegin(); }
-	ConstIterator end() const { return access_chunks_.cend(); }
+	ConstIterator begin() const { return access_chunks_.begin(); }
+	ConstIterator end() const { return access_chunks_.end(); }
 
 	bool empty() const { return begin() == end(); }
 
@@ -42,36 +73,73 @@ public:
 		return access_chunks_.size();
 	}
 
+	/**
+	 * Return an estimate of the bytes used by the chunks and accesses of the slice. This is cheap to call.
+	 */
+	std::size_t memory_usage() const {
+		return access_pool_->memory_usage() + access_chunks_.memory_usage();
+	}
+
+	const SliceBuildStats& build_stats() const { return build_stats_; }
+
 	/**
 	 * Warning: will actually count accesses, so it is fairly slow.
 	 */
 	std::size_t access_count() const {
 		std::size_t count = 0;
 		for(const auto& c: access_chunks_) {
-			count += c.second.size();
+			count += c.size();
 		}
 		return count;
 	}
 
 private:
-	friend SliceBuilder;
+	friend BasicSliceBuilder<Storage>;
+	// Heap-allocated so that moving the slice does not invalidate the pool pointer held by its chunks.
+	std::unique_ptr<ChunkAccessPool> access_pool_ = std::make_unique<ChunkAccessPool>();
 	StorageType access_chunks_;
 	std::uint64_t transition_first_ = 0;
 	std::uint64_t transition_last_ = 0;
+	SliceBuildStats build_stats_;
 };
 
+/**
+ * Checks done by `BasicSliceBuilder::insert`, chosen at compile time so that callers that do not need some of them get
+ * an insertion without their branches:
+ * - `limits`: enforce the limits of the builder, except `chunk_size_touch_limit` which only applies to `build`. Without
+ *   it, no access is refused, as after `ignore_limits`, and the limits that were set are not enforced.
+ * - `validation`: throw std::invalid_argument on accesses of size 0, that wrap around the address space, or whose
+ *   icount goes backward. Without it, inserting such an access is undefined behaviour.
+ */
+template <bool Limits, bool Validation>
+struct InsertPolicy {
+	static constexpr bool limits = Limits;
+	static constexpr bool validation = Validation;
+};
+
+using CheckedInsertion = InsertPolicy<true, true>;
+
+/**
+ * Size of an access known at compile time, to insert it with `BasicSliceBuilder::insert` in place of a runtime size.
+ */
+template <std::uint32_t Size>
+using FixedSize = std::integral_constant<std::uint32_t, Size>;
+
 /**
  * This object's role is to help create a slice from separate accesses, creating and merging chunks as necessary.
  */
-class SliceBuilder
+template <typename Storage>
+class BasicSliceBuilder
 {
 public:
+	using Slice = BasicSlice<Storage>;
+
 	/**
 	 * Will impose a soft limit on the amount of accesses in a chunk. Note this limit will temporarily be ignored if the
 	 * access being added is on a transition that is already part of the slice, to enforce the non-overlapping property
 	 * of slices.
 	 */
-	SliceBuilder& chunk_size_overlap_limit(std::uint64_t chunk_size_overlap_limit) {
+	BasicSliceBuilder& chunk_size_overlap_limit(std::uint64_t chunk_size_overlap_limit) {
 		chunk_size_overlap_limit_ = chunk_size_overlap_limit;
 		return *this;
 	}
@@ -81,7 +149,7 @@ public:
 	 * chunks.
 	 * Note this will not impact `insert`, only the post-processing merge phase.
 	 */
-	SliceBuilder& chunk_size_touch_limit(std::uint64_t chunk_size_touch_limit) {
+	BasicSliceBuilder& chunk_size_touch_limit(std::uint64_t chunk_size_touch_limit) {
 		chunk_size_touch_limit_ = chunk_size_touch_limit;
 		return *this;
 	}
@@ -89,7 +157,7 @@ public:
 	/**
 	 * Will impose a hard limit on the transitions a slice can represent.
 	 */
-	SliceBuilder& transition_limit(std::uint64_t transition_limit) {
+	BasicSliceBuilder& transition_limit(std::uint64_t transition_limit) {
 		transition_limit_ = transition_limit;
 		return *this;
 	}
@@ -97,11 +165,42 @@ public:
 	/**
 	 * Will impose a soft limit on the amount of accesses a slice can contain.
 	 */
-	SliceBuilder& access_count_limit(std::uint64_t access_count) {
+	BasicSliceBuilder& access_count_limit(std::uint64_t access_count) {
 		access_count_limit_ = access_count;
 		return *this;
 	}
 
+	/**
+	 * Will impose a soft limit on the bytes used by the slice, as returned by `memory_usage`. Like
+	 * `access_count_limit`, accesses on a transition that is already part of the slice are still inserted.
+	 */
+	BasicSliceBuilder& memory_limit(std::size_t bytes) {
+		memory_limit_ = bytes;
+		return *this;
+	}
+
+	/**
+	 * Stop enforcing the limits above, except `chunk_size_touch_limit`: every valid access will then be inserted.
+	 * Meant for callers that cannot cut the slice right when a limit is hit.
+	 */
+	BasicSliceBuilder& ignore_limits() {
+		chunk_size_overlap_limit_ = std::experimental::nullopt;
+		transition_limit_ = std::experimental::nullopt;
+		access_count_limit_ = std::experimental::nullopt;
+		memory_limit_ = std::experimental::nullopt;
+		stop_at_next_transition_ = false;
+		return *this;
+	}
+
+	/**
+	 * Record that `limit` was hit, when the caller checked it instead of `insert`. Only the first limit is kept.
+	 */
+	void limit_hit(SliceLimit limit)
+	{
+		if (limit != SliceLimit::None)
+			hit(limit);
+	}
+
 	/**
 	 * Insert an access in the slice being built.
 	 *
@@ -111,17 +210,31 @@ public:
 	 *
 	 * Otherwise, it will return a pointer to the inserted access. This pointer is valid until after the slice being
 	 * returned by `build` is destroyed, or until this object is destroyed if `build` is never called.
+	 *
+	 * `journal_index` is the index of the access in the journal the caller keeps alongside the slice (see
+	 * access_journal.h). The overload without it numbers accesses in their order of insertion.
+	 *
+	 * `Policy` is an InsertPolicy telling which checks are done, and `size` may be a FixedSize.
 	 */
 	const ChunkAccess* insert(std::uint64_t icount, std::uint64_t address, std::uint64_t size)
 	{
-		if (size == 0) {
+		return insert(icount, address, size, static_cast<JournalIndex>(access_count_));
+	}
+
+	template <typename Policy = CheckedInsertion, typename Size = std::uint64_t>
+	const ChunkAccess* insert(std::uint64_t icount, std::uint64_t address, Size size, JournalIndex journal_index)
+	{
+		if (Policy::validation and size == 0) {
 			throw std::invalid_argument("SliceBuilder insertion: attempted to insert access with size 0");
 		}
 
-		if (icount > slice_.transition_last_ and stop_at_next_transition_)
+		if (Policy::limits and icount > slice_.transition_last_ and stop_at_next_transition_)
 			return nullptr;
 
-		if (access_count_limit_ and access_count_ >= access_count_limit_) {
+		if (Policy::limits and ((access_count_limit_ and access_count_ >= access_count_limit_) or
+		                        (memory_limit_ and slice_.memory_usage() >= *memory_limit_))) {
+			hit(access_count_limit_ and access_count_ >= access_count_limit_ ? SliceLimit::AccessCount
+			                                                                  : SliceLimit::Memory);
 			if (icount > slice_.transition_last_) {
 				return nullptr;
 			} else {
@@ -130,48 +243,64 @@ public:
 			}
 		}
 
-		if (static_cast<std::uint64_t>(address - 1 + size) < address) {
+		if (Policy::validation and static_cast<std::uint64_t>(address - 1 + size) < address) {
 			// Wrap around
 			throw std::invalid_argument("SliceBuilder insertion: address + size wraps around std::uint64_t");
 		}
 
-		if (slice_.access_chunks_.size() and icount < slice_.transition_last_) {
+		if (Policy::validation and slice_.access_chunks_.size() and icount < slice_.transition_last_) {
 			throw std::invalid_argument("SliceBuilder insertion: icount going backward");
 		}
 
-		if (transition_limit_ and not slice_.access_chunks_.empty() and
-		    (icount - slice_.transition_first_ + 1) > *transition_limit_)
+		if (Policy::limits and transition_limit_ and not slice_.access_chunks_.empty() and
+		    (icount - slice_.transition_first_ + 1) > *transition_limit_) {
+			hit(SliceLimit::Transition);
 			return nullptr;
+		}
 
-		Chunk access_chunk(icount, address, size);
-		const auto* access = access_chunk.accesses();
-		std::vector<Slice::Iterator> overlaps;
-		auto total_count = access_chunk.size();
+		auto& chunks = slice_.access_chunks_;
 
-		// Look for existing chunks that we might have to merge in.
-		if (slice_.access_chunks_.empty()) {
-			slice_.transition_first_ = icount;
-		} else {
-			auto next = slice_.access_chunks_.upper_bound(address);
-			if (next != slice_.access_chunks_.begin()) {
-				auto previous = std::prev(next);
-				if (previous->second.overlaps(access_chunk)) {
-					overlaps.push_back(previous);
-					total_count += previous->second.size();
-				}
-			}
-			while (next != slice_.access_chunks_.end()) {
-				if (next->second.overlaps(access_chunk)) {
-					overlaps.push_back(next);
-					total_count += next->second.size();
-					next++;
+		// Look for existing chunks that we might have to merge in. Since chunks do not overlap, they are all part of a
+		// contiguous range starting at the first chunk that ends after the access' first address: `[position,
+		// overlaps_end)`.
+		auto position = chunks.empty() ? chunks.end() : lower_bound_by_last(address);
+
+		// Fast path: the access lies within an existing chunk, which is then the only one it overlaps.
+		if (position != chunks.end() and position->address_first() <= address and
+		    address - 1 + size <= position->address_last()) {
+			if (Policy::limits and chunk_size_overlap_limit_ and position->size() + 1 > *chunk_size_overlap_limit_) {
+				hit(SliceLimit::ChunkSizeOverlap);
+				if (icount > slice_.transition_last_) {
+					return nullptr;
 				} else {
-					break;
+					// Do not refuse accesses if this transition is already part of the slice.
+					stop_at_next_transition_ = true;
 				}
 			}
+
+			slice_.transition_last_ = icount;
+			last_touched_ = position;
+			access_count_ += 1;
+			return chunks.add_access(position, journal_index);
+		}
+
+		Chunk access_chunk(*slice_.access_pool_, journal_index, address, static_cast<std::uint32_t>(size));
+		const auto* access = access_chunk.accesses();
+		auto total_count = access_chunk.size();
+
+		auto overlaps_end = position;
+		std::uint64_t overlap_count = 0;
+		if (not chunks.empty()) {
+			// Chunks from `position` end after the access starts, so they overlap it until one starts after its end
+			overlaps_end = chunks.upper_bound_by_first(position, access_chunk.address_last());
+			for (auto it = position; it != overlaps_end; ++it) {
+				total_count += it->size();
+				++overlap_count;
+			}
 		}
 
-		if (chunk_size_overlap_limit_ and total_count > *chunk_size_overlap_limit_) {
+		if (Policy::limits and chunk_size_overlap_limit_ and total_count > *chunk_size_overlap_limit_) {
+			hit(SliceLimit::ChunkSizeOverlap);
 			if (icount > slice_.transition_last_) {
 				return nullptr;
 			} else {
@@ -180,16 +309,16 @@ public:
 			}
 		}
 
-		if (slice_.access_chunks_.empty())
+		if (chunks.empty())
 			slice_.transition_first_ = icount;
 
-		for (auto& it : overlaps) {
-			access_chunk.merge_in(std::move(it->second));
-			slice_.access_chunks_.erase(it);
+		for (auto it = position; it != overlaps_end; ++it) {
+			access_chunk.merge_in(std::move(*it));
 		}
 
 		slice_.transition_last_ = icount;
-		slice_.access_chunks_.insert(std::pair<std::uint64_t, Chunk>(access_chunk.address_first(), std::move(access_chunk)));
+		last_touched_ = chunks.replace(position, overlaps_end, std::move(access_chunk));
+		stats_.overlap_merges += overlap_count;
 
 		access_count_ += 1;
 		return access;
@@ -200,8 +329,12 @@ public:
 	 */
 	Slice build() &&
 	{
+		auto start = std::chrono::steady_clock::now();
+		last_touched_ = std::experimental::nullopt;
 		merge();
 		access_count_ = 0;
+		stats_.build_time += std::chrono::steady_clock::now() - start;
+		slice_.build_stats_ = stats_;
 		return std::move(slice_);
 	}
 
@@ -215,7 +348,38 @@ public:
 	 */
 	std::size_t chunk_count() const { return slice_.chunk_count(); }
 
+	/**
+	 * Return an estimate of the bytes used by the slice being built. This is cheap to call.
+	 */
+	std::size_t memory_usage() const { return slice_.memory_usage(); }
+
 private:
+	/**
+	 * Same as the storage's `lower_bound_by_last`, but first looks around the last touched chunk: accesses are very
+	 * local, so they usually land in or next to it, or next to one of its neighbours.
+	 */
+	typename Slice::Iterator lower_bound_by_last(std::uint64_t address)
+	{
+		auto& chunks = slice_.access_chunks_;
+		if (last_touched_) {
+			auto hint = *last_touched_;
+			if (hint->address_last() < address) {
+				auto next = std::next(hint);
+				if (next == chunks.end() or next->address_last() >= address)
+					return next;
+			} else if (hint->address_first() <= address or hint == chunks.begin()) {
+				return hint;
+			} else {
+				auto previous = std::prev(hint);
+				if (previous->address_last() < address)
+					return hint;
+				if (previous->address_first() <= address)
+					return previous;
+			}
+		}
+		return chunks.lower_bound_by_last(address);
+	}
+
 	/**
 	 * During normal insertion, chunks are merged only if absolutely necessary, ie when an access overlaps an existing
 	 * chunk. This method will then try to merge chunks that are next to each other: this step drastically reduces the
@@ -223,21 +387,22 @@ private:
 	 */
 	void merge()
 	{
-		if (slice_.access_chunks_.empty())
-			return;
-
-		auto current = slice_.access_chunks_.begin();
-		for (auto next = std::next(current); next != slice_.access_chunks_.end();) {
-			if (current->second.is_contiguous(next->second) and
-			    (not chunk_size_touch_limit_ or
-			     current->second.size() + next->second.size() <= *chunk_size_touch_limit_)) {
-				current->second.merge_in(std::move(next->second));
-				slice_.access_chunks_.erase(next++);
-			} else {
-				current = next;
-				next++;
-			}
-		}
+		auto touch_limit = chunk_size_touch_limit_;
+		auto& touch_merges = stats_.touch_merges;
+		slice_.access_chunks_.compact([touch_limit, &touch_merges](const Chunk& current, const Chunk& next) {
+			// Chunks are sorted and do not overlap, so they can only touch that way
+			bool should_merge = current.address_last() + 1 == next.address_first() and
+			                    (not touch_limit or current.size() + next.size() <= *touch_limit);
+			touch_merges += should_merge;
+			return should_merge;
+		});
+	}
+
+	// Remember the first limit that was hit
+	void hit(SliceLimit limit)
+	{
+		if (stats_.limit == SliceLimit::None)
+			stats_.limit = limit;
 	}
 
 	Slice slice_;
@@ -245,8 +410,17 @@ private:
 	std::experimental::optional<std::size_t> chunk_size_overlap_limit_;
 	std::experimental::optional<std::size_t> transition_limit_;
 	std::experimental::optional<std::size_t> access_count_limit_;
+	std::experimental::optional<std::size_t> memory_limit_;
 	bool stop_at_next_transition_ = false;
 	std::size_t access_count_ = 0;
+	SliceBuildStats stats_;
+
+	// Chunk the last access was inserted in. It is always valid, since the storage is only modified by insertions,
+	// which update it.
+	std::experimental::optional<typename Slice::Iterator> last_touched_;
 };
 
+using Slice = BasicSlice<FlatChunkStorage>;
+using SliceBuilder = BasicSliceBuilder<FlatChunkStorage>;
+
 }}}}
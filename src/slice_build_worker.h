@@ -0,0 +1,231 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "slice.h"
+#include "spsc_queue.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * Feeds a SliceBuilder on a dedicated thread, so that several builders can run in parallel.
+ *
+ * Accesses are handed over through a SpscQueue: `insert`, `request_cut` and `take_slice` must all be called from the
+ * same producer thread.
+ *
+ * Since the producer does not wait for insertions, the builder cannot refuse an access the way `SliceBuilder::insert`
+ * does. The access count and transition limits only depend on the accesses queued, so the producer checks them with
+ * `refusal` before queuing, and cuts where the builder would have. Other limits depend on the chunks built so far:
+ * when the builder hits one, the worker stops enforcing limits, inserts the access anyway and raises `cut_requested`,
+ * and the producer is expected to cut the slice soon after, at a point of its choosing. That is at most a queue worth
+ * of accesses later.
+ *
+ * Errors from the builder are kept and rethrown by `take_slice`. Once one happened, accesses are dropped until then,
+ * and `cut_requested` is raised so that the producer gets to know it early.
+ */
+class SliceBuildWorker
+{
+public:
+	using BuilderFactory = std::function<std::unique_ptr<SliceBuilder>()>;
+
+	/**
+	 * `access_count_limit` and `transition_limit` are those of the builders made by `factory`, 0 meaning none.
+	 */
+	SliceBuildWorker(std::size_t queue_capacity, BuilderFactory factory, std::size_t access_count_limit = 0,
+	                 std::uint64_t transition_limit = 0)
+	  : access_count_limit_(access_count_limit)
+	  , transition_limit_(transition_limit)
+	  , factory_(std::move(factory))
+	  , builder_(factory_())
+	  , queue_(queue_capacity)
+	  , thread_([this]() { run(); })
+	{
+	}
+
+	SliceBuildWorker(const SliceBuildWorker&) = delete;
+	SliceBuildWorker& operator=(const SliceBuildWorker&) = delete;
+
+	/**
+	 * Stop the thread. The slice being built is dropped.
+	 */
+	~SliceBuildWorker()
+	{
+		queue_.push(Item::stop());
+		thread_.join();
+	}
+
+	/**
+	 * Queue an access for insertion. Waits if the queue is full. `size` must not be 0.
+	 */
+	void insert(std::uint64_t icount, std::uint64_t address, std::uint32_t size, JournalIndex journal_index)
+	{
+		if (queued_ == 0)
+			transition_first_ = icount;
+		transition_last_ = icount;
+		++queued_;
+		queue_.push(Item{ icount, address, size, journal_index });
+	}
+
+	/**
+	 * Whether the builder would refuse an access on `icount` if it was inserted now. Only the access count and
+	 * transition limits are checked, the same way as `SliceBuilder::insert` does. The limit is then recorded in the
+	 * build stats of the slice at the next cut.
+	 */
+	bool refuses(std::uint64_t icount)
+	{
+		if (access_count_limit_ and queued_ >= access_count_limit_ and icount > transition_last_)
+			refused_ = SliceLimit::AccessCount;
+		else if (transition_limit_ and queued_ and icount - transition_first_ + 1 > transition_limit_)
+			refused_ = SliceLimit::Transition;
+		return refused_ != SliceLimit::None;
+	}
+
+	/**
+	 * Return an estimate of the bytes used by the slice being built. It is updated regularly by the worker, rather than
+	 * on each insertion.
+	 */
+	std::size_t memory_usage() const { return memory_usage_.load(std::memory_order_relaxed); }
+
+	/**
+	 * Whether the builder hit one of its limits, or failed, since the last cut.
+	 */
+	bool cut_requested() const { return cut_requested_.load(std::memory_order_relaxed); }
+
+	/**
+	 * Ask the worker to build the slice holding the accesses queued so far, and to start a new one for the following
+	 * accesses. The built slice is retrieved with `take_slice`.
+	 */
+	void request_cut()
+	{
+		queue_.push(Item::cut(refused_));
+		queued_ = 0;
+		refused_ = SliceLimit::None;
+	}
+
+	/**
+	 * Wait for the slice requested by `request_cut`, and return it. Rethrow any error from the builder.
+	 */
+	Slice take_slice()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		built_.wait(lock, [this]() { return slice_ready_; });
+		slice_ready_ = false;
+		if (error_) {
+			auto error = error_;
+			error_ = nullptr;
+			std::rethrow_exception(error);
+		}
+		return std::move(slice_);
+	}
+
+private:
+	struct Item {
+		std::uint64_t icount;
+		std::uint64_t address;
+		// Accesses are never empty, so markers use a size of 0.
+		std::uint32_t size;
+		JournalIndex journal_index;
+
+		// Cuts carry the limit refused by the producer, if any, as their address.
+		static Item cut(SliceLimit limit) { return { 0, static_cast<std::uint64_t>(limit), 0, 0 }; }
+		static Item stop() { return { 1, 0, 0, 0 }; }
+		bool is_cut() const { return size == 0 and icount == 0; }
+		bool is_stop() const { return size == 0 and icount == 1; }
+	};
+
+	// Amount of insertions between two updates of `memory_usage_`
+	static constexpr std::size_t memory_usage_period = 256;
+
+	void run()
+	{
+		std::exception_ptr error;
+		std::size_t inserted = 0;
+		for (;;) {
+			Item item;
+			queue_.pop(item);
+
+			if (item.is_stop())
+				return;
+
+			if (item.is_cut()) {
+				Slice slice;
+				if (not error) {
+					try {
+						builder_->limit_hit(static_cast<SliceLimit>(item.address));
+						slice = std::move(*builder_).build();
+					} catch (...) {
+						error = std::current_exception();
+					}
+				}
+				builder_ = factory_();
+				memory_usage_.store(builder_->memory_usage(), std::memory_order_relaxed);
+
+				cut_requested_.store(false, std::memory_order_relaxed);
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					slice_ = std::move(slice);
+					error_ = error;
+					slice_ready_ = true;
+				}
+				built_.notify_one();
+				error = nullptr;
+				continue;
+			}
+
+			if (error)
+				continue;
+
+			try {
+				if (not builder_->insert(item.icount, item.address, item.size, item.journal_index)) {
+					builder_->ignore_limits();
+					cut_requested_.store(true, std::memory_order_relaxed);
+					if (not builder_->insert(item.icount, item.address, item.size, item.journal_index)) {
+						throw std::logic_error("Insertion must be possible without limits");
+					}
+				}
+			} catch (...) {
+				error = std::current_exception();
+				cut_requested_.store(true, std::memory_order_relaxed);
+			}
+
+			if (++inserted % memory_usage_period == 0)
+				memory_usage_.store(builder_->memory_usage(), std::memory_order_relaxed);
+		}
+	}
+
+	const std::size_t access_count_limit_;
+	const std::uint64_t transition_limit_;
+	// Accesses queued since the last cut, only used by the producer thread
+	std::size_t queued_ = 0;
+	std::uint64_t transition_first_ = 0;
+	std::uint64_t transition_last_ = 0;
+	SliceLimit refused_ = SliceLimit::None;
+
+	BuilderFactory factory_;
+	// Only used by the worker thread
+	std::unique_ptr<SliceBuilder> builder_;
+
+	SpscQueue<Item> queue_;
+	std::atomic<bool> cut_requested_{false};
+	std::atomic<std::size_t> memory_usage_{0};
+
+	std::mutex mutex_;
+	std::condition_variable built_;
+	Slice slice_;
+	bool slice_ready_ = false;
+	std::exception_ptr error_;
+
+	// Last, so that it starts once everything else is initialized.
+	std::thread thread_;
+};
+
+}}}}
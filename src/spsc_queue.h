@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * Bounded lock-free queue between exactly one producer thread and one consumer thread.
+ *
+ * `T` must be default constructible and copy assignable: the ring is allocated up front, and slots are overwritten.
+ */
+template <typename T>
+class SpscQueue
+{
+public:
+	/**
+	 * `capacity` must be a power of two.
+	 */
+	explicit SpscQueue(std::size_t capacity)
+	  : mask_(capacity - 1)
+	  , ring_(new T[capacity])
+	{
+		if (capacity == 0 or (capacity & mask_) != 0) {
+			throw std::invalid_argument("SpscQueue: capacity must be a power of two");
+		}
+	}
+
+	SpscQueue(const SpscQueue&) = delete;
+	SpscQueue& operator=(const SpscQueue&) = delete;
+
+	/**
+	 * Producer side. Return false if the queue is full.
+	 */
+	bool try_push(const T& value)
+	{
+		auto tail = tail_.load(std::memory_order_relaxed);
+		if (tail - cached_head_ > mask_) {
+			cached_head_ = head_.load(std::memory_order_acquire);
+			if (tail - cached_head_ > mask_)
+				return false;
+		}
+
+		ring_[tail & mask_] = value;
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Producer side. Wait until there is room for `value`.
+	 */
+	void push(const T& value)
+	{
+		for (Backoff backoff; not try_push(value); backoff.wait()) {}
+	}
+
+	/**
+	 * Consumer side. Return false if the queue is empty.
+	 */
+	bool try_pop(T& value)
+	{
+		auto head = head_.load(std::memory_order_relaxed);
+		if (head == cached_tail_) {
+			cached_tail_ = tail_.load(std::memory_order_acquire);
+			if (head == cached_tail_)
+				return false;
+		}
+
+		value = ring_[head & mask_];
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Consumer side. Wait until a value is available.
+	 */
+	void pop(T& value)
+	{
+		for (Backoff backoff; not try_pop(value); backoff.wait()) {}
+	}
+
+private:
+	// Spin first since the other side is usually about to catch up, then yield, then sleep so that an idle side does
+	// not hog its core.
+	class Backoff
+	{
+	public:
+		void wait()
+		{
+			if (count_ < 64) {
+				++count_;
+			} else if (count_ < 1024) {
+				++count_;
+				std::this_thread::yield();
+			} else {
+				std::this_thread::sleep_for(std::chrono::microseconds(50));
+			}
+		}
+
+	private:
+		unsigned count_ = 0;
+	};
+
+	const std::size_t mask_;
+	std::unique_ptr<T[]> ring_;
+
+	// Each index is written by a single side: keep them on their own cache lines, along with the copy of the other
+	// index that side works with.
+	alignas(64) std::atomic<std::size_t> head_{0};
+	std::size_t cached_tail_ = 0;
+	alignas(64) std::atomic<std::size_t> tail_{0};
+	std::size_t cached_head_ = 0;
+};
+
+}}}}
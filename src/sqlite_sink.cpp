@@ -0,0 +1,546 @@
+#include "sqlite_sink.h"
+
+#include <algorithm>
+#include <sstream>
+#include <string>
+
+#include <sqlite3.h>
+
+#include "compact_accesses.h"
+
+#include <rvnmetadata/metadata-common.h>
+#include <rvnmetadata/metadata-sql.h>
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+namespace {
+
+using Db = sqlite::Database;
+using RDb = sqlite::ResourceDatabase;
+using Stmt = sqlite::Statement;
+
+using Meta = ::reven::metadata::Metadata;
+using MetaType = ::reven::metadata::ResourceType;
+using MetaVersion = ::reven::metadata::Version;
+
+void create_indexes(Db& db, bool compact_accesses)
+{
+	db.exec("create index if not exists idx_slices_1 on slices(transition_last);", "Can't create idx_slices_1");
+	db.exec("create index if not exists idx_chunks_1 on chunks(operation, slice_id, phy_last);",
+	        "Can't create idx_chunks_1");
+	if (compact_accesses)
+		return;
+
+	db.exec("create index if not exists idx_accesses_1 on accesses(chunk_id, transition);",
+	        "Can't create idx_accesses_1");
+	db.exec("create index if not exists idx_accesses_2 on accesses(transition);",
+	        "Can't create idx_accesses_2");
+}
+
+void set_pragmas(Db& db, const DbWriterOptions& options);
+
+void check_storage_options(const DbWriterOptions& options)
+{
+	if (options.durable_slices and options.no_journal) {
+		throw std::invalid_argument("DbWriter: durable_slices requires a journal");
+	}
+	if (options.page_size != 0 and
+	    (options.page_size < 512 or options.page_size > 65536 or (options.page_size & (options.page_size - 1)) != 0)) {
+		throw std::invalid_argument("DbWriter: page_size must be a power of two between 512 and 65536");
+	}
+}
+
+void create_sqlite_db(Db& db, const DbWriterOptions& options)
+{
+	if (options.page_size != 0) {
+		// The metadata table is already written with the default page size: vacuum the database, which is still
+		// almost empty, to apply the new one.
+		db.exec(("pragma page_size=" + std::to_string(options.page_size)).c_str(), "Pragma error");
+		db.exec("vacuum;", "Can't apply page_size");
+	}
+
+	db.exec("create table slices(transition_first int8 not null, transition_last int8 not null);",
+	        "Can't create table slices");
+	if (options.compact_accesses) {
+		// See compact_accesses.h for the blob
+		db.exec("create table chunks(slice_id int8 not null, phy_first int8 not null, phy_last int8 not null,"
+		        "operation int not null, accesses blob not null);",
+		        "Can't create table chunks");
+	} else {
+		db.exec("create table chunks(slice_id int8 not null, phy_first int8 not null, phy_last int8 not null,"
+		        "operation int not null);",
+		        "Can't create table chunks");
+		db.exec("create table accesses(chunk_id int8 not null, transition int8 not null, linear int8,"
+		        "phy_first int8 not null, size int not null, operation int not null);",
+		        "Can't create table accesses");
+	}
+
+	// In bulk load mode, indexes are built once all data is inserted, see SqliteSink::create_deferred_indexes
+	if (not options.deferred_indexes)
+		create_indexes(db, options.compact_accesses);
+
+	set_pragmas(db, options);
+}
+
+void set_pragmas(Db& db, const DbWriterOptions& options)
+{
+	if (options.durable_slices) {
+		// Commits survive crashes and power losses, so the database always ends at the last written slice
+		db.exec("pragma synchronous=full", "Pragma error");
+		db.exec("pragma journal_mode=truncate", "Pragma error");
+	} else {
+		db.exec("pragma synchronous=off", "Pragma error");
+		db.exec(options.no_journal ? "pragma journal_mode=off" : "pragma journal_mode=memory", "Pragma error");
+	}
+	db.exec("pragma count_changes=off", "Pragma error");
+	db.exec("pragma temp_store=memory", "Pragma error");
+	if (options.cache_size_kib != 0) {
+		// Negative values are in KiB
+		db.exec(("pragma cache_size=-" + std::to_string(options.cache_size_kib)).c_str(), "Pragma error");
+	}
+	if (options.mmap_size != 0)
+		db.exec(("pragma mmap_size=" + std::to_string(options.mmap_size)).c_str(), "Pragma error");
+	if (options.exclusive_locking)
+		db.exec("pragma locking_mode=exclusive", "Pragma error");
+}
+
+// Build an insertion query for `rows` rows of `columns` values each
+std::string insert_query(const char* table, int columns, std::size_t rows)
+{
+	std::string row = "(?";
+	for (int i = 1; i < columns; ++i)
+		row += ",?";
+	row += ")";
+
+	std::string query = std::string("insert into ") + table + " values " + row;
+	for (std::size_t i = 1; i < rows; ++i)
+		query += "," + row;
+	return query + ";";
+}
+
+} // anonymous namespace
+
+constexpr int SqliteSink::chunk_columns;
+constexpr int SqliteSink::access_columns;
+constexpr int SqliteSink::compact_chunk_columns;
+
+SqliteSink::SqliteSink(const char* filename, const char* tool_name, const char* tool_version, const char* tool_info,
+                       const DbWriterOptions& options) :
+	SqliteSink([filename, tool_name, tool_version, tool_info, &options]() {
+	check_storage_options(options);
+
+	auto md = Meta(
+		MetaType::MemHist,
+		MetaVersion::from_string(options.compact_accesses ? compact_format_version : format_version),
+		tool_name,
+		MetaVersion::from_string(tool_version),
+		tool_info + std::string(" - using rvnmemhistwriter ") + writer_version +
+		  (options.compact_accesses ? " with compact accesses" : "")
+	);
+
+	auto rdb = RDb::create(filename, metadata::to_sqlite_raw_metadata(md));
+	create_sqlite_db(rdb, options);
+	return rdb;
+}(), options)
+{
+}
+
+std::unique_ptr<SqliteSink> SqliteSink::resume(const char* filename, const DbWriterOptions& options)
+{
+	check_storage_options(options);
+
+	auto db = RDb::open(filename, false);
+	auto has_table = [&db](const char* name) {
+		Stmt stmt(db, (std::string("select count(*) from sqlite_master where type = 'table' and name = '") + name +
+		               "';").c_str());
+		stmt.step();
+		return stmt.column_i64(0) != 0;
+	};
+	if (not has_table("slices") or not has_table("chunks")) {
+		throw std::runtime_error(std::string("Can't resume ") + filename + ": not a memory history database");
+	}
+
+	// The schema and the state of the indexes are the ones of the database, whatever the options
+	DbWriterOptions resumed_options = options;
+	resumed_options.compact_accesses = not has_table("accesses");
+	{
+		Stmt stmt(db, "select count(*) from sqlite_master where type = 'index' and name = 'idx_chunks_1';");
+		stmt.step();
+		resumed_options.deferred_indexes = stmt.column_i64(0) == 0;
+	}
+
+	set_pragmas(db, resumed_options);
+	return std::unique_ptr<SqliteSink>(new SqliteSink(std::move(db), resumed_options));
+}
+
+SqliteSink::SqliteSink(sqlite::ResourceDatabase db, const DbWriterOptions& options) :
+	db_(std::move(db)),
+	insert_slice_stmt_(db_, "insert into slices values (?,?);"),
+	insert_chunk_stmt_(db_, options.compact_accesses ? "insert into chunks values (?,?,?,?,?);"
+	                                                  : "insert into chunks values (?,?,?,?);"),
+	bulk_insert_rows_(options.bulk_insert_rows),
+	index_build_threads_(options.index_build_threads),
+	indexes_pending_(options.deferred_indexes),
+	compact_accesses_(options.compact_accesses)
+{
+	if (bulk_insert_rows_ == 0) {
+		throw std::invalid_argument("DbWriter: bulk_insert_rows must be at least 1");
+	}
+
+	// Stay within the amount of parameters sqlite accepts in a single statement
+	auto max_params = static_cast<std::size_t>(sqlite3_limit(db_.get(), SQLITE_LIMIT_VARIABLE_NUMBER, -1));
+	bulk_insert_rows_ = std::min(bulk_insert_rows_, max_params / access_columns);
+
+	if (compact_accesses_) {
+		insert_compact_chunk_stmt_ = std::make_unique<BlobStatement>(
+		  db_, insert_query("chunks", compact_chunk_columns, 1).c_str());
+		if (bulk_insert_rows_ > 1) {
+			insert_compact_chunks_bulk_stmt_ = std::make_unique<BlobStatement>(
+			  db_, insert_query("chunks", compact_chunk_columns, bulk_insert_rows_).c_str());
+		}
+		return;
+	}
+
+	insert_access_stmt_ = std::make_unique<Stmt>(db_, insert_query("accesses", access_columns, 1).c_str());
+	if (bulk_insert_rows_ > 1) {
+		insert_chunks_bulk_stmt_ = std::make_unique<Stmt>(
+		  db_, insert_query("chunks", chunk_columns, bulk_insert_rows_).c_str());
+		insert_accesses_bulk_stmt_ = std::make_unique<Stmt>(
+		  db_, insert_query("accesses", access_columns, bulk_insert_rows_).c_str());
+	}
+}
+
+void SqliteSink::bind_chunk(Stmt& stmt, int first_param, const ChunkRow& chunk)
+{
+	stmt.bind_arg_throw(first_param + 0, chunk.slice_id, "slice_id");
+	stmt.bind_arg_throw(first_param + 1, chunk.phy_first, "phy_first");
+	stmt.bind_arg_throw(first_param + 2, chunk.phy_last, "phy_last");
+	stmt.bind_arg_extend(first_param + 3, chunk.operation, "operation");
+}
+
+void SqliteSink::bind_access(Stmt& stmt, int first_param, const AccessRow& access)
+{
+	stmt.bind_arg_throw(first_param + 0, access.chunk_id, "chunk_id");
+	stmt.bind_arg_throw(first_param + 1, access.transition, "transition");
+	if (access.has_linear)
+		stmt.bind_arg_cast(first_param + 2, access.linear, "linear");
+	else
+		stmt.bind_null(first_param + 2, "linear");
+	stmt.bind_arg_throw(first_param + 3, access.phy_first, "phy_first");
+	stmt.bind_arg_throw(first_param + 4, access.size, "size");
+	stmt.bind_arg_extend(first_param + 5, access.operation, "operation");
+}
+
+void SqliteSink::bind_compact_chunk(BlobStatement& stmt, int first_param, const ChunkRow& chunk,
+                                    const std::vector<std::uint8_t>& accesses)
+{
+	auto* raw = stmt.get();
+	sqlite3_bind_int64(raw, first_param + 0, static_cast<sqlite3_int64>(chunk.slice_id));
+	sqlite3_bind_int64(raw, first_param + 1, static_cast<sqlite3_int64>(chunk.phy_first));
+	sqlite3_bind_int64(raw, first_param + 2, static_cast<sqlite3_int64>(chunk.phy_last));
+	sqlite3_bind_int(raw, first_param + 3, chunk.operation);
+	if (sqlite3_bind_blob(raw, first_param + 4, accesses.data(), static_cast<int>(accesses.size()), SQLITE_TRANSIENT) !=
+	    SQLITE_OK) {
+		throw std::runtime_error("Can't bind accesses blob");
+	}
+}
+
+void SqliteSink::check_default_schema() const
+{
+	if (compact_accesses_) {
+		throw std::logic_error("SqliteSink: rows cannot be inserted one by one with compact accesses");
+	}
+}
+
+std::uint64_t SqliteSink::transition_end()
+{
+	Stmt stmt(db_, "select max(transition_last) from slices;");
+	stmt.step();
+	if (stmt.column_type(0) == Stmt::Type::Null)
+		return 0;
+	return static_cast<std::uint64_t>(stmt.column_i64(0)) + 1;
+}
+
+void SqliteSink::begin()
+{
+	db_.exec("begin", "Cannot start transaction");
+}
+
+void SqliteSink::commit()
+{
+	db_.exec("commit", "Can't commit transaction");
+}
+
+std::uint64_t SqliteSink::insert_slice(std::uint64_t transition_first, std::uint64_t transition_last)
+{
+	insert_slice_stmt_.bind_arg_throw(1, transition_first, "transition_first");
+	insert_slice_stmt_.bind_arg_throw(2, transition_last, "transition_last");
+	insert_slice_stmt_.step();
+
+	insert_slice_stmt_.reset();
+
+	return static_cast<std::uint64_t>(db_.last_insert_rowid());
+}
+
+// Writes the slices in a transaction that stays open between steps: chunks first, then accesses with the default
+// schema, or chunks along with their accesses with the compact one.
+class SqliteSink::StepWrite : public SliceWrite
+{
+public:
+	StepWrite(SqliteSink& sink, Slice& read_slice, Slice& write_slice, AccessJournal& journal)
+	  : sink_(sink)
+	  , journal_(journal)
+	  , chunks_(read_slice, write_slice)
+	{
+		auto transitions = slice_transitions(read_slice, write_slice);
+		transition_first_ = transitions.first;
+
+		sink_.begin();
+		slice_id_ = sink_.insert_slice(transitions.first, transitions.second);
+		if (sink_.compact_accesses_)
+			sink_.group_compact_accesses(read_slice, write_slice, journal);
+	}
+
+	bool step(std::size_t rows) override
+	{
+		if (chunks_written_ < chunks_.size()) {
+			auto count = std::min(rows, chunks_.size() - chunks_written_);
+			if (sink_.compact_accesses_) {
+				sink_.insert_compact_chunks(chunks_, chunks_written_, count, slice_id_, transition_first_, journal_);
+			} else {
+				auto first_chunk_id = sink_.insert_chunks(chunks_, chunks_written_, count, slice_id_, journal_);
+				if (chunks_written_ == 0)
+					first_chunk_id_ = first_chunk_id;
+			}
+			chunks_written_ += count;
+			rows -= count;
+		}
+
+		std::size_t access_count = sink_.compact_accesses_ ? 0 : journal_.size();
+		if (rows and accesses_written_ < access_count) {
+			auto count = std::min(rows, access_count - accesses_written_);
+			sink_.insert_accesses(journal_, accesses_written_, count, first_chunk_id_);
+			accesses_written_ += count;
+		}
+
+		if (chunks_written_ < chunks_.size() or accesses_written_ < access_count)
+			return false;
+
+		StepTimer timer(sink_.times_.commit);
+		sink_.commit();
+		return true;
+	}
+
+private:
+	SqliteSink& sink_;
+	AccessJournal& journal_;
+	SliceChunkMerge chunks_;
+	std::uint64_t slice_id_;
+	std::uint64_t transition_first_;
+	std::size_t chunks_written_ = 0;
+	std::size_t accesses_written_ = 0;
+	std::uint64_t first_chunk_id_ = 0;
+};
+
+void SqliteSink::write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal)
+{
+	StepWrite(*this, read_slice, write_slice, journal).step(SliceWrite::all_rows);
+}
+
+std::unique_ptr<SliceWrite> SqliteSink::start_write_slices(Slice& read_slice, Slice& write_slice,
+                                                           AccessJournal& journal)
+{
+	return std::make_unique<StepWrite>(*this, read_slice, write_slice, journal);
+}
+
+// Will insert the accesses in their order of appearance, using the chunk indices set by insert_chunks
+void SqliteSink::insert_accesses(const AccessJournal& journal, std::size_t first, std::size_t count,
+                                 std::uint64_t first_chunk_id)
+{
+	StepTimer timer(times_.accesses);
+	insert_access_rows(count, [&journal, first, first_chunk_id](std::size_t index) {
+		auto i = static_cast<AccessJournal::Index>(first + index);
+		auto chunk_index = journal.chunk_id(i);
+		if (not chunk_index) {
+			throw std::logic_error("All accesses should have a chunk id, but one is missing");
+		}
+
+		return AccessRow{ first_chunk_id + chunk_index - 1, journal.transition(i), journal.virtual_address(i),
+		                  journal.has_virtual_address(i), journal.physical_address(i), journal.size(i),
+		                  journal.operation(i) };
+	});
+}
+
+std::uint64_t SqliteSink::insert_chunks(SliceChunkMerge& chunks, std::size_t first, std::size_t count,
+                                        std::uint64_t slice_id, AccessJournal& journal)
+{
+	StepTimer timer(times_.chunks);
+
+	// Rowids are only known once chunks are inserted, so accesses get the index of their chunk, starting at 1 since 0
+	// means unset, and the first rowid is added when inserting them.
+	std::uint64_t chunk_index = first;
+	return insert_chunk_rows(count, [&chunks, &chunk_index, slice_id, &journal](std::size_t) {
+		auto it = chunks.next();
+		++chunk_index;
+		for (auto a = it.chunk->accesses(); a; a = it.chunk->next(a)) {
+			journal.set_chunk_id(a->journal_index, chunk_index);
+		}
+		return ChunkRow{ slice_id, it.chunk->address_first(), it.chunk->address_last(), it.operation };
+	});
+}
+
+void SqliteSink::group_compact_accesses(Slice& read_slice, Slice& write_slice, AccessJournal& journal)
+{
+	StepTimer timer(times_.accesses);
+
+	// Chunks list their accesses out of order once merged. They are grouped by chunk with a pass over the journal
+	// instead, which keeps their order of appearance: chunk_ends_ first holds where the accesses of each chunk start.
+	chunk_ends_.clear();
+	std::size_t offset = 0;
+	for (SliceChunkMerge chunks(read_slice, write_slice); not chunks.done();) {
+		auto it = chunks.next();
+		chunk_ends_.push_back(offset);
+		for (auto a = it.chunk->accesses(); a; a = it.chunk->next(a)) {
+			journal.set_chunk_id(a->journal_index, chunk_ends_.size());
+		}
+		offset += it.chunk->size();
+	}
+
+	chunk_accesses_.resize(journal.size());
+	for (AccessJournal::Index i = 0; i < journal.size(); ++i) {
+		auto chunk_index = journal.chunk_id(i);
+		if (not chunk_index) {
+			throw std::logic_error("All accesses should have a chunk id, but one is missing");
+		}
+		chunk_accesses_[chunk_ends_[chunk_index - 1]++] = i;
+	}
+}
+
+void SqliteSink::insert_compact_chunks(SliceChunkMerge& chunks, std::size_t first, std::size_t count,
+                                       std::uint64_t slice_id, std::uint64_t transition_first,
+                                       const AccessJournal& journal)
+{
+	StepTimer timer(times_.chunks);
+	std::size_t chunk_index = first;
+	insert_rows(*insert_compact_chunk_stmt_, insert_compact_chunks_bulk_stmt_.get(), compact_chunk_columns, count,
+	            [&](BlobStatement& stmt, int first_param, std::size_t) {
+		auto it = chunks.next();
+		auto first_access = chunk_index ? chunk_ends_[chunk_index - 1] : 0;
+		auto last_access = chunk_ends_[chunk_index++];
+
+		compact::AccessEncoder encoder(blob_, last_access - first_access, it.chunk->address_first(), transition_first);
+		for (auto a = first_access; a < last_access; ++a) {
+			auto i = chunk_accesses_[a];
+			encoder.add(journal.transition(i), journal.physical_address(i), journal.virtual_address(i),
+			            journal.has_virtual_address(i), journal.size(i));
+		}
+
+		bind_compact_chunk(stmt, first_param,
+		                   ChunkRow{ slice_id, it.chunk->address_first(), it.chunk->address_last(), it.operation },
+		                   blob_);
+	});
+}
+
+void SqliteSink::discard_after(std::uint64_t transition_count)
+{
+	// The deletion below relies on indexes, and they would be built at the end anyway.
+	create_deferred_indexes();
+
+	if (compact_accesses_) {
+		discard_compact_accesses_after(transition_count);
+		return;
+	}
+
+	std::stringstream ss;
+	ss << "delete from accesses where "
+	   << "chunk_id >= (select min(rowid) from chunks where "
+	   <<              "slice_id = (select rowid from slices where transition_last >= " << transition_count
+	   <<                         " limit 1) limit 1) and "
+	   << "transition >= " << transition_count << ";";
+	db_.exec(ss.str().c_str(), "Can't discard accesses");
+
+	// Note we do not shrink chunks or slices to reflect this change, which may result in slight inconsistencies where
+	// chunks are empty or not tight.
+	// This should not be a problem because the user should always end up requesting the accesses for a given chunk,
+	// and in this case accesses will simply not be there.
+}
+
+void SqliteSink::discard_compact_accesses_after(std::uint64_t transition_count)
+{
+	struct Rewrite {
+		std::uint64_t chunk_id;
+		std::vector<std::uint8_t> blob;
+	};
+	std::vector<Rewrite> rewrites;
+
+	// Only the chunks of the slices that end after the transition can have accesses to discard, which should be few
+	{
+		BlobStatement select(db_, "select c.rowid, c.phy_first, s.transition_first, c.accesses from chunks c "
+		                          "join slices s on c.slice_id = s.rowid where s.transition_last >= ?;");
+		sqlite3_bind_int64(select.get(), 1, static_cast<sqlite3_int64>(transition_count));
+		while (select.step_row()) {
+			auto* raw = select.get();
+			auto chunk_first = static_cast<std::uint64_t>(sqlite3_column_int64(raw, 1));
+			auto transition_first = static_cast<std::uint64_t>(sqlite3_column_int64(raw, 2));
+			const auto* blob = static_cast<const std::uint8_t*>(sqlite3_column_blob(raw, 3));
+			auto accesses = compact::decode_accesses(blob, static_cast<std::size_t>(sqlite3_column_bytes(raw, 3)),
+			                                         chunk_first, transition_first);
+
+			auto kept = std::count_if(accesses.begin(), accesses.end(), [transition_count](const compact::Access& a) {
+				return a.transition < transition_count;
+			});
+			if (static_cast<std::size_t>(kept) == accesses.size())
+				continue;
+
+			Rewrite rewrite{ static_cast<std::uint64_t>(sqlite3_column_int64(raw, 0)), {} };
+			compact::AccessEncoder encoder(rewrite.blob, static_cast<std::uint64_t>(kept), chunk_first,
+			                               transition_first);
+			for (const auto& a : accesses) {
+				if (a.transition < transition_count)
+					encoder.add(a.transition, a.physical_address, a.linear_address, a.has_linear_address, a.size);
+			}
+			rewrites.push_back(std::move(rewrite));
+		}
+	}
+
+	// As with the default schema, chunks are left as they are, even if empty
+	begin();
+	BlobStatement update(db_, "update chunks set accesses = ? where rowid = ?;");
+	for (const auto& rewrite : rewrites) {
+		sqlite3_bind_blob(update.get(), 1, rewrite.blob.data(), static_cast<int>(rewrite.blob.size()),
+		                  SQLITE_STATIC);
+		sqlite3_bind_int64(update.get(), 2, static_cast<sqlite3_int64>(rewrite.chunk_id));
+		update.step();
+		update.reset();
+	}
+	commit();
+}
+
+void SqliteSink::finish()
+{
+	create_deferred_indexes();
+}
+
+RDb SqliteSink::take() &&
+{
+	return std::move(db_);
+}
+
+void SqliteSink::create_deferred_indexes()
+{
+	if (not indexes_pending_)
+		return;
+
+	if (index_build_threads_) {
+		// Let sqlite sort index entries with helper threads
+		db_.exec(("pragma threads=" + std::to_string(index_build_threads_)).c_str(), "Pragma error");
+	}
+
+	create_indexes(db_, compact_accesses_);
+	indexes_pending_ = false;
+}
+
+}}}} // namespace reven::backend::memaccess::db
@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+#include <rvnsqlite/resource_database.h>
+
+#include "sink.h"
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * A statement used through the sqlite API directly, to bind blobs.
+ */
+class BlobStatement
+{
+public:
+	BlobStatement(sqlite::Database& db, const char* query)
+	{
+		if (sqlite3_prepare_v2(db.get(), query, -1, &stmt_, nullptr) != SQLITE_OK) {
+			auto error = std::string("Can't prepare statement: ") + sqlite3_errmsg(db.get());
+			sqlite3_finalize(stmt_);
+			throw std::runtime_error(error);
+		}
+	}
+
+	~BlobStatement() { sqlite3_finalize(stmt_); }
+
+	BlobStatement(const BlobStatement&) = delete;
+	BlobStatement& operator=(const BlobStatement&) = delete;
+
+	sqlite3_stmt* get() { return stmt_; }
+
+	// Run a statement that returns no row
+	void step()
+	{
+		if (not step_row())
+			return;
+		throw std::runtime_error("Statement returned a row");
+	}
+
+	// Go to the next row of a query, and return false once there are no more
+	bool step_row()
+	{
+		auto result = sqlite3_step(stmt_);
+		if (result == SQLITE_ROW)
+			return true;
+		if (result != SQLITE_DONE) {
+			throw std::runtime_error(std::string("Can't execute statement: ") +
+			                         sqlite3_errmsg(sqlite3_db_handle(stmt_)));
+		}
+		return false;
+	}
+
+	void reset() { sqlite3_reset(stmt_); }
+
+private:
+	sqlite3_stmt* stmt_ = nullptr;
+};
+
+/**
+ * Writes slices to a sqlite database with the schema described in the README, or its compact variant when
+ * `compact_accesses` is set.
+ *
+ * Besides the Sink interface, rows can be inserted directly, by writers that do not build Slice objects, such as the
+ * columnar converter. Each slice is then expected to be written in a transaction, with its chunks then its accesses.
+ * This is only possible with the default schema.
+ */
+class SqliteSink : public Sink
+{
+public:
+	struct ChunkRow {
+		std::uint64_t slice_id;
+		std::uint64_t phy_first;
+		std::uint64_t phy_last;
+		std::uint8_t operation;
+	};
+
+	struct AccessRow {
+		std::uint64_t chunk_id;
+		std::uint64_t transition;
+		std::uint64_t linear;
+		bool has_linear;
+		std::uint64_t phy_first;
+		std::uint32_t size;
+		std::uint8_t operation;
+	};
+
+	/**
+	 * Create the database and its tables. `options` tells how rows are inserted and when indexes are built.
+	 */
+	SqliteSink(const char* filename, const char* tool_name, const char* tool_version, const char* tool_info,
+	           const DbWriterOptions& options);
+
+	/**
+	 * Open an existing database to append slices to it, see `DbWriter::open_resume`. The schema and deferred indexes
+	 * are the ones of the database, the other options apply.
+	 */
+	static std::unique_ptr<SqliteSink> resume(const char* filename, const DbWriterOptions& options);
+
+	/**
+	 * Return the transition after the last slice of the database, or 0 if it has none.
+	 */
+	std::uint64_t transition_end();
+
+	void write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal) override;
+	/**
+	 * The transaction of the slices stays open between steps, and each step writes chunks, then accesses with the
+	 * default schema.
+	 */
+	std::unique_ptr<SliceWrite> start_write_slices(Slice& read_slice, Slice& write_slice,
+	                                               AccessJournal& journal) override;
+	/**
+	 * With the compact schema, the blobs of the affected chunks are rewritten.
+	 */
+	void discard_after(std::uint64_t transition_count) override;
+
+	/**
+	 * In bulk load mode, build the indexes. Does nothing otherwise.
+	 */
+	void finish() override;
+
+	/**
+	 * Return the database. The sink cannot be used afterwards.
+	 */
+	sqlite::ResourceDatabase take() &&;
+
+	void begin();
+	void commit();
+
+	// Insert a slice and return its rowid.
+	std::uint64_t insert_slice(std::uint64_t transition_first, std::uint64_t transition_last);
+
+	// Insert `count` chunks, where `row(index)` returns the ChunkRow of the chunk at `index`, and return the rowid of
+	// the first one. The others follow it. `row` is called once per chunk, in order, so it can stream them.
+	template <typename RowAt>
+	std::uint64_t insert_chunk_rows(std::size_t count, RowAt&& row)
+	{
+		check_default_schema();
+		insert_rows(insert_chunk_stmt_, insert_chunks_bulk_stmt_.get(), chunk_columns, count,
+		            [&row](sqlite::Statement& stmt, int first_param, std::size_t index) {
+			bind_chunk(stmt, first_param, row(index));
+		});
+
+		// Chunks are never deleted, so sqlite gives them consecutive rowids: there is no need to query them one by one.
+		return static_cast<std::uint64_t>(db_.last_insert_rowid()) - count + 1;
+	}
+
+	// Insert `count` accesses, where `row(index)` returns the AccessRow of the access at `index`.
+	template <typename RowAt>
+	void insert_access_rows(std::size_t count, RowAt&& row)
+	{
+		check_default_schema();
+		insert_rows(*insert_access_stmt_, insert_accesses_bulk_stmt_.get(), access_columns, count,
+		            [&row](sqlite::Statement& stmt, int first_param, std::size_t index) {
+			bind_access(stmt, first_param, row(index));
+		});
+	}
+
+private:
+	// Prepare the statements to write to `db`, whose tables exist
+	SqliteSink(sqlite::ResourceDatabase db, const DbWriterOptions& options);
+
+	static constexpr int chunk_columns = 4;
+	static constexpr int access_columns = 6;
+	// Chunk columns, then the blob of its accesses
+	static constexpr int compact_chunk_columns = 5;
+
+	static void bind_chunk(sqlite::Statement& stmt, int first_param, const ChunkRow& chunk);
+	static void bind_access(sqlite::Statement& stmt, int first_param, const AccessRow& access);
+	static void bind_compact_chunk(BlobStatement& stmt, int first_param, const ChunkRow& chunk,
+	                               const std::vector<std::uint8_t>& accesses);
+
+	// Throw std::logic_error with the compact schema
+	void check_default_schema() const;
+
+	// Insert `count` rows, `bulk_insert_rows_` at a time with `bulk_stmt` if available, and the remainder one at a time
+	// with `stmt`. `bind(stmt, first_param, index)` must bind the columns of row `index` starting at parameter
+	// `first_param`.
+	template <typename Statement, typename Bind>
+	void insert_rows(Statement& stmt, Statement* bulk_stmt, int columns, std::size_t count, Bind&& bind)
+	{
+		std::size_t index = 0;
+		if (bulk_stmt) {
+			for (; index + bulk_insert_rows_ <= count; index += bulk_insert_rows_) {
+				for (std::size_t row = 0; row < bulk_insert_rows_; ++row) {
+					bind(*bulk_stmt, static_cast<int>(row) * columns + 1, index + row);
+				}
+				bulk_stmt->step();
+				bulk_stmt->reset();
+			}
+		}
+
+		for (; index < count; ++index) {
+			bind(stmt, 1, index);
+			stmt.step();
+			stmt.reset();
+		}
+	}
+
+	class StepWrite;
+
+	// Will insert the next `count` chunks of `chunks` in the database, and return the rowid of the first one. `first`
+	// is the amount of chunks already inserted for the slices: accesses in `journal` get the index of their chunk,
+	// starting at 1.
+	std::uint64_t insert_chunks(SliceChunkMerge& chunks, std::size_t first, std::size_t count, std::uint64_t slice_id,
+	                            AccessJournal& journal);
+
+	// Will insert `count` accesses of `journal` from index `first`, once their chunks are inserted.
+	void insert_accesses(const AccessJournal& journal, std::size_t first, std::size_t count,
+	                     std::uint64_t first_chunk_id);
+
+	// With the compact schema, group the accesses of both slices by chunk in `chunk_accesses_`, before inserting their
+	// chunks.
+	void group_compact_accesses(Slice& read_slice, Slice& write_slice, AccessJournal& journal);
+
+	// With the compact schema, will insert the next `count` chunks of `chunks` in the database, along with their
+	// accesses. `first` is the amount of chunks already inserted for the slices.
+	void insert_compact_chunks(SliceChunkMerge& chunks, std::size_t first, std::size_t count, std::uint64_t slice_id,
+	                           std::uint64_t transition_first, const AccessJournal& journal);
+
+	// `discard_after` with the compact schema
+	void discard_compact_accesses_after(std::uint64_t transition_count);
+
+	// Build the indexes that were not created with the tables, in bulk load mode.
+	void create_deferred_indexes();
+
+	sqlite::ResourceDatabase db_;
+	sqlite::Statement insert_slice_stmt_;
+	sqlite::Statement insert_chunk_stmt_;
+	// Null with the compact schema, which has no accesses table
+	std::unique_ptr<sqlite::Statement> insert_access_stmt_;
+	// Multi-row variants of the statements above, only when `bulk_insert_rows_` > 1.
+	std::unique_ptr<sqlite::Statement> insert_chunks_bulk_stmt_;
+	std::unique_ptr<sqlite::Statement> insert_accesses_bulk_stmt_;
+	// Only with the compact schema, and the multi-row variant only when `bulk_insert_rows_` > 1
+	std::unique_ptr<BlobStatement> insert_compact_chunk_stmt_;
+	std::unique_ptr<BlobStatement> insert_compact_chunks_bulk_stmt_;
+	std::size_t bulk_insert_rows_;
+	unsigned index_build_threads_;
+	// Whether indexes still need to be created, in bulk load mode.
+	bool indexes_pending_;
+	bool compact_accesses_;
+
+	// scratch-space for reuse without allocation with the compact schema: the accesses of the slice grouped by chunk,
+	// where chunk_ends_ tells where those of each chunk end, and the blob being encoded
+	std::vector<AccessJournal::Index> chunk_accesses_;
+	std::vector<std::size_t> chunk_ends_;
+	std::vector<std::uint8_t> blob_;
+};
+
+}}}}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+namespace reven {
+namespace backend {
+namespace memaccess {
+namespace db {
+
+/**
+ * LEB128 varints, for compact encodings of integers that are usually small. Signed deltas are zigzag-encoded first.
+ */
+
+inline std::uint64_t zigzag(std::uint64_t delta)
+{
+	return (delta << 1) ^ (0 - (delta >> 63));
+}
+
+inline std::uint64_t unzigzag(std::uint64_t value)
+{
+	return (value >> 1) ^ (0 - (value & 1));
+}
+
+inline void put_varint(std::vector<std::uint8_t>& out, std::uint64_t value)
+{
+	while (value >= 0x80) {
+		out.push_back(static_cast<std::uint8_t>(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<std::uint8_t>(value));
+}
+
+/**
+ * Read a varint at `in` and advance it. Throw std::runtime_error if it does not end before `end`.
+ */
+inline std::uint64_t get_varint(const std::uint8_t*& in, const std::uint8_t* end)
+{
+	std::uint64_t value = 0;
+	for (unsigned shift = 0; shift < 64; shift += 7) {
+		if (in == end)
+			throw std::runtime_error("Truncated varint");
+		auto byte = *in++;
+		value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+		if (not (byte & 0x80))
+			return value;
+	}
+	throw std::runtime_error("Invalid varint");
+}
+
+}}}}
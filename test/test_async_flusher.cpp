@@ -0,0 +1,45 @@
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+#include "async_flusher.h"
+
+using namespace reven::backend::memaccess::db;
+
+BOOST_AUTO_TEST_CASE(test_db_writer_async_flusher_order)
+{
+	std::vector<int> written;
+	{
+		AsyncFlusher<int> flusher(2, [&written](int& job) { written.push_back(job); });
+		for (int i = 0; i < 100; ++i)
+			flusher.submit(int(i));
+		flusher.wait();
+		BOOST_CHECK_EQUAL(written.size(), 100);
+		flusher.submit(100);
+	}
+	// Destruction writes what remains
+	BOOST_REQUIRE_EQUAL(written.size(), 101);
+	for (int i = 0; i < 101; ++i)
+		BOOST_CHECK_EQUAL(written[i], i);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_async_flusher_error)
+{
+	AsyncFlusher<int> flusher(1, [](int& job) {
+		if (job == 3)
+			throw std::runtime_error("write failed");
+	});
+
+	BOOST_CHECK_THROW(
+	  {
+		  for (int i = 0; i < 100; ++i)
+			  flusher.submit(int(i));
+		  flusher.wait();
+	  },
+	  std::runtime_error);
+	BOOST_CHECK(flusher.error() != nullptr);
+	BOOST_CHECK_THROW(flusher.submit(0), std::runtime_error);
+	BOOST_CHECK_THROW(flusher.wait(), std::runtime_error);
+}
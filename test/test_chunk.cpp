@@ -8,9 +8,11 @@
 
 using namespace reven::backend::memaccess::db;
 
+static ChunkAccessPool pool;
+
 static std::set<const ChunkAccess*> get_accesses(const Chunk& chunk, std::set<const ChunkAccess*> accesses = {})
 {
-	for (const auto* access = chunk.accesses(); access; access = access->next())
+	for (const auto* access = chunk.accesses(); access; access = chunk.next(access))
 		BOOST_CHECK(accesses.insert(access).second); // Ensure unicity
 	return accesses;
 }
@@ -42,23 +44,60 @@ static void assert_touch(Chunk a, Chunk b)
 
 BOOST_AUTO_TEST_CASE(test_db_writer_chunk_creation)
 {
-	Chunk chunk(0x42, 10, 100);
+	Chunk chunk(pool, 0x42, 10, 100);
 	BOOST_CHECK_EQUAL(chunk.size(), 1);
 	BOOST_CHECK(chunk.accesses() != nullptr);
-	BOOST_CHECK(chunk.accesses()->next() == nullptr);
-	BOOST_CHECK_EQUAL(chunk.accesses()->transition, 0x42);
-	BOOST_CHECK_EQUAL(chunk.accesses()->address, 10);
-	BOOST_CHECK_EQUAL(chunk.accesses()->size, 100);
+	BOOST_CHECK(chunk.next(chunk.accesses()) == nullptr);
+	BOOST_CHECK_EQUAL(chunk.accesses()->journal_index, 0x42);
+	BOOST_CHECK_EQUAL(chunk.address_first(), 10);
+	BOOST_CHECK_EQUAL(chunk.address_last(), 109);
 }
 
 BOOST_AUTO_TEST_CASE(test_db_writer_chunk_merging)
 {
-	assert_overlap(Chunk(0, 10, 10), Chunk(2, 10, 10)); // Cover
-	assert_overlap(Chunk(0, 10, 10), Chunk(2, 4, 20));  // Over
-	assert_overlap(Chunk(0, 10, 10), Chunk(2, 15, 2));  // Inside
-	assert_overlap(Chunk(0, 10, 10), Chunk(2, 12, 10)); // Up
-	assert_overlap(Chunk(0, 10, 10), Chunk(2, 8, 10));  // Down
-
-	assert_touch(Chunk(0, 10, 10), Chunk(0, 20, 10)); // Up
-	assert_touch(Chunk(0, 10, 10), Chunk(0, 0, 10)); // Down
+	assert_overlap(Chunk(pool, 0, 10, 10), Chunk(pool, 2, 10, 10)); // Cover
+	assert_overlap(Chunk(pool, 0, 10, 10), Chunk(pool, 2, 4, 20));  // Over
+	assert_overlap(Chunk(pool, 0, 10, 10), Chunk(pool, 2, 15, 2));  // Inside
+	assert_overlap(Chunk(pool, 0, 10, 10), Chunk(pool, 2, 12, 10)); // Up
+	assert_overlap(Chunk(pool, 0, 10, 10), Chunk(pool, 2, 8, 10));  // Down
+
+	assert_touch(Chunk(pool, 0, 10, 10), Chunk(pool, 0, 20, 10)); // Up
+	assert_touch(Chunk(pool, 0, 10, 10), Chunk(pool, 0, 0, 10)); // Down
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_chunk_pool)
+{
+	ChunkAccessPool local_pool;
+	std::vector<const ChunkAccess*> accesses;
+
+	// Cross a block boundary to ensure previously returned nodes do not move.
+	for (std::uint32_t i = 0; i < 100000; ++i) {
+		accesses.push_back(&local_pool[local_pool.emplace(i * 2)]);
+	}
+
+	BOOST_CHECK_EQUAL(local_pool.size(), accesses.size());
+	for (std::uint32_t i = 0; i < accesses.size(); ++i) {
+		BOOST_CHECK(accesses[i] == &local_pool[i]);
+		BOOST_CHECK_EQUAL(accesses[i]->journal_index, i * 2);
+		BOOST_CHECK(local_pool.next(*accesses[i]) == nullptr);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_chunk_merging_different_pools)
+{
+	ChunkAccessPool other_pool;
+	Chunk a(pool, 0, 10, 10);
+	BOOST_CHECK_THROW(a.merge_in(Chunk(other_pool, 0, 20, 10)), std::logic_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_chunk_append)
+{
+	Chunk a(pool, 0, 10, 10);
+	Chunk b(pool, 1, 20, 10);
+	auto accesses = get_accesses(b, get_accesses(a));
+	a.append(std::move(b));
+	BOOST_CHECK_EQUAL(a.size(), 2);
+	BOOST_CHECK_EQUAL(a.address_first(), 10);
+	BOOST_CHECK_EQUAL(a.address_last(), 29);
+	BOOST_CHECK(accesses == get_accesses(a));
 }
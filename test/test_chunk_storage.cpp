@@ -0,0 +1,150 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/mpl/list.hpp>
+
+#include <random>
+#include <vector>
+
+#include "slice.h"
+
+using namespace reven::backend::memaccess::db;
+
+using Storages = boost::mpl::list<MapChunkStorage, FlatChunkStorage>;
+
+struct ChunkBounds {
+	std::uint64_t first;
+	std::uint64_t last;
+	std::size_t size;
+
+	bool operator==(const ChunkBounds& other) const
+	{
+		return first == other.first and last == other.last and size == other.size;
+	}
+
+	bool operator!=(const ChunkBounds& other) const { return not (*this == other); }
+};
+
+std::ostream& operator<<(std::ostream& os, const ChunkBounds& bounds)
+{
+	return os << "[" << bounds.first << ", " << bounds.last << "] x" << bounds.size;
+}
+
+template <typename Slice>
+static std::vector<ChunkBounds> get_bounds(const Slice& slice)
+{
+	std::vector<ChunkBounds> bounds;
+	for (const auto& chunk : slice)
+		bounds.push_back({ chunk.address_first(), chunk.address_last(), chunk.size() });
+	return bounds;
+}
+
+template <typename Storage>
+static BasicSlice<Storage> build_random(std::uint64_t seed, std::size_t count, std::uint64_t address_space)
+{
+	std::mt19937_64 rng(seed);
+	BasicSliceBuilder<Storage> b;
+	b.chunk_size_touch_limit(10);
+	for (std::size_t i = 0; i < count; ++i) {
+		BOOST_REQUIRE(b.insert(i, rng() % address_space, 1 + rng() % 16));
+	}
+	return std::move(b).build();
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_db_writer_chunk_storage_sorted, Storage, Storages)
+{
+	// Enough chunks to split flat blocks several times
+	auto slice = build_random<Storage>(1, 20000, 1 << 20);
+	auto bounds = get_bounds(slice);
+
+	BOOST_CHECK_EQUAL(bounds.size(), slice.chunk_count());
+	BOOST_CHECK_EQUAL(slice.access_count(), 20000);
+	for (std::size_t i = 1; i < bounds.size(); ++i) {
+		BOOST_CHECK(bounds[i - 1].last < bounds[i].first);
+	}
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_db_writer_chunk_storage_compact, Storage, Storages)
+{
+	BasicSliceBuilder<Storage> b;
+	b.chunk_size_touch_limit(100);
+	// Touching chunks over many flat blocks, plus a lonely one
+	for (std::uint64_t i = 0; i < 2000; ++i) {
+		BOOST_REQUIRE(b.insert(i, i, 1));
+	}
+	BOOST_REQUIRE(b.insert(2000, 5000, 1));
+	BOOST_CHECK_EQUAL(b.chunk_count(), 2001);
+
+	auto slice = std::move(b).build();
+	auto bounds = get_bounds(slice);
+	BOOST_REQUIRE_EQUAL(bounds.size(), 21);
+	for (std::uint64_t i = 0; i < 20; ++i) {
+		BOOST_CHECK_EQUAL(bounds[i], (ChunkBounds{ i * 100, i * 100 + 99, 100 }));
+	}
+	BOOST_CHECK_EQUAL(bounds[20], (ChunkBounds{ 5000, 5000, 1 }));
+
+	// Accesses are still all linked
+	BOOST_CHECK_EQUAL(slice.access_count(), 2001);
+	std::size_t linked = 0;
+	for (const auto& chunk : slice)
+		for (auto a = chunk.accesses(); a; a = chunk.next(a))
+			++linked;
+	BOOST_CHECK_EQUAL(linked, 2001);
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_db_writer_chunk_storage_memory_usage, Storage, Storages)
+{
+	auto small = build_random<Storage>(1, 1000, 1 << 30);
+	auto big = build_random<Storage>(1, 100000, 1 << 30);
+
+	BOOST_CHECK(small.memory_usage() > small.chunk_count() * sizeof(Chunk));
+	BOOST_CHECK(big.memory_usage() > small.memory_usage());
+	// The estimate stays in the ballpark of the actual size of chunks and accesses
+	BOOST_CHECK(big.memory_usage() < 4 * big.chunk_count() * (sizeof(Chunk) + 4 * sizeof(void*)) + (1 << 20));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_chunk_storage_equivalent)
+{
+	// Dense address space: many overlaps, including overlaps spanning several flat blocks.
+	for (std::uint64_t seed = 0; seed < 5; ++seed) {
+		auto map_bounds = get_bounds(build_random<MapChunkStorage>(seed, 20000, 1 << 16));
+		auto flat_bounds = get_bounds(build_random<FlatChunkStorage>(seed, 20000, 1 << 16));
+		BOOST_CHECK_EQUAL_COLLECTIONS(map_bounds.begin(), map_bounds.end(), flat_bounds.begin(), flat_bounds.end());
+	}
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_db_writer_chunk_storage_wide_overlap, Storage, Storages)
+{
+	BasicSliceBuilder<Storage> b;
+	for (std::uint64_t i = 0; i < 1000; ++i) {
+		BOOST_REQUIRE(b.insert(0, i * 2, 1));
+	}
+	BOOST_CHECK_EQUAL(b.chunk_count(), 1000);
+
+	// Covers every chunk
+	BOOST_REQUIRE(b.insert(1, 0, 2000));
+	BOOST_CHECK_EQUAL(b.chunk_count(), 1);
+
+	auto slice = std::move(b).build();
+	auto bounds = get_bounds(slice);
+	BOOST_REQUIRE_EQUAL(bounds.size(), 1);
+	BOOST_CHECK_EQUAL(bounds[0], (ChunkBounds{ 0, 1999, 1001 }));
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(test_db_writer_chunk_storage_overlap_to_block_end, Storage, Storages)
+{
+	// Flat blocks split in two when full: 300 chunks are [0, 127] and [128, 299], so the chunk [508, 509] ends the first
+	BasicSliceBuilder<Storage> b;
+	for (std::uint64_t i = 0; i < 300; ++i) {
+		BOOST_REQUIRE(b.insert(0, i * 4, 2));
+	}
+
+	// Overlaps more chunks than are checked one by one, and ends within the last chunk of the block
+	BOOST_REQUIRE(b.insert(1, 480, 29));
+	BOOST_CHECK_EQUAL(b.chunk_count(), 293);
+
+	auto slice = std::move(b).build();
+	auto bounds = get_bounds(slice);
+	BOOST_REQUIRE_EQUAL(bounds.size(), 293);
+	BOOST_CHECK_EQUAL(bounds[119], (ChunkBounds{ 476, 477, 1 }));
+	BOOST_CHECK_EQUAL(bounds[120], (ChunkBounds{ 480, 509, 9 }));
+	BOOST_CHECK_EQUAL(bounds[121], (ChunkBounds{ 512, 513, 1 }));
+}
@@ -0,0 +1,204 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#include <db_writer.h>
+#include <columnar.h>
+
+#include "columnar_format.h"
+
+using namespace reven::backend::memaccess::db;
+using Db = reven::sqlite::Database;
+using Stmt = reven::sqlite::Statement;
+
+namespace {
+
+constexpr const char* test_tool_name = "TestColumnar";
+constexpr const char* test_tool_version = "1.0.0";
+constexpr const char* test_tool_info = "TestColumnar info";
+
+// Accesses spread over several slices, overlapping and touching each other, going both ways in memory.
+std::vector<MemoryAccess> trace_accesses()
+{
+	std::vector<MemoryAccess> accesses;
+	for (std::uint64_t i = 0; i < 2000; ++i) {
+		auto address = (i % 7) * 0x1000 + (i * 13 % 64) * 4;
+		auto operation = i % 3 ? Operation::Read : Operation::Write;
+		accesses.push_back(MemoryAccess{ i / 2, address, address + 0xfff0000, static_cast<std::uint32_t>(1 + i % 8),
+		                                 i % 5 != 0, operation });
+	}
+	return accesses;
+}
+
+DbWriterOptions trace_options()
+{
+	DbWriterOptions options;
+	options.read_slice_limits.access_count_limit = 300;
+	return options;
+}
+
+std::vector<std::vector<std::int64_t>> table_rows(Db& db, const char* query, int columns)
+{
+	Stmt stmt(db, query);
+	std::vector<std::vector<std::int64_t>> rows;
+
+	while (stmt.step() == Stmt::StepResult::Row) {
+		rows.emplace_back();
+		for (int i = 0; i < columns; ++i) {
+			rows.back().push_back(stmt.column_type(i) == Stmt::Type::Null ? -1 : stmt.column_i64(i));
+		}
+	}
+
+	return rows;
+}
+
+void check_same_content(Db& db, Db& reference)
+{
+	const char* slices = "select rowid, * from slices order by rowid;";
+	const char* chunks = "select rowid, * from chunks order by rowid;";
+	const char* accesses = "select rowid, * from accesses order by rowid;";
+	BOOST_CHECK(table_rows(db, slices, 3) == table_rows(reference, slices, 3));
+	BOOST_CHECK(table_rows(db, chunks, 5) == table_rows(reference, chunks, 5));
+	BOOST_CHECK(table_rows(db, accesses, 7) == table_rows(reference, accesses, 7));
+}
+
+// Columnar file removed at the end of the test
+struct TemporaryFile {
+	explicit TemporaryFile(const char* name) : name(name) {}
+	~TemporaryFile() { std::remove(name); }
+	const char* name;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_columnar_codec)
+{
+	using namespace columnar;
+
+	std::vector<std::uint8_t> bytes;
+	std::vector<std::uint64_t> values = { 0, 1, 127, 128, 300, ~std::uint64_t(0), std::uint64_t(1) << 63 };
+	for (auto value : values) {
+		put_varint(bytes, value);
+		put_varint(bytes, zigzag(value));
+	}
+
+	const auto* in = bytes.data();
+	for (auto value : values) {
+		BOOST_CHECK_EQUAL(get_varint(in, bytes.data() + bytes.size()), value);
+		BOOST_CHECK_EQUAL(unzigzag(get_varint(in, bytes.data() + bytes.size())), value);
+	}
+	BOOST_CHECK(in == bytes.data() + bytes.size());
+	BOOST_CHECK_THROW(get_varint(in, bytes.data() + bytes.size()), std::runtime_error);
+
+	// Small negative deltas stay small
+	BOOST_CHECK_EQUAL(zigzag(std::uint64_t(0) - 1), 1);
+	BOOST_CHECK_EQUAL(zigzag(1), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_columnar_to_sqlite)
+{
+	auto accesses = trace_accesses();
+
+	auto reference_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, trace_options());
+	reference_writer.push(accesses.data(), accesses.size());
+	auto reference = std::move(reference_writer).take();
+
+	TemporaryFile file("test_db_writer_columnar_to_sqlite.rvnmh");
+	auto writer = DbWriter::columnar(file.name, test_tool_name, test_tool_version, test_tool_info, trace_options());
+	writer.push(accesses.data(), accesses.size());
+	BOOST_CHECK_THROW(std::move(writer).take(), std::logic_error);
+	std::move(writer).finish();
+
+	auto db = columnar_to_sqlite(file.name, ":memory:");
+	BOOST_CHECK(table_rows(reference, "select count(*) from slices;", 1)[0][0] > 1);
+	check_same_content(db, reference);
+	BOOST_CHECK_EQUAL(table_rows(db, "select count(*) from sqlite_master where type = 'index';", 1)[0][0], 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_columnar_async_flush)
+{
+	auto accesses = trace_accesses();
+
+	auto reference_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, trace_options());
+	reference_writer.push(accesses.data(), accesses.size());
+	auto reference = std::move(reference_writer).take();
+
+	auto options = trace_options();
+	options.async_flush_queue_depth = 2;
+
+	TemporaryFile file("test_db_writer_columnar_async_flush.rvnmh");
+	{
+		// Completed by the destructor
+		auto writer = DbWriter::columnar(file.name, test_tool_name, test_tool_version, test_tool_info, options);
+		writer.push(accesses.data(), accesses.size());
+		auto moved_writer = std::move(writer);
+	}
+
+	auto db = columnar_to_sqlite(file.name, ":memory:");
+	check_same_content(db, reference);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_columnar_parallel_slice_building)
+{
+	auto accesses = trace_accesses();
+
+	auto options = trace_options();
+	options.parallel_slice_building = true;
+
+	TemporaryFile file("test_db_writer_columnar_parallel_slice_building.rvnmh");
+	auto writer = DbWriter::columnar(file.name, test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+	std::move(writer).finish();
+
+	// Cuts depend on the workers' timing
+	auto db = columnar_to_sqlite(file.name, ":memory:");
+	BOOST_CHECK_EQUAL(table_rows(db, "select count(*) from accesses;", 1)[0][0], accesses.size());
+	BOOST_CHECK(table_rows(db, "select count(*) from accesses a, chunks c where a.chunk_id = c.rowid and "
+	                           "a.operation = c.operation and a.phy_first between c.phy_first and c.phy_last;",
+	                       1)[0][0] == static_cast<std::int64_t>(accesses.size()));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_columnar_remove_last)
+{
+	auto accesses = trace_accesses();
+	auto last = accesses.back().transition_id;
+
+	auto reference_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, trace_options());
+	reference_writer.push(accesses.data(), accesses.size());
+	reference_writer.discard_after(last);
+	auto reference = std::move(reference_writer).take();
+
+	TemporaryFile file("test_db_writer_columnar_remove_last.rvnmh");
+	auto writer = DbWriter::columnar(file.name, test_tool_name, test_tool_version, test_tool_info, trace_options());
+	writer.push(accesses.data(), accesses.size());
+	writer.discard_after(last);
+	std::move(writer).finish();
+
+	auto db = columnar_to_sqlite(file.name, ":memory:");
+	BOOST_CHECK_EQUAL(table_rows(db, "select count(*) from accesses;", 1)[0][0], accesses.size() - 2);
+	check_same_content(db, reference);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_columnar_invalid)
+{
+	TemporaryFile file("test_db_writer_columnar_invalid.rvnmh");
+	BOOST_CHECK_THROW(columnar_to_sqlite(file.name, ":memory:"), std::runtime_error);
+
+	auto accesses = trace_accesses();
+	auto writer = DbWriter::columnar(file.name, test_tool_name, test_tool_version, test_tool_info, trace_options());
+	writer.push(accesses.data(), accesses.size());
+
+	// Not finished yet
+	BOOST_CHECK_THROW(columnar_to_sqlite(file.name, ":memory:"), std::runtime_error);
+	std::move(writer).finish();
+	columnar_to_sqlite(file.name, ":memory:");
+
+	// Truncated
+	std::ifstream input(file.name, std::ios::binary);
+	std::vector<char> content((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+	input.close();
+	std::ofstream(file.name, std::ios::binary).write(content.data(), static_cast<std::streamsize>(content.size() - 1));
+	BOOST_CHECK_THROW(columnar_to_sqlite(file.name, ":memory:"), std::runtime_error);
+}
@@ -0,0 +1,161 @@
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+#include <sqlite3.h>
+
+#include <db_writer.h>
+
+#include "compact_accesses.h"
+#include "sqlite_sink.h"
+
+using namespace reven::backend::memaccess::db;
+
+namespace {
+
+constexpr const char* test_tool_name = "TestCompactAccesses";
+constexpr const char* test_tool_version = "1.0.0";
+constexpr const char* test_tool_info = "TestCompactAccesses info";
+
+using AccessTuple = std::tuple<std::uint64_t, std::uint64_t, std::uint64_t, std::uint32_t, bool, std::uint8_t>;
+
+AccessTuple as_tuple(const MemoryAccess& access)
+{
+	return AccessTuple{ access.transition_id, access.physical_address,
+	                    access.has_virtual_address ? access.virtual_address : 0, access.size,
+	                    access.has_virtual_address, static_cast<std::uint8_t>(access.operation) };
+}
+
+// All accesses of a compact database, decoded, sorted
+std::vector<AccessTuple> decode_database(reven::sqlite::Database& db)
+{
+	sqlite3_stmt* stmt = nullptr;
+	BOOST_REQUIRE(sqlite3_prepare_v2(db.get(),
+	                                 "select c.phy_first, c.operation, s.transition_first, c.accesses from chunks c "
+	                                 "join slices s on c.slice_id = s.rowid;",
+	                                 -1, &stmt, nullptr) == SQLITE_OK);
+
+	std::vector<AccessTuple> result;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		auto chunk_first = static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 0));
+		auto operation = static_cast<std::uint8_t>(sqlite3_column_int(stmt, 1));
+		auto accesses = compact::decode_accesses(static_cast<const std::uint8_t*>(sqlite3_column_blob(stmt, 3)),
+		                                         static_cast<std::size_t>(sqlite3_column_bytes(stmt, 3)), chunk_first,
+		                                         static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 2)));
+		for (const auto& a : accesses) {
+			result.emplace_back(a.transition, a.physical_address, a.linear_address, a.size, a.has_linear_address,
+			                    operation);
+		}
+	}
+	sqlite3_finalize(stmt);
+
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+std::uint64_t query(reven::sqlite::Database& db, const char* sql)
+{
+	reven::sqlite::Statement stmt(db, sql);
+	BOOST_REQUIRE(stmt.step() == reven::sqlite::Statement::StepResult::Row);
+	return static_cast<std::uint64_t>(stmt.column_i64(0));
+}
+
+std::vector<MemoryAccess> test_accesses()
+{
+	return {
+		MemoryAccess{ 0, 0x1000, 0xffff0000, 8, true, Operation::Write },
+		MemoryAccess{ 0, 0x1004, 0xffff0004, 8, true, Operation::Read },
+		MemoryAccess{ 1, 0x2000, 0, 4, false, Operation::Write },
+		MemoryAccess{ 2, 0x1008, 0x7fff1008, 8, true, Operation::Write },
+		MemoryAccess{ 3, 0x0ff8, 0xffff0ff8, 16, true, Operation::Write }, // merges the chunk at 0x1000
+		MemoryAccess{ 4, 0x1004, 0xffff0004, 2, true, Operation::Read },
+		MemoryAccess{ 5, 0x2002, 0, 1, false, Operation::Write },
+		MemoryAccess{ 6, 0x5000, 0x5000, 4, true, Operation::Read },
+	};
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_compact_codec)
+{
+	std::vector<std::uint8_t> blob;
+	compact::AccessEncoder encoder(blob, 3, 0x1000, 100);
+	encoder.add(100, 0x1000, 0x1010, true, 8);
+	encoder.add(102, 0x1010, 0, false, 4);
+	encoder.add(102, 0x1004, 0x1004, true, 1);
+
+	auto accesses = compact::decode_accesses(blob.data(), blob.size(), 0x1000, 100);
+	BOOST_REQUIRE_EQUAL(accesses.size(), 3);
+	BOOST_CHECK_EQUAL(accesses[0].linear_address, 0x1010);
+	BOOST_CHECK_EQUAL(accesses[0].size, 8);
+	BOOST_CHECK_EQUAL(accesses[1].transition, 102);
+	BOOST_CHECK(not accesses[1].has_linear_address);
+	BOOST_CHECK_EQUAL(accesses[2].physical_address, 0x1004);
+	BOOST_CHECK_EQUAL(accesses[2].linear_address, 0x1004);
+	BOOST_CHECK_EQUAL(accesses[2].size, 1);
+
+	// Small: one byte per value here
+	BOOST_CHECK_EQUAL(blob.size(), 1 + 3 * 4);
+
+	BOOST_CHECK_THROW(compact::decode_accesses(blob.data(), blob.size() - 1, 0x1000, 100), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_compact_database)
+{
+	auto accesses = test_accesses();
+
+	for (std::size_t bulk_insert_rows : { 1, 16 }) {
+		DbWriterOptions options;
+		options.compact_accesses = true;
+		options.bulk_insert_rows = bulk_insert_rows;
+		options.write_slice_limits.access_count_limit = 2;
+
+		auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+		writer.push(accesses.data(), accesses.size());
+		auto db = std::move(writer).take();
+
+		BOOST_CHECK_EQUAL(query(db, "select count(*) from sqlite_master where name = 'accesses';"), 0);
+		BOOST_CHECK_EQUAL(query(db, "select count(*) from sqlite_master where type = 'index';"), 2);
+		BOOST_CHECK(query(db, "select count(*) from slices;") > 1);
+
+		std::vector<AccessTuple> expected;
+		for (const auto& a : accesses)
+			expected.push_back(as_tuple(a));
+		std::sort(expected.begin(), expected.end());
+		BOOST_CHECK(decode_database(db) == expected);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_compact_remove_last)
+{
+	auto accesses = test_accesses();
+
+	DbWriterOptions options;
+	options.compact_accesses = true;
+	options.deferred_indexes = true;
+	options.write_slice_limits.access_count_limit = 2;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+	// Written slices are affected
+	writer.discard_after(1);
+	auto db = std::move(writer).take();
+
+	std::vector<AccessTuple> expected = { as_tuple(accesses[0]), as_tuple(accesses[1]) };
+	std::sort(expected.begin(), expected.end());
+	BOOST_CHECK(decode_database(db) == expected);
+	BOOST_CHECK_EQUAL(query(db, "select count(*) from sqlite_master where type = 'index';"), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_compact_rows)
+{
+	DbWriterOptions options;
+	options.compact_accesses = true;
+	SqliteSink sink(":memory:", test_tool_name, test_tool_version, test_tool_info, options);
+
+	// Rows of the default schema cannot be inserted
+	BOOST_CHECK_THROW(sink.insert_access_rows(0, [](std::size_t) { return SqliteSink::AccessRow{}; }),
+	                  std::logic_error);
+}
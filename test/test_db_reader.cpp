@@ -0,0 +1,285 @@
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <tuple>
+#include <vector>
+
+#include <db_reader.h>
+#include <db_writer.h>
+
+using namespace reven::backend::memaccess::db;
+
+namespace {
+
+constexpr const char* test_tool_name = "TestDbReader";
+constexpr const char* test_tool_version = "1.0.0";
+constexpr const char* test_tool_info = "TestDbReader info";
+
+using AccessTuple = std::tuple<std::uint64_t, std::uint64_t, std::uint64_t, std::uint32_t, bool, std::uint8_t>;
+
+AccessTuple as_tuple(const MemoryAccess& access)
+{
+	return AccessTuple{ access.transition_id, access.physical_address,
+	                    access.has_virtual_address ? access.virtual_address : 0, access.size,
+	                    access.has_virtual_address, static_cast<std::uint8_t>(access.operation) };
+}
+
+std::vector<AccessTuple> as_tuples(const std::vector<MemoryAccess>& accesses)
+{
+	std::vector<AccessTuple> result;
+	for (const auto& a : accesses)
+		result.push_back(as_tuple(a));
+	return result;
+}
+
+// Accesses on a few pages, on every other transition, `per_transition` at a time
+std::vector<MemoryAccess> test_accesses(std::size_t count, std::size_t per_transition)
+{
+	std::vector<MemoryAccess> accesses;
+	std::uint64_t state = 42;
+	for (std::size_t i = 0; i < count; ++i) {
+		state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+		auto address = 0x1000 + ((state >> 33) % 0x400);
+		auto size = static_cast<std::uint32_t>(1 << ((state >> 20) % 4));
+		auto operation = (state >> 40) % 3 ? Operation::Read : Operation::Write;
+		bool has_virtual = (state >> 50) % 2;
+		accesses.push_back(MemoryAccess{ 2 * (i / per_transition), address, has_virtual ? address + 0x7000 : 0, size,
+		                                 has_virtual, operation });
+	}
+	return accesses;
+}
+
+// What a half-axis query should return, by looking at all accesses
+std::vector<AccessTuple> expected_results(const std::vector<MemoryAccess>& accesses, const HalfAxisQuery& query,
+                                          bool forward)
+{
+	std::vector<AccessTuple> result;
+	auto matches = [&query, forward](const MemoryAccess& a) {
+		bool operation = a.operation == Operation::Read ? query.reads : query.writes;
+		bool transition = forward ? a.transition_id >= query.transition : a.transition_id <= query.transition;
+		return operation and transition and a.physical_address <= query.address_last and
+		       a.physical_address + a.size - 1 >= query.address_first;
+	};
+
+	if (forward) {
+		for (auto it = accesses.begin(); it != accesses.end() and result.size() < query.max_results; ++it) {
+			if (matches(*it))
+				result.push_back(as_tuple(*it));
+		}
+	} else {
+		for (auto it = accesses.rbegin(); it != accesses.rend() and result.size() < query.max_results; ++it) {
+			if (matches(*it))
+				result.push_back(as_tuple(*it));
+		}
+	}
+	return result;
+}
+
+DbWriterOptions small_slices(bool compact)
+{
+	DbWriterOptions options;
+	options.compact_accesses = compact;
+	options.read_slice_limits.access_count_limit = 100;
+	options.write_slice_limits.access_count_limit = 100;
+	return options;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_reader_half_axis)
+{
+	// Accesses of a transition are returned in their order of appearance with the default schema, but only known per
+	// chunk with the compact one: it gets a single access per transition.
+	for (bool compact : { false, true }) {
+		auto accesses = test_accesses(2000, compact ? 1 : 3);
+
+		for (std::size_t cache_size : { 0, 2, 1024 }) {
+			auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info,
+			                                    small_slices(compact));
+			writer.push(accesses.data(), accesses.size());
+
+			DbReaderOptions options;
+			options.chunk_cache_size = cache_size;
+			DbReader reader(std::move(writer).take(), options);
+			BOOST_CHECK(reader.slice_count() > 10);
+			BOOST_CHECK(reader.chunk_count() > reader.slice_count());
+
+			std::uint64_t state = 7;
+			auto next_random = [&state](std::uint64_t bound) {
+				state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+				return (state >> 33) % bound;
+			};
+			for (int i = 0; i < 300; ++i) {
+				HalfAxisQuery query;
+				// Beyond the last transition too
+				query.transition = next_random(2 * accesses.back().transition_id + 10);
+				query.address_first = 0x1000 + next_random(0x400);
+				query.address_last = query.address_first + next_random(0x40);
+				query.reads = i % 3 != 1;
+				query.writes = i % 3 != 2;
+				query.max_results = 1 + next_random(20);
+
+				BOOST_CHECK(as_tuples(reader.next(query)) == expected_results(accesses, query, true));
+				BOOST_CHECK(as_tuples(reader.previous(query)) == expected_results(accesses, query, false));
+			}
+
+			// Whole address space
+			HalfAxisQuery query;
+			query.transition = accesses.back().transition_id;
+			query.max_results = 50;
+			BOOST_CHECK(as_tuples(reader.previous(query)) == expected_results(accesses, query, false));
+
+			auto stats = reader.stats();
+			BOOST_CHECK_EQUAL(stats.queries, 601);
+			BOOST_CHECK(stats.chunks > 0);
+			if (cache_size == 0)
+				BOOST_CHECK_EQUAL(stats.cache_hits, 0);
+			if (cache_size == 1024)
+				BOOST_CHECK(stats.cache_hits > 0);
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_reader_shared_boundaries)
+{
+	// Slices are cut within transitions, so neighbours share their boundary transition
+	auto path = std::string("test_db_writer_reader_shared.sqlite");
+	std::remove(path.c_str());
+	{
+		auto accesses = test_accesses(3000, 3);
+		DbWriter writer(path.c_str(), test_tool_name, test_tool_version, test_tool_info, small_slices(false));
+		writer.push(accesses.data(), accesses.size());
+	}
+
+	auto db = reven::sqlite::ResourceDatabase::open(path.c_str(), true);
+	std::vector<std::uint64_t> boundaries;
+	{
+		reven::sqlite::Statement stmt(db, "select a.transition_last from slices a join slices b on b.rowid = a.rowid + 1 "
+		                           "where a.transition_last = b.transition_first;");
+		while (stmt.step() == reven::sqlite::Statement::StepResult::Row)
+			boundaries.push_back(static_cast<std::uint64_t>(stmt.column_i64(0)));
+	}
+	BOOST_REQUIRE(not boundaries.empty());
+
+	// Brute force: all accesses, in order of appearance
+	auto scan = [&db](const HalfAxisQuery& query, bool forward) {
+		std::string sql = "select a.transition, a.phy_first, ifnull(a.linear, 0), a.size, a.linear is not null, "
+		                  "c.operation from accesses a join chunks c on c.rowid = a.chunk_id where a.transition ";
+		sql += forward ? ">= ?1" : "<= ?1";
+		sql += " and a.phy_first <= ?2 and a.phy_first + a.size > ?3 order by a.transition";
+		sql += forward ? ", a.rowid" : " desc, a.rowid desc";
+		sql += " limit ?4;";
+		reven::sqlite::Statement stmt(db, sql.c_str());
+		stmt.bind_arg_cast(1, query.transition, "transition");
+		stmt.bind_arg_cast(2, query.address_last, "address_last");
+		stmt.bind_arg_cast(3, query.address_first, "address_first");
+		stmt.bind_arg_cast(4, query.max_results, "limit");
+		std::vector<AccessTuple> result;
+		while (stmt.step() == reven::sqlite::Statement::StepResult::Row) {
+			result.push_back(AccessTuple{ static_cast<std::uint64_t>(stmt.column_i64(0)),
+			                              static_cast<std::uint64_t>(stmt.column_i64(1)),
+			                              static_cast<std::uint64_t>(stmt.column_i64(2)),
+			                              static_cast<std::uint32_t>(stmt.column_i64(3)), stmt.column_i64(4) != 0,
+			                              static_cast<std::uint8_t>(stmt.column_i64(5)) });
+		}
+		return result;
+	};
+
+	for (std::size_t cache_size : { 0, 1024 }) {
+		DbReaderOptions options;
+		options.chunk_cache_size = cache_size;
+		DbReader reader(path.c_str(), options);
+
+		for (auto transition : boundaries) {
+			for (std::uint64_t first : { 0x1000, 0x1100, 0x1200, 0x1300 }) {
+				HalfAxisQuery query;
+				query.transition = transition;
+				query.address_first = first;
+				query.address_last = first + 0xff;
+				query.max_results = 5;
+				BOOST_CHECK(as_tuples(reader.next(query)) == scan(query, true));
+				BOOST_CHECK(as_tuples(reader.previous(query)) == scan(query, false));
+			}
+
+			// Everything at the boundary, from both slices
+			HalfAxisQuery query;
+			query.transition = transition;
+			query.address_first = 0;
+			query.address_last = 0xffff;
+			query.max_results = 6;
+			BOOST_CHECK(as_tuples(reader.next(query)) == scan(query, true));
+			BOOST_CHECK(as_tuples(reader.previous(query)) == scan(query, false));
+		}
+	}
+
+	std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_reader_edge_cases)
+{
+	std::vector<MemoryAccess> accesses = {
+		MemoryAccess{ 10, 0x1000, 0, 8, false, Operation::Write },
+		MemoryAccess{ 12, 0x1004, 0x2004, 4, true, Operation::Read },
+		MemoryAccess{ 20, 0xfff8, 0, 8, false, Operation::Write },
+	};
+
+	auto path = std::string("test_db_writer_reader.sqlite");
+	std::remove(path.c_str());
+	{
+		DbWriter writer(path.c_str(), test_tool_name, test_tool_version, test_tool_info);
+		writer.push(accesses.data(), accesses.size());
+	}
+
+	DbReader reader(path.c_str());
+	BOOST_CHECK_EQUAL(reader.slice_count(), 1);
+	BOOST_CHECK(reader.memory_usage() > 0);
+
+	HalfAxisQuery query;
+	query.max_results = 10;
+
+	// Before, within and after the slice
+	query.transition = 0;
+	BOOST_CHECK_EQUAL(reader.next(query).size(), 3);
+	BOOST_CHECK_EQUAL(reader.previous(query).size(), 0);
+	query.transition = 15;
+	BOOST_CHECK_EQUAL(reader.next(query).size(), 1);
+	BOOST_CHECK_EQUAL(reader.previous(query).size(), 2);
+	query.transition = 100;
+	BOOST_CHECK_EQUAL(reader.next(query).size(), 0);
+	auto previous = reader.previous(query);
+	BOOST_REQUIRE_EQUAL(previous.size(), 3);
+	BOOST_CHECK_EQUAL(previous[0].transition_id, 20);
+	BOOST_CHECK_EQUAL(previous[1].virtual_address, 0x2004);
+	BOOST_CHECK(previous[1].has_virtual_address);
+	BOOST_CHECK(previous[1].operation == Operation::Read);
+
+	// An access touching the last address of the range
+	query.transition = 0;
+	query.address_first = 0;
+	query.address_last = 0x1000;
+	BOOST_CHECK_EQUAL(reader.next(query).size(), 1);
+	query.address_first = 0x1008;
+	query.address_last = 0x1008;
+	BOOST_CHECK_EQUAL(reader.next(query).size(), 0);
+
+	// Nothing to look for
+	query.address_first = 0;
+	query.address_last = 0xffff;
+	query.reads = false;
+	query.writes = false;
+	BOOST_CHECK_EQUAL(reader.next(query).size(), 0);
+	query.writes = true;
+	query.max_results = 0;
+	BOOST_CHECK_EQUAL(reader.next(query).size(), 0);
+
+	std::remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_reader_not_a_database)
+{
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	auto db = std::move(writer).take();
+	db.exec("drop table chunks;", "Can't drop chunks");
+	BOOST_CHECK_THROW(DbReader reader(std::move(db)), std::runtime_error);
+}
@@ -4,10 +4,19 @@
 #include <set>
 #include <limits>
 #include <algorithm>
+#include <list>
+#include <thread>
+#include <chrono>
 #include <iostream>
+#include <cstdio>
+
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <db_writer.h>
 
+#include "null_sink.h"
+
 using namespace reven::backend::memaccess::db;
 using Db = reven::sqlite::Database;
 using Stmt = reven::sqlite::Statement;
@@ -184,3 +193,860 @@ BOOST_AUTO_TEST_CASE(test_db_writer_slices_ordering)
 		ss.clear();
 	}
 }
+
+BOOST_AUTO_TEST_CASE(test_db_writer_async_flush)
+{
+	DbWriterOptions options;
+	options.async_flush_queue_depth = 1;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	for (const auto& a : accesses)
+		writer.push(a);
+
+	// Moving the writer must not lose pending work
+	auto moved_writer = std::move(writer);
+
+	auto db = std::move(moved_writer).take();
+	BOOST_CHECK_EQUAL(slice_count(db), 1);
+	BOOST_CHECK_EQUAL(chunk_count(db), 6);
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size());
+
+	for (const auto& a : accesses)
+		BOOST_CHECK(is_access_present(db, a));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_async_flush_remove_last)
+{
+	DbWriterOptions options;
+	options.async_flush_queue_depth = 2;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	for (const auto& a : accesses)
+		writer.push(a);
+	writer.push(MemoryAccess{ 7, 200, 6666, 10, true, Operation::Write });
+	writer.discard_after(7);
+
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size() - 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_parallel_slice_building)
+{
+	DbWriterOptions options;
+	options.parallel_slice_building = true;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+
+	auto moved_writer = std::move(writer);
+
+	auto db = std::move(moved_writer).take();
+	BOOST_CHECK_EQUAL(slice_count(db), 1);
+	BOOST_CHECK_EQUAL(chunk_count(db), 6);
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size());
+	BOOST_CHECK(is_non_empty_and_ordered(db, "select transition from accesses order by rowid;"));
+
+	for (const auto& a : accesses)
+		BOOST_CHECK(is_access_present(db, a));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_parallel_slice_building_invalid)
+{
+	DbWriterOptions options;
+	options.parallel_slice_building = true;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	BOOST_CHECK_THROW(writer.push(MemoryAccess{ 0, 10, 6666, 0, true, Operation::Write }), std::invalid_argument);
+
+	// Reported when the slices are built
+	writer.push(MemoryAccess{ 5, 10, 6666, 10, true, Operation::Write });
+	writer.push(MemoryAccess{ 4, 10, 6666, 10, true, Operation::Write });
+	BOOST_CHECK_THROW(std::move(writer).take(), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_parallel_slice_building_push_after_error)
+{
+	DbWriterOptions options;
+	options.parallel_slice_building = true;
+
+	// The error is reported by a push that cuts slices once the worker raised it, or by a discard, which always does
+	for (bool by_push : { false, true }) {
+		auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+		writer.push(MemoryAccess{ 5, 10, 6666, 10, true, Operation::Write });
+		writer.push(MemoryAccess{ 4, 10, 6666, 10, true, Operation::Write });
+		if (by_push) {
+			bool thrown = false;
+			for (std::uint64_t transition = 6; transition < 1000 and not thrown; ++transition) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				try {
+					writer.push(MemoryAccess{ transition, 10, 6666, 10, true, Operation::Write });
+				} catch (const std::invalid_argument&) {
+					thrown = true;
+				}
+			}
+			BOOST_REQUIRE(thrown);
+		} else {
+			BOOST_CHECK_THROW(writer.discard_after(4), std::invalid_argument);
+		}
+
+		// Reported again, whatever is called next
+		BOOST_CHECK_THROW(writer.push(MemoryAccess{ 2000, 10, 6666, 10, true, Operation::Read }), std::invalid_argument);
+		BOOST_CHECK_THROW(writer.discard_after(4), std::invalid_argument);
+		if (by_push)
+			BOOST_CHECK_THROW(std::move(writer).take(), std::invalid_argument);
+		else
+			BOOST_CHECK_THROW(std::move(writer).finish(), std::invalid_argument);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_limits_access_count)
+{
+	DbWriterOptions options;
+	options.write_slice_limits.access_count_limit = 2;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+
+	// Writes are cut after 2 accesses, but reads are not limited
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(slice_count(db), 2);
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select transition_last from slices where rowid = 1;"), 1);
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select transition_first from slices where rowid = 2;"), 2);
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_limits_transition)
+{
+	DbWriterOptions options;
+	options.read_slice_limits.transition_limit = 2;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+
+	// Reads span transitions 4 to 7
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(slice_count(db), 2);
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select transition_last from slices where rowid = 1;"), 5);
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select transition_first from slices where rowid = 2;"), 6);
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_parallel_slice_building_cut)
+{
+	DbWriterOptions options;
+	options.parallel_slice_building = true;
+	options.write_slice_limits.access_count_limit = 5;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	constexpr std::uint64_t count = 40;
+	for (std::uint64_t i = 0; i < count; ++i) {
+		writer.push(MemoryAccess{ i, i * 100, 6666, 10, true, i % 2 ? Operation::Read : Operation::Write });
+		// Give the workers time to report limits
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	auto db = std::move(writer).take();
+	BOOST_CHECK(slice_count(db) > 1);
+	BOOST_CHECK_EQUAL(access_count(db), count);
+
+	// Slices are cut on transition boundaries
+	auto firsts = sqlite_results(db, "select transition_first from slices order by rowid;");
+	auto lasts = sqlite_results(db, "select transition_last from slices order by rowid;");
+	for (std::size_t i = 1; i < firsts.size(); ++i)
+		BOOST_CHECK(lasts[i - 1] < firsts[i]);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_parallel_slice_building_same_cuts)
+{
+	// Access count and transition limits are checked before queuing, so slices match those of the sequential mode
+	std::vector<MemoryAccess> trace;
+	for (std::uint64_t i = 0; i < 400000; ++i) {
+		auto operation = i % 3 ? Operation::Read : Operation::Write;
+		trace.push_back(MemoryAccess{ i / 4, 0x1000 + (i * 40503) % 0x10000, 6666, 8, true, operation });
+	}
+
+	for (std::uint64_t transition_limit : { 0, 150 }) {
+		std::vector<std::uint64_t> firsts, lasts, counts;
+		DbWriterStats stats[2];
+		for (bool parallel : { false, true }) {
+			DbWriterOptions options;
+			options.parallel_slice_building = parallel;
+			options.read_slice_limits.access_count_limit = 700;
+			options.write_slice_limits.transition_limit = transition_limit;
+
+			auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+			writer.push(trace.data(), trace.size());
+			stats[parallel] = writer.stats();
+			auto db = std::move(writer).take();
+			BOOST_CHECK_EQUAL(access_count(db), trace.size());
+
+			auto slice_firsts = sqlite_results(db, "select transition_first from slices order by rowid;");
+			auto slice_lasts = sqlite_results(db, "select transition_last from slices order by rowid;");
+			auto slice_counts = sqlite_results(db, "select count(*) from accesses a join chunks c on c.rowid = "
+			                                       "a.chunk_id group by c.slice_id order by c.slice_id;");
+			if (not parallel) {
+				BOOST_CHECK(slice_firsts.size() > 300);
+				firsts = slice_firsts;
+				lasts = slice_lasts;
+				counts = slice_counts;
+			} else {
+				BOOST_CHECK(slice_firsts == firsts);
+				BOOST_CHECK(slice_lasts == lasts);
+				BOOST_CHECK(slice_counts == counts);
+			}
+		}
+		BOOST_CHECK_EQUAL(stats[0].slices, stats[1].slices);
+		BOOST_CHECK_EQUAL(stats[0].access_count_cuts, stats[1].access_count_cuts);
+		BOOST_CHECK_EQUAL(stats[0].transition_cuts, stats[1].transition_cuts);
+		BOOST_CHECK_EQUAL(stats[1].transition_cuts > 0, transition_limit != 0);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_memory_budget)
+{
+	DbWriterOptions options;
+	options.memory_budget = 1;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	BOOST_CHECK_EQUAL(writer.memory_usage(), 0);
+	writer.push(accesses[0]);
+	BOOST_CHECK(writer.memory_usage() > 0);
+	writer.push(accesses.data() + 1, accesses.size() - 1);
+
+	// Each transition immediately uses up the budget
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(slice_count(db), accesses.size());
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_memory_budget_small)
+{
+	std::vector<MemoryAccess> trace;
+	for (std::uint64_t i = 0; i < 20000; ++i) {
+		auto operation = i % 3 ? Operation::Read : Operation::Write;
+		trace.push_back(MemoryAccess{ i / 2, 0x1000 + (i * 40503) % 0x10000, 6666, 8, true, operation });
+	}
+
+	DbWriterOptions options;
+	options.memory_budget = 200000;
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	for (std::size_t i = 0; i < trace.size(); i += 100)
+		writer.push(trace.data() + i, 100);
+	auto stats = writer.stats();
+
+	// Slices use up the budget with their accesses, not with what is allocated ahead of them
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(access_count(db), trace.size());
+	BOOST_CHECK(slice_count(db) > 1);
+	BOOST_CHECK(slice_count(db) < 20);
+	BOOST_CHECK_EQUAL(stats.memory_budget_cuts, slice_count(db) - 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_batched_push)
+{
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	writer.push(accesses.data(), 3);
+	writer.push(accesses.data() + 3, 0);
+	writer.push(accesses.begin() + 3, accesses.begin() + 5);
+
+	// Non-contiguous range
+	std::list<MemoryAccess> list(accesses.begin() + 5, accesses.end());
+	writer.push(list.begin(), list.end());
+
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(slice_count(db), 1);
+	BOOST_CHECK_EQUAL(chunk_count(db), 6);
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size());
+	BOOST_CHECK(is_non_empty_and_ordered(db, "select transition from accesses order by rowid;"));
+
+	for (const auto& a : accesses)
+		BOOST_CHECK(is_access_present(db, a));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_batched_push_invalid)
+{
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	std::array<MemoryAccess, 2> invalid {{
+		MemoryAccess{ 0, 10, 6666, 10, true, Operation::Write },
+		MemoryAccess{ 1, 10, 6666, 10, true, Operation::Execute },
+	}};
+	BOOST_CHECK_THROW(writer.push(invalid.begin(), invalid.end()), std::runtime_error);
+}
+
+std::vector<std::vector<std::uint64_t>> table_rows(Db& db, const char* query, int columns)
+{
+	Stmt stmt(db, query);
+	std::vector<std::vector<std::uint64_t>> rows;
+
+	while (stmt.step() == Stmt::StepResult::Row) {
+		rows.emplace_back();
+		for (int i = 0; i < columns; ++i)
+			rows.back().push_back(stmt.column_i64(i));
+	}
+
+	return rows;
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_bulk_insert)
+{
+	auto reference_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	reference_writer.push(accesses.data(), accesses.size());
+	auto reference_db = std::move(reference_writer).take();
+
+	auto reference_chunks = table_rows(reference_db, "select rowid, * from chunks order by rowid;", 5);
+	auto reference_accesses = table_rows(reference_db, "select rowid, * from accesses order by rowid;", 7);
+
+	// Exercise bulk statements alone, with a remainder, and capped to sqlite's limit
+	for (std::size_t rows : { 2, 4, 5, 100000 }) {
+		DbWriterOptions options;
+		options.bulk_insert_rows = rows;
+
+		auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+		writer.push(accesses.data(), accesses.size());
+		auto db = std::move(writer).take();
+
+		BOOST_CHECK(table_rows(db, "select rowid, * from chunks order by rowid;", 5) == reference_chunks);
+		BOOST_CHECK(table_rows(db, "select rowid, * from accesses order by rowid;", 7) == reference_accesses);
+	}
+
+	DbWriterOptions invalid_options;
+	invalid_options.bulk_insert_rows = 0;
+	BOOST_CHECK_THROW(DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, invalid_options),
+	                  std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_push_columns)
+{
+	// Every other access without a virtual address
+	std::vector<MemoryAccess> mixed(accesses.begin(), accesses.end());
+	for (std::size_t i = 0; i < mixed.size(); i += 2) {
+		mixed[i].has_virtual_address = false;
+		mixed[i].virtual_address = 0;
+	}
+
+	std::vector<std::uint64_t> transitions, physical_addresses, virtual_addresses;
+	std::vector<std::uint8_t> has_virtual_addresses;
+	std::vector<std::uint32_t> sizes;
+	std::vector<Operation> operations;
+	for (const auto& a : mixed) {
+		transitions.push_back(a.transition_id);
+		physical_addresses.push_back(a.physical_address);
+		virtual_addresses.push_back(a.virtual_address);
+		has_virtual_addresses.push_back(a.has_virtual_address);
+		sizes.push_back(a.size);
+		operations.push_back(a.operation);
+	}
+
+	for (bool parallel : { false, true }) {
+		DbWriterOptions options;
+		options.parallel_slice_building = parallel;
+
+		auto reference_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+		reference_writer.push(mixed.data(), mixed.size());
+		auto reference_db = std::move(reference_writer).take();
+
+		// Pushed in two parts
+		AccessColumns columns;
+		columns.count = 5;
+		columns.transition_ids = transitions.data();
+		columns.physical_addresses = physical_addresses.data();
+		columns.virtual_addresses = virtual_addresses.data();
+		columns.has_virtual_addresses = has_virtual_addresses.data();
+		columns.sizes = sizes.data();
+		columns.operations = operations.data();
+
+		std::size_t released = 0;
+		auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+		writer.push(columns, [&released]() { ++released; });
+		BOOST_CHECK_EQUAL(released, 1);
+
+		columns.count = mixed.size() - 5;
+		columns.transition_ids += 5;
+		columns.physical_addresses += 5;
+		columns.virtual_addresses += 5;
+		columns.has_virtual_addresses += 5;
+		columns.sizes += 5;
+		columns.operations += 5;
+		writer.push(columns);
+		auto db = std::move(writer).take();
+
+		const char* query = "select rowid, * from accesses order by rowid;";
+		BOOST_CHECK(table_rows(db, query, 7) == table_rows(reference_db, query, 7));
+		BOOST_CHECK(sqlite_results_is_null(db, "select linear from accesses order by rowid;") ==
+		            sqlite_results_is_null(reference_db, "select linear from accesses order by rowid;"));
+	}
+
+	// Without virtual addresses at all
+	AccessColumns columns;
+	columns.count = transitions.size();
+	columns.transition_ids = transitions.data();
+	columns.physical_addresses = physical_addresses.data();
+	columns.sizes = sizes.data();
+	columns.operations = operations.data();
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	writer.push(columns);
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select count(*) from accesses where linear is null;"), transitions.size());
+
+	// Missing columns, which still releases the buffers
+	std::size_t released = 0;
+	columns.sizes = nullptr;
+	auto invalid_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	BOOST_CHECK_THROW(invalid_writer.push(columns, [&released]() { ++released; }), std::invalid_argument);
+	BOOST_CHECK_EQUAL(released, 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_push_columns_fixed_size)
+{
+	std::vector<MemoryAccess> sized;
+	for (const auto& a : accesses) {
+		sized.push_back(a);
+		sized.back().size = 8;
+		sized.back().has_virtual_address = false;
+		sized.back().virtual_address = 0;
+	}
+
+	std::vector<std::uint64_t> transitions, physical_addresses;
+	std::vector<Operation> operations;
+	for (const auto& a : sized) {
+		transitions.push_back(a.transition_id);
+		physical_addresses.push_back(a.physical_address);
+		operations.push_back(a.operation);
+	}
+
+	AccessColumns columns;
+	columns.count = sized.size();
+	columns.transition_ids = transitions.data();
+	columns.physical_addresses = physical_addresses.data();
+	columns.operations = operations.data();
+
+	const char* query = "select rowid, * from accesses order by rowid;";
+	// Sizes known at compile time or not, with all combinations of checks in the builders
+	for (std::uint32_t size : { 8, 3 }) {
+		for (auto& a : sized)
+			a.size = size;
+		columns.size = size;
+
+		for (int checks = 0; checks < 4; ++checks) {
+			DbWriterOptions options;
+			options.unchecked_accesses = checks & 1;
+			if (checks & 2) {
+				for (auto* limits : { &options.read_slice_limits, &options.write_slice_limits }) {
+					limits->chunk_size_overlap_limit = 0;
+					limits->access_count_limit = 0;
+				}
+			}
+
+			auto reference_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+			reference_writer.push(sized.data(), sized.size());
+			auto reference_db = std::move(reference_writer).take();
+
+			auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+			writer.push(columns);
+			auto db = std::move(writer).take();
+			BOOST_CHECK(table_rows(db, query, 7) == table_rows(reference_db, query, 7));
+		}
+	}
+
+	// Neither sizes nor a size
+	columns.size = 0;
+	auto invalid_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	BOOST_CHECK_THROW(invalid_writer.push(columns), std::invalid_argument);
+
+	// Checks still apply without limits
+	columns.size = 8;
+	transitions[1] = 0;
+	transitions[0] = 1;
+	DbWriterOptions options;
+	options.read_slice_limits = SliceLimits{ 0, 0, 0, 0, 0 };
+	options.write_slice_limits = options.read_slice_limits;
+	auto backward_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	BOOST_CHECK_THROW(backward_writer.push(columns), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_incremental_flush)
+{
+	// Many small slices, with accesses pushed one by one
+	std::vector<MemoryAccess> many;
+	for (std::uint64_t i = 0; i < 200; ++i) {
+		many.push_back(MemoryAccess{ i, 0x1000 + (i % 50) * 16, 0, 8, false,
+		                             i % 3 ? Operation::Read : Operation::Write });
+	}
+
+	for (bool compact : { false, true }) {
+		DbWriterOptions options;
+		options.compact_accesses = compact;
+		options.bulk_insert_rows = 4;
+		options.read_slice_limits.access_count_limit = 30;
+		options.write_slice_limits.access_count_limit = 30;
+
+		auto reference_writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+		for (const auto& a : many)
+			reference_writer.push(a);
+		auto reference_db = std::move(reference_writer).take();
+
+		const char* chunks_query = "select rowid, slice_id, phy_first, phy_last, operation from chunks order by rowid;";
+		const char* accesses_query = compact ? "select rowid, length(accesses) from chunks order by rowid;"
+		                                     : "select rowid, * from accesses order by rowid;";
+		int access_columns = compact ? 2 : 7;
+		for (std::size_t rows : { 1, 5, 1000 }) {
+			options.incremental_flush_rows = rows;
+			auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+			for (const auto& a : many)
+				writer.push(a);
+			BOOST_CHECK(writer.stats().slices > 0);
+			auto db = std::move(writer).take();
+
+			BOOST_CHECK(table_rows(db, "select rowid, * from slices;", 3) ==
+			            table_rows(reference_db, "select rowid, * from slices;", 3));
+			BOOST_CHECK(table_rows(db, chunks_query, 5) == table_rows(reference_db, chunks_query, 5));
+			BOOST_CHECK(table_rows(db, accesses_query, access_columns) ==
+			            table_rows(reference_db, accesses_query, access_columns));
+		}
+	}
+
+	// Slices are written over the next pushes, and completed before discarding accesses
+	DbWriterOptions options;
+	options.write_slice_limits.access_count_limit = 2;
+	options.incremental_flush_rows = 1;
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+	BOOST_CHECK_EQUAL(writer.stats().slices, 0);
+	writer.push(MemoryAccess{ 8, 0x5000, 0, 4, false, Operation::Read });
+	BOOST_CHECK_EQUAL(writer.stats().slices, 0);
+	writer.discard_after(1);
+	BOOST_CHECK_EQUAL(writer.stats().slices, 1);
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(slice_count(db), 1);
+	BOOST_CHECK_EQUAL(access_count(db), 1);
+}
+
+std::uint64_t index_count(Db& db)
+{
+	return sqlite_result(db, "select count(*) from sqlite_master where type = 'index' and name like 'idx_%';");
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_deferred_indexes)
+{
+	DbWriterOptions options;
+	options.deferred_indexes = true;
+	options.index_build_threads = 2;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(index_count(db), 4);
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size());
+	for (const auto& a : accesses)
+		BOOST_CHECK(is_access_present(db, a));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_deferred_indexes_remove_last)
+{
+	DbWriterOptions options;
+	options.deferred_indexes = true;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+	writer.push(MemoryAccess{ 7, 200, 6666, 10, true, Operation::Read });
+	writer.discard_after(7);
+
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(index_count(db), 4);
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size() - 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_storage_options)
+{
+	const char* filename = "test_db_writer_storage_options.sqlite";
+	std::remove(filename);
+
+	DbWriterOptions options;
+	options.page_size = 65536;
+	options.cache_size_kib = 64 << 10;
+	options.mmap_size = 1 << 20;
+	options.exclusive_locking = true;
+	options.no_journal = true;
+
+	{
+		DbWriter writer(filename, test_tool_name, test_tool_version, test_tool_info, options);
+		writer.push(accesses.data(), accesses.size());
+		writer.discard_after(7);
+
+		auto db = std::move(writer).take();
+		BOOST_CHECK_EQUAL(sqlite_result(db, "pragma page_size;"), 65536);
+		BOOST_CHECK_EQUAL(static_cast<std::int64_t>(sqlite_result(db, "pragma cache_size;")), -(64 << 10));
+		BOOST_CHECK_EQUAL(access_count(db), accesses.size() - 1);
+		BOOST_CHECK_EQUAL(index_count(db), 4);
+	}
+	std::remove(filename);
+
+	DbWriterOptions invalid_options;
+	for (std::size_t page_size : { 256, 1000, 131072 }) {
+		invalid_options.page_size = page_size;
+		BOOST_CHECK_THROW(DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, invalid_options),
+		                  std::invalid_argument);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_open_resume)
+{
+	const char* filename = "test_db_writer_open_resume.sqlite";
+	std::remove(filename);
+
+	DbWriterOptions options;
+	options.durable_slices = true;
+	options.deferred_indexes = true;
+	options.read_slice_limits.access_count_limit = 2;
+	options.write_slice_limits.access_count_limit = 2;
+
+	// Crash after writing the slices of transitions 0 and 1, while building the next ones
+	auto child = fork();
+	BOOST_REQUIRE(child >= 0);
+	if (child == 0) {
+		DbWriter writer(filename, test_tool_name, test_tool_version, test_tool_info, options);
+		writer.push(accesses.data(), 6);
+		_exit(0);
+	}
+	int status = 0;
+	BOOST_REQUIRE(waitpid(child, &status, 0) == child);
+	BOOST_REQUIRE(WIFEXITED(status));
+
+	{
+		auto writer = DbWriter::open_resume(filename, options);
+		BOOST_CHECK_EQUAL(writer.resume_transition(), 2);
+		BOOST_CHECK_THROW(writer.push(accesses[1]), std::invalid_argument);
+		writer.push(accesses.data() + 2, accesses.size() - 2);
+
+		// Indexes deferred by the crashed writer are built now
+		auto db = std::move(writer).take();
+		BOOST_CHECK_EQUAL(slice_count(db), 3);
+		BOOST_CHECK_EQUAL(index_count(db), 4);
+		BOOST_CHECK_EQUAL(access_count(db), accesses.size());
+		BOOST_CHECK(is_non_empty_and_ordered(db, "select transition from accesses order by rowid;"));
+		for (const auto& a : accesses)
+			BOOST_CHECK(is_access_present(db, a));
+		BOOST_CHECK_EQUAL(sqlite_result(db, "select count(*) from accesses a, chunks c where a.chunk_id = c.rowid and "
+		                                    "a.operation = c.operation and a.phy_first between c.phy_first and "
+		                                    "c.phy_last;"), accesses.size());
+	}
+
+	// Compact databases stay compact
+	std::remove(filename);
+	DbWriterOptions compact_options;
+	compact_options.compact_accesses = true;
+	{
+		DbWriter writer(filename, test_tool_name, test_tool_version, test_tool_info, compact_options);
+		writer.push(accesses.data(), 4);
+	}
+	{
+		auto writer = DbWriter::open_resume(filename);
+		BOOST_CHECK_EQUAL(writer.resume_transition(), 4);
+
+		// Reads and writes are only ordered within their slice: an earlier write after a read is rejected too
+		std::array<MemoryAccess, 2> unordered {{ MemoryAccess{ 10, 5000, 6666, 10, true, Operation::Read }, accesses[3] }};
+		BOOST_CHECK_THROW(writer.push(unordered.data(), unordered.size()), std::invalid_argument);
+		writer.discard_after(4);
+
+		writer.push(accesses.data() + 4, accesses.size() - 4);
+		auto db = std::move(writer).take();
+		BOOST_CHECK_EQUAL(sqlite_result(db, "select count(*) from sqlite_master where name = 'accesses';"), 0);
+		BOOST_CHECK_EQUAL(slice_count(db), 2);
+		BOOST_CHECK_EQUAL(chunk_count(db), 6);
+	}
+	std::remove(filename);
+
+	BOOST_CHECK_THROW(DbWriter::open_resume(filename), std::exception);
+
+	DbWriterOptions invalid_options;
+	invalid_options.durable_slices = true;
+	invalid_options.no_journal = true;
+	BOOST_CHECK_THROW(DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, invalid_options),
+	                  std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_null_sink)
+{
+	DbWriterOptions options;
+	options.write_slice_limits.access_count_limit = 2;
+
+	NullSink::Counts counts;
+	{
+		DbWriter writer(std::make_unique<NullSink>(&counts), options);
+		writer.push(accesses.data(), accesses.size());
+		BOOST_CHECK_THROW(std::move(writer).take(), std::logic_error);
+	}
+
+	BOOST_CHECK_EQUAL(counts.slices, 2);
+	BOOST_CHECK_EQUAL(counts.chunks, 6);
+	BOOST_CHECK_EQUAL(counts.accesses, accesses.size());
+}
+
+namespace {
+
+struct Recording {
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> slices;
+	std::vector<std::uint64_t> transitions;
+	std::vector<std::uint64_t> discarded_after;
+	int finish_count = 0;
+	bool fail_writes = false;
+};
+
+// Records what it receives
+struct RecordingSink : Sink {
+	explicit RecordingSink(Recording& recording) : recording(recording) {}
+
+	void write_slices(Slice& read_slice, Slice& write_slice, AccessJournal& journal) override
+	{
+		if (recording.fail_writes)
+			throw std::runtime_error("RecordingSink: write failed");
+		recording.slices.push_back(slice_transitions(read_slice, write_slice));
+		for (AccessJournal::Index i = 0; i < journal.size(); ++i)
+			recording.transitions.push_back(journal.transition(i));
+	}
+
+	void discard_after(std::uint64_t transition_count) override
+	{
+		recording.discarded_after.push_back(transition_count);
+	}
+
+	void finish() override { ++recording.finish_count; }
+
+	Recording& recording;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_custom_sink)
+{
+	DbWriterOptions options;
+	options.async_flush_queue_depth = 1;
+	options.write_slice_limits.access_count_limit = 2;
+
+	Recording recording;
+	DbWriter writer(std::make_unique<RecordingSink>(recording), options);
+	writer.push(accesses.data(), accesses.size());
+
+	// Only the open slice has accesses to discard: the sink is not involved
+	writer.discard_after(7);
+	BOOST_CHECK(recording.discarded_after.empty());
+
+	// The written slice has some
+	writer.discard_after(1);
+	BOOST_CHECK(recording.discarded_after == std::vector<std::uint64_t>{ 1 });
+	BOOST_CHECK_EQUAL(recording.finish_count, 0);
+
+	auto moved_writer = std::move(writer);
+	std::move(moved_writer).finish();
+	BOOST_CHECK_EQUAL(recording.finish_count, 1);
+
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> slices = { { 0, 1 } };
+	BOOST_CHECK(recording.slices == slices);
+	BOOST_CHECK_EQUAL(recording.transitions.size(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_custom_sink_failure)
+{
+	DbWriterOptions options;
+	options.async_flush_queue_depth = 1;
+	options.write_slice_limits.access_count_limit = 2;
+
+	// Reported by finish, dropped by the destructor
+	for (bool finish : { true, false }) {
+		Recording recording;
+		recording.fail_writes = true;
+		DbWriter writer(std::make_unique<RecordingSink>(recording), options);
+		writer.push(accesses.data(), accesses.size());
+		if (finish)
+			BOOST_CHECK_THROW(std::move(writer).finish(), std::runtime_error);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_remove_last_tightens_chunks)
+{
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	writer.push(MemoryAccess{ 0, 10, 6666, 10, true, Operation::Write });
+	writer.push(MemoryAccess{ 1, 15, 6666, 20, true, Operation::Write });
+	writer.push(MemoryAccess{ 1, 100, 6666, 10, true, Operation::Read });
+	writer.discard_after(1);
+
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(chunk_count(db), 1);
+	BOOST_CHECK_EQUAL(access_count(db), 1);
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select phy_last from chunks;"), 19);
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select transition_last from slices;"), 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_parallel_slice_building_remove_last)
+{
+	DbWriterOptions options;
+	options.parallel_slice_building = true;
+	options.write_slice_limits.access_count_limit = 2;
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+	writer.push(MemoryAccess{ 7, 200, 6666, 10, true, Operation::Write });
+	writer.discard_after(6);
+
+	auto db = std::move(writer).take();
+	BOOST_CHECK_EQUAL(access_count(db), accesses.size() - 2);
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select max(transition) from accesses;"), 5);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_stats)
+{
+	std::vector<DbWriterStats> reported;
+
+	DbWriterOptions options;
+	options.write_slice_limits.access_count_limit = 2;
+	options.stats_callback = [&reported](const DbWriterStats& stats) { reported.push_back(stats); };
+
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info, options);
+	writer.push(accesses.data(), accesses.size());
+
+	auto stats = writer.stats();
+	BOOST_CHECK_EQUAL(stats.read_accesses, 4);
+	BOOST_CHECK_EQUAL(stats.write_accesses, 4);
+	BOOST_CHECK_EQUAL(stats.slices, 1);
+	BOOST_CHECK_EQUAL(stats.chunks, 2);
+	BOOST_CHECK_EQUAL(stats.access_count_cuts, 1);
+	BOOST_CHECK_EQUAL(stats.final_cuts, 0);
+	BOOST_REQUIRE_EQUAL(reported.size(), 1);
+	BOOST_CHECK_EQUAL(reported[0].slices, 1);
+
+	// Discarded accesses still count as pushed
+	writer.discard_after(7);
+	BOOST_CHECK_EQUAL(writer.stats().read_accesses, 4);
+
+	auto db = std::move(writer).take();
+	BOOST_REQUIRE_EQUAL(reported.size(), 2);
+	stats = reported.back();
+	BOOST_CHECK_EQUAL(stats.slices, 2);
+	BOOST_CHECK_EQUAL(stats.chunks, chunk_count(db));
+	BOOST_CHECK_EQUAL(stats.final_cuts, 1);
+	BOOST_CHECK_EQUAL(stats.overlap_merges, 1);
+	BOOST_CHECK(stats.access_insert_time.count() > 0);
+	BOOST_CHECK(stats.commit_time.count() > 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_chunks_ascending)
+{
+	auto writer = DbWriter::from_memory(test_tool_name, test_tool_version, test_tool_info);
+	writer.push(MemoryAccess{ 0, 500, 6666, 10, true, Operation::Write });
+	writer.push(MemoryAccess{ 1, 100, 6666, 10, true, Operation::Read });
+	writer.push(MemoryAccess{ 2, 300, 6666, 10, true, Operation::Write });
+	writer.push(MemoryAccess{ 3, 300, 6666, 10, true, Operation::Read });
+	writer.push(MemoryAccess{ 4, 50, 6666, 10, true, Operation::Write });
+
+	auto db = std::move(writer).take();
+	BOOST_CHECK((sqlite_results(db, "select phy_first from chunks order by rowid;") ==
+	             std::vector<std::uint64_t>{ 50, 100, 300, 300, 500 }));
+	// Read chunks first on ties
+	BOOST_CHECK((sqlite_results(db, "select operation from chunks where phy_first = 300 order by rowid;") ==
+	             std::vector<std::uint64_t>{ 4, 2 }));
+	BOOST_CHECK_EQUAL(sqlite_result(db, "select count(*) from accesses a join chunks c on a.chunk_id = c.rowid "
+	                                    "where a.phy_first = c.phy_first and a.operation = c.operation;"),
+	                  5);
+}
@@ -0,0 +1,140 @@
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <multi_producer_writer.h>
+
+#include "sink.h"
+
+using namespace reven::backend::memaccess::db;
+
+namespace {
+
+// Records the transitions of the accesses it receives, in order
+struct TransitionSink : Sink {
+	explicit TransitionSink(std::vector<std::uint64_t>& transitions) : transitions(transitions) {}
+
+	void write_slices(Slice&, Slice&, AccessJournal& journal) override
+	{
+		for (AccessJournal::Index i = 0; i < journal.size(); ++i)
+			transitions.push_back(journal.transition(i));
+	}
+
+	void discard_after(std::uint64_t) override {}
+	void finish() override {}
+
+	std::vector<std::uint64_t>& transitions;
+};
+
+MemoryAccess access_at(std::uint64_t transition)
+{
+	return MemoryAccess{ transition, transition * 16, 6666, 8, true, Operation::Write };
+}
+
+// Push the transitions [first, last) of every `period` transitions starting at `offset`, as a replayed segment would
+void push_segments(MultiProducerWriter::Producer& producer, std::uint64_t offset, std::uint64_t period,
+                   std::uint64_t segment_length, std::uint64_t end)
+{
+	for (std::uint64_t first = offset; first < end; first += period) {
+		for (std::uint64_t transition = first; transition < first + segment_length; ++transition)
+			producer.push(access_at(transition));
+		// Nothing more until the next segment of this producer
+		producer.advance(first + period);
+	}
+	producer.close();
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_multi_producer_ordered)
+{
+	constexpr std::uint64_t producer_count = 3;
+	constexpr std::uint64_t segment_length = 1000;
+	constexpr std::uint64_t end = 60000;
+
+	std::vector<std::uint64_t> transitions;
+	MultiProducerWriter writer(DbWriter(std::make_unique<TransitionSink>(transitions)), producer_count);
+
+	std::vector<std::thread> threads;
+	for (std::uint64_t i = 0; i < producer_count; ++i) {
+		threads.emplace_back([&writer, i]() {
+			push_segments(writer.producer(i), i * segment_length, producer_count * segment_length, segment_length,
+			              end);
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	std::move(writer).finish().finish();
+
+	BOOST_REQUIRE_EQUAL(transitions.size(), end);
+	for (std::uint64_t i = 0; i < end; ++i)
+		BOOST_REQUIRE_EQUAL(transitions[i], i);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_multi_producer_to_sqlite)
+{
+	MultiProducerWriter writer(DbWriter::from_memory("TestMultiProducer", "1.0.0", "TestMultiProducer info"), 2);
+
+	// Closed producers do not hold the others, and the same transition may come from two producers
+	writer.producer(0).push(access_at(0));
+	writer.producer(1).push(access_at(0));
+	writer.producer(1).push(access_at(3));
+	writer.producer(0).push(access_at(5));
+	writer.producer(1).close();
+
+	auto db = std::move(writer).finish().take();
+	reven::sqlite::Statement stmt(db, "select transition from accesses order by transition;");
+	std::vector<std::uint64_t> transitions;
+	while (stmt.step() == reven::sqlite::Statement::StepResult::Row)
+		transitions.push_back(stmt.column_i64(0));
+	BOOST_CHECK((transitions == std::vector<std::uint64_t>{ 0, 0, 3, 5 }));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_multi_producer_finish_full_queue)
+{
+	std::vector<std::uint64_t> transitions;
+	MultiProducerWriter writer(DbWriter(std::make_unique<TransitionSink>(transitions)), 2);
+
+	// Fills the queue of the first producer, which cannot be merged before the second one, idle, is closed
+	constexpr std::uint64_t count = 16 * 4096 + 10;
+	for (std::uint64_t transition = 0; transition < count; ++transition)
+		writer.producer(0).push(access_at(transition));
+
+	std::move(writer).finish().finish();
+	BOOST_CHECK_EQUAL(transitions.size(), count);
+	BOOST_CHECK(std::is_sorted(transitions.begin(), transitions.end()));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_multi_producer_invalid)
+{
+	std::vector<std::uint64_t> transitions;
+	MultiProducerWriter writer(DbWriter(std::make_unique<TransitionSink>(transitions)), 1);
+	auto& producer = writer.producer(0);
+
+	producer.push(access_at(10));
+	BOOST_CHECK_THROW(producer.push(access_at(9)), std::invalid_argument);
+	BOOST_CHECK_THROW(producer.advance(5), std::invalid_argument);
+	producer.close();
+	BOOST_CHECK_THROW(producer.push(access_at(11)), std::logic_error);
+
+	BOOST_CHECK_THROW(MultiProducerWriter(DbWriter(std::make_unique<TransitionSink>(transitions)), 0),
+	                  std::invalid_argument);
+
+	std::move(writer).finish().finish();
+	BOOST_CHECK((transitions == std::vector<std::uint64_t>{ 10 }));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_multi_producer_destroyed)
+{
+	std::vector<std::uint64_t> transitions;
+	{
+		// An idle producer that never closes: destruction does not wait for it
+		MultiProducerWriter writer(DbWriter(std::make_unique<TransitionSink>(transitions)), 2);
+		writer.producer(0).push(access_at(1));
+		writer.producer(0).close();
+	}
+	BOOST_CHECK(transitions.empty());
+}
@@ -0,0 +1,144 @@
+#include <boost/test/unit_test.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+#include <sqlite3.h>
+
+#include <db_writer.h>
+#include <shards.h>
+
+using namespace reven::backend::memaccess::db;
+
+namespace {
+
+constexpr const char* test_tool_name = "TestShardedSink";
+constexpr const char* test_tool_version = "1.0.0";
+constexpr const char* test_tool_info = "TestShardedSink info";
+
+// One write per transition: with an access count limit of 5, there is one slice every 5 transitions.
+void push_accesses(DbWriter& writer, std::uint64_t count)
+{
+	for (std::uint64_t i = 0; i < count; ++i)
+		writer.push(MemoryAccess{ i, i * 100, 6666, 10, true, Operation::Write });
+}
+
+DbWriterOptions shard_options()
+{
+	DbWriterOptions options;
+	options.write_slice_limits.access_count_limit = 5;
+	options.deferred_indexes = true;
+	return options;
+}
+
+std::uint64_t query(const std::string& filename, const char* sql)
+{
+	sqlite3* db = nullptr;
+	BOOST_REQUIRE(sqlite3_open_v2(filename.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK);
+	sqlite3_stmt* stmt = nullptr;
+	BOOST_REQUIRE(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK);
+	BOOST_REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+	auto result = static_cast<std::uint64_t>(sqlite3_column_int64(stmt, 0));
+	sqlite3_finalize(stmt);
+	sqlite3_close(db);
+	return result;
+}
+
+// Manifest and shards removed at the end of the test
+struct TemporaryShards {
+	explicit TemporaryShards(const char* manifest) : manifest(manifest) {}
+	~TemporaryShards()
+	{
+		std::remove(manifest);
+		for (int i = 0; i < 16; ++i)
+			std::remove((std::string(manifest) + "." + std::to_string(i)).c_str());
+	}
+	const char* manifest;
+};
+
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_sharded_slice_limit)
+{
+	TemporaryShards files("test_db_writer_sharded_slice_limit.manifest");
+
+	auto options = shard_options();
+	options.shard_slice_limit = 3;
+	auto writer = DbWriter::sharded(files.manifest, test_tool_name, test_tool_version, test_tool_info, options);
+
+	// Readable right away
+	BOOST_CHECK(read_shard_manifest(files.manifest).empty());
+
+	push_accesses(writer, 40);
+	std::move(writer).finish();
+
+	auto shards = read_shard_manifest(files.manifest);
+	BOOST_REQUIRE_EQUAL(shards.size(), 3);
+	BOOST_CHECK_EQUAL(shards[0].filename, std::string(files.manifest) + ".0");
+
+	std::uint64_t accesses = 0;
+	std::uint64_t expected_slices[] = { 3, 3, 2 };
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		const auto& shard = shards[i];
+		BOOST_CHECK_EQUAL(query(shard.filename, "select count(*) from slices;"), expected_slices[i]);
+		BOOST_CHECK_EQUAL(query(shard.filename, "select min(transition_first) from slices;"), shard.transition_first);
+		BOOST_CHECK_EQUAL(query(shard.filename, "select max(transition_last) from slices;"), shard.transition_last);
+		BOOST_CHECK_EQUAL(query(shard.filename, "select count(*) from sqlite_master where type = 'index';"), 4);
+		if (i > 0)
+			BOOST_CHECK(shards[i - 1].transition_last < shard.transition_first);
+		accesses += query(shard.filename, "select count(*) from accesses;");
+	}
+	BOOST_CHECK_EQUAL(accesses, 40);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_sharded_transition_limit)
+{
+	TemporaryShards files("test_db_writer_sharded_transition_limit.manifest");
+
+	auto options = shard_options();
+	options.shard_transition_limit = 10;
+	options.async_flush_queue_depth = 1;
+	{
+		auto writer = DbWriter::sharded(files.manifest, test_tool_name, test_tool_version, test_tool_info, options);
+		push_accesses(writer, 32);
+	}
+
+	// Slices of 5 transitions, 2 per shard
+	auto shards = read_shard_manifest(files.manifest);
+	BOOST_REQUIRE_EQUAL(shards.size(), 4);
+	for (std::size_t i = 0; i < shards.size(); ++i) {
+		BOOST_CHECK_EQUAL(shards[i].transition_first, i * 10);
+		BOOST_CHECK_EQUAL(shards[i].transition_last, std::min<std::uint64_t>(i * 10 + 9, 31));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_sharded_remove_last)
+{
+	TemporaryShards files("test_db_writer_sharded_remove_last.manifest");
+
+	auto options = shard_options();
+	options.shard_slice_limit = 1;
+	auto writer = DbWriter::sharded(files.manifest, test_tool_name, test_tool_version, test_tool_info, options);
+	push_accesses(writer, 12);
+
+	// The first shard is completed once the second slice is written, the third slice is still open
+	BOOST_CHECK_THROW(writer.discard_after(4), std::invalid_argument);
+	writer.discard_after(7);
+	std::move(writer).finish();
+
+	auto shards = read_shard_manifest(files.manifest);
+	BOOST_REQUIRE_EQUAL(shards.size(), 2);
+	BOOST_CHECK_EQUAL(query(shards[0].filename, "select count(*) from accesses;"), 5);
+	BOOST_CHECK_EQUAL(query(shards[1].filename, "select count(*) from accesses;"), 2);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_sharded_invalid_manifest)
+{
+	const char* filename = "test_db_writer_sharded_invalid_manifest.manifest";
+	BOOST_CHECK_THROW(read_shard_manifest(filename), std::runtime_error);
+
+	std::ofstream(filename) << "rvnmemhistwriter shards 1.0.0\n0 10\n";
+	BOOST_CHECK_THROW(read_shard_manifest(filename), std::runtime_error);
+	std::remove(filename);
+}
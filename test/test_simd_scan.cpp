@@ -0,0 +1,45 @@
+#include <boost/test/unit_test.hpp>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "simd_scan.h"
+
+using namespace reven::backend::memaccess::db;
+
+namespace {
+
+// Sorted values with duplicates, spanning the whole range so that unsigned comparisons matter
+std::vector<std::uint64_t> sorted_values(std::uint64_t seed, std::size_t count)
+{
+	std::mt19937_64 rng(seed);
+	std::vector<std::uint64_t> values;
+	for (std::size_t i = 0; i < count; ++i)
+		values.push_back(rng() % 4 ? rng() : rng() % 64);
+	values.push_back(0);
+	values.push_back(~std::uint64_t(0));
+	std::sort(values.begin(), values.end());
+	return values;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_simd_sorted_bounds)
+{
+	// Sizes around the vector widths and the scan window
+	for (std::size_t count : { 0, 1, 2, 3, 5, 31, 32, 33, 100, 256 }) {
+		auto values = sorted_values(count, count);
+		std::vector<std::uint64_t> keys(values.begin(), values.end());
+		keys.push_back(1);
+		keys.push_back(~std::uint64_t(0) - 1);
+		keys.push_back(std::uint64_t(1) << 63);
+
+		for (auto key : keys) {
+			auto expected_lower = std::lower_bound(values.begin(), values.end(), key) - values.begin();
+			auto expected_upper = std::upper_bound(values.begin(), values.end(), key) - values.begin();
+			BOOST_CHECK_EQUAL(simd::lower_bound(values.data(), values.size(), key), expected_lower);
+			BOOST_CHECK_EQUAL(simd::upper_bound(values.data(), values.size(), key), expected_upper);
+		}
+	}
+}
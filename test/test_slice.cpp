@@ -43,6 +43,25 @@ BOOST_AUTO_TEST_CASE(test_db_writer_slice_builder_nominal)
 	BOOST_CHECK_EQUAL(slice.transition_last(), 100);
 }
 
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_builder_journal_index)
+{
+	SliceBuilder b;
+	BOOST_CHECK_EQUAL(b.insert(1, 10, 10)->journal_index, 0);
+	BOOST_CHECK_EQUAL(b.insert(2, 50, 10)->journal_index, 1);
+	BOOST_CHECK_EQUAL(b.insert(3, 12, 10, 42)->journal_index, 42);
+
+	auto slice = std::move(b).build();
+	BOOST_REQUIRE_EQUAL(slice.chunk_count(), 2);
+
+	// Accesses of the first chunk: the overlapping access absorbed the chunk it was inserted into
+	std::vector<JournalIndex> indices;
+	const auto& chunk = *slice.begin();
+	for (auto a = chunk.accesses(); a; a = chunk.next(a))
+		indices.push_back(a->journal_index);
+	std::vector<JournalIndex> expected = { 42, 0 };
+	BOOST_CHECK_EQUAL_COLLECTIONS(indices.begin(), indices.end(), expected.begin(), expected.end());
+}
+
 BOOST_AUTO_TEST_CASE(test_db_writer_slice_builder_wraparound)
 {
 	SliceBuilder b;
@@ -122,9 +141,96 @@ BOOST_AUTO_TEST_CASE(test_db_writer_slice_builder_limit_access_count_soft)
 	BOOST_CHECK_EQUAL(b.access_count(), 3);
 }
 
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_builder_contained)
+{
+	SliceBuilder b;
+	b.chunk_size_overlap_limit(3);
+	BOOST_CHECK(b.insert(1, 10, 10));
+	BOOST_CHECK(b.insert(1, 100, 10));
+	// Within the first chunk, which is not the last touched one anymore
+	BOOST_CHECK(b.insert(2, 12, 2));
+	// Within the last touched chunk
+	BOOST_CHECK(b.insert(3, 14, 2));
+	BOOST_CHECK(not b.insert(4, 15, 1)); // Overlap limit still applies
+	BOOST_CHECK(b.insert(3, 10, 10));    // But not on a transition already part of the slice
+	BOOST_CHECK(not b.insert(4, 500, 1));
+
+	BOOST_CHECK_EQUAL(b.access_count(), 5);
+	auto slice = std::move(b).build();
+	BOOST_REQUIRE_EQUAL(slice.chunk_count(), 2);
+	BOOST_CHECK_EQUAL(slice.begin()->size(), 4);
+	BOOST_CHECK_EQUAL(slice.begin()->address_first(), 10);
+	BOOST_CHECK_EQUAL(slice.begin()->address_last(), 19);
+	BOOST_CHECK_EQUAL(slice.transition_last(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_builder_limit_memory)
+{
+	SliceBuilder b;
+	BOOST_CHECK_EQUAL(b.memory_usage(), 0);
+	b.memory_limit(1);
+
+	BOOST_CHECK(b.insert(1, 10, 10));
+	BOOST_CHECK(b.memory_usage() > 0);
+	BOOST_CHECK(b.insert(1, 100, 10));     // Same transition: inserted anyway
+	BOOST_CHECK(not b.insert(2, 200, 10)); // New transition: refused
+}
+
 BOOST_AUTO_TEST_CASE(test_db_writer_slice_invalid_accesses)
 {
 	SliceBuilder b;
 	BOOST_CHECK_THROW(b.insert(0, 1, 0), std::invalid_argument);
 	BOOST_CHECK_THROW(b.insert(0, 0, 0), std::invalid_argument);
 }
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_builder_build_stats)
+{
+	SliceBuilder b;
+	BOOST_CHECK(b.insert(1, 10, 10));
+	BOOST_CHECK(b.insert(2, 15, 10)); // one overlap merge
+	BOOST_CHECK(b.insert(3, 30, 10));
+	BOOST_CHECK(b.insert(4, 25, 5));  // touches both, overlaps none
+	BOOST_CHECK(b.insert(5, 12, 2));  // contained
+
+	auto slice = std::move(b).build();
+	BOOST_CHECK_EQUAL(slice.chunk_count(), 1);
+	BOOST_CHECK_EQUAL(slice.build_stats().overlap_merges, 1);
+	BOOST_CHECK_EQUAL(slice.build_stats().touch_merges, 2);
+	BOOST_CHECK(slice.build_stats().limit == SliceLimit::None);
+
+	SliceBuilder limited;
+	limited.access_count_limit(1).transition_limit(2);
+	BOOST_CHECK(limited.insert(1, 10, 10));
+	BOOST_CHECK(not limited.insert(2, 100, 10));
+	BOOST_CHECK(not limited.insert(3, 100, 10));
+	BOOST_CHECK(std::move(limited).build().build_stats().limit == SliceLimit::AccessCount);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_builder_insert_policies)
+{
+	using Unlimited = InsertPolicy<false, true>;
+	using Unchecked = InsertPolicy<false, false>;
+
+	SliceBuilder checked, unlimited, unchecked;
+	for (auto* b : { &checked, &unlimited, &unchecked })
+		b->access_count_limit(2);
+
+	for (std::uint64_t i = 0; i < 4; ++i) {
+		bool inserted = checked.insert(i, 10 * i, 8, static_cast<JournalIndex>(i));
+		BOOST_CHECK_EQUAL(inserted, i < 2);
+		BOOST_CHECK(unlimited.insert<Unlimited>(i, 10 * i, 8, static_cast<JournalIndex>(i)));
+		BOOST_CHECK(unchecked.insert<Unchecked>(i, 8 * i + 4, FixedSize<8>(), static_cast<JournalIndex>(i)));
+	}
+
+	// Validation is independent of limits
+	BOOST_CHECK_THROW(unlimited.insert<Unlimited>(4, 1, 0, 4), std::invalid_argument);
+	BOOST_CHECK_THROW(unlimited.insert<Unlimited>(2, 1, FixedSize<1>(), 4), std::invalid_argument);
+
+	auto slice = std::move(unchecked).build();
+	BOOST_CHECK_EQUAL(slice.access_count(), 4);
+	BOOST_CHECK_EQUAL(slice.chunk_count(), 1); // touching
+	BOOST_CHECK_EQUAL(slice.begin()->address_first(), 4);
+	BOOST_CHECK_EQUAL(slice.begin()->address_last(), 35);
+	BOOST_CHECK(slice.build_stats().limit == SliceLimit::None);
+	BOOST_CHECK_EQUAL(std::move(unlimited).build().access_count(), 4);
+}
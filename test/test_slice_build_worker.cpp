@@ -0,0 +1,78 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdexcept>
+
+#include "slice_build_worker.h"
+
+using namespace reven::backend::memaccess::db;
+
+static std::unique_ptr<SliceBuilder> limited_builder()
+{
+	auto builder = std::make_unique<SliceBuilder>();
+	builder->access_count_limit(10);
+	return builder;
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_build_worker_nominal)
+{
+	SliceBuildWorker worker(16, limited_builder);
+	for (std::uint32_t i = 0; i < 5; ++i)
+		worker.insert(i, i * 100, 10, i);
+	worker.request_cut();
+
+	auto slice = worker.take_slice();
+	BOOST_CHECK_EQUAL(slice.access_count(), 5);
+	BOOST_CHECK_EQUAL(slice.transition_first(), 0);
+	BOOST_CHECK_EQUAL(slice.transition_last(), 4);
+	BOOST_CHECK(not worker.cut_requested());
+
+	// Next slice starts empty
+	worker.insert(10, 0, 10, 0);
+	worker.request_cut();
+	slice = worker.take_slice();
+	BOOST_CHECK_EQUAL(slice.access_count(), 1);
+	BOOST_CHECK_EQUAL(slice.transition_first(), 10);
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_build_worker_limit)
+{
+	SliceBuildWorker worker(16, limited_builder);
+	// Twice the limit: accesses are kept nonetheless
+	for (std::uint32_t i = 0; i < 20; ++i)
+		worker.insert(i, i * 100, 10, i);
+	worker.request_cut();
+
+	auto slice = worker.take_slice();
+	BOOST_CHECK_EQUAL(slice.access_count(), 20);
+	BOOST_CHECK(not worker.cut_requested());
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_build_worker_cut_requested)
+{
+	SliceBuildWorker worker(16, limited_builder);
+	for (std::uint32_t i = 0; i < 11; ++i)
+		worker.insert(i, i * 100, 10, i);
+
+	// The flag is raised asynchronously
+	while (not worker.cut_requested())
+		std::this_thread::yield();
+
+	worker.request_cut();
+	worker.take_slice();
+	BOOST_CHECK(not worker.cut_requested());
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_slice_build_worker_error)
+{
+	SliceBuildWorker worker(16, limited_builder);
+	worker.insert(5, 0, 10, 0);
+	worker.insert(4, 0, 10, 1); // going backward
+	worker.insert(6, 0, 10, 2);
+	worker.request_cut();
+	BOOST_CHECK_THROW(worker.take_slice(), std::invalid_argument);
+
+	// The worker can still be used
+	worker.insert(1, 0, 10, 0);
+	worker.request_cut();
+	BOOST_CHECK_EQUAL(worker.take_slice().access_count(), 1);
+}
@@ -0,0 +1,49 @@
+#include <boost/test/unit_test.hpp>
+
+#include <stdexcept>
+#include <thread>
+
+#include "spsc_queue.h"
+
+using namespace reven::backend::memaccess::db;
+
+BOOST_AUTO_TEST_CASE(test_db_writer_spsc_queue_bounds)
+{
+	BOOST_CHECK_THROW(SpscQueue<int>(3), std::invalid_argument);
+
+	SpscQueue<int> queue(4);
+	for (int i = 0; i < 4; ++i)
+		BOOST_CHECK(queue.try_push(i));
+	BOOST_CHECK(not queue.try_push(4));
+
+	int value;
+	BOOST_CHECK(queue.try_pop(value));
+	BOOST_CHECK_EQUAL(value, 0);
+	BOOST_CHECK(queue.try_push(4));
+	for (int i = 1; i < 5; ++i) {
+		BOOST_CHECK(queue.try_pop(value));
+		BOOST_CHECK_EQUAL(value, i);
+	}
+	BOOST_CHECK(not queue.try_pop(value));
+}
+
+BOOST_AUTO_TEST_CASE(test_db_writer_spsc_queue_threads)
+{
+	// Small queue, so that both sides wait on each other
+	SpscQueue<std::uint64_t> queue(16);
+	constexpr std::uint64_t count = 200000;
+
+	std::thread producer([&queue]() {
+		for (std::uint64_t i = 0; i < count; ++i)
+			queue.push(i);
+	});
+
+	bool ordered = true;
+	for (std::uint64_t i = 0; i < count; ++i) {
+		std::uint64_t value;
+		queue.pop(value);
+		ordered = ordered and value == i;
+	}
+	producer.join();
+	BOOST_CHECK(ordered);
+}